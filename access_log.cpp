@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <exception>
+
+#include "access_log.h"
+#include "log.h"
+
+access_log::access_log(const char *path, size_t records) :
+    m_fd(-1), m_map(NULL), m_map_size(0), m_header(NULL), m_records(NULL), m_capacity(records) {
+
+    static_assert(sizeof(header) == 64 && sizeof(access_record) == 32, "access log layout");
+    if(records == 0) {
+        throw std::exception();
+    }
+    m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd == -1) {
+        LOG_ERROR("open: %s", strerror(errno));
+        throw std::exception();
+    }
+    // 预先分配磁盘块，写记录时不会因为文件空洞而在缺页中分配
+    m_map_size = sizeof(header) + records * sizeof(access_record);
+    if(posix_fallocate(m_fd, 0, m_map_size) != 0 && ftruncate(m_fd, m_map_size) != 0) {
+        LOG_ERROR("ftruncate: %s", strerror(errno));
+        close(m_fd);
+        throw std::exception();
+    }
+    m_map = mmap(NULL, m_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if(m_map == MAP_FAILED) {
+        LOG_ERROR("mmap: %s", strerror(errno));
+        close(m_fd);
+        throw std::exception();
+    }
+    m_header = (header *)m_map;
+    m_records = (access_record *)((char *)m_map + sizeof(header));
+    memcpy(m_header->magic, "TWSALOG1", 8);
+    m_header->record_size = sizeof(access_record);
+    m_header->capacity = records;
+    m_header->next.store(0, std::memory_order_relaxed);
+}
+
+access_log::~access_log() {
+    msync(m_map, m_map_size, MS_ASYNC);
+    munmap(m_map, m_map_size);
+    close(m_fd);
+}
+
+void access_log::append(int fd, int status, uint64_t bytes, long long latency_ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t n = m_header->next.fetch_add(1, std::memory_order_relaxed);
+    access_record &rec = m_records[n % m_capacity];
+    rec.time_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    rec.fd = fd;
+    rec.status = status;
+    rec.reserved = 0;
+    rec.bytes = bytes;
+    rec.latency_us = latency_ns > 0 ? latency_ns / 1000 : 0;
+    rec.reserved2 = 0;
+}
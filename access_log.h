@@ -0,0 +1,52 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/*
+    二进制访问日志
+    每个应答一条定长记录，写进映射到内存的文件中：工作线程用原子加法领取一个位置后直接填写，
+    不加锁、不做系统调用，由内核在后台把脏页写回文件。文件写满后从头覆盖最旧的记录。
+    文件格式（小端）：
+        0   头部64字节：magic "TWSALOG1"、记录大小(uint32)、保留(uint32)、容量(uint64)、已写记录总数(uint64)
+        64  容量条access_record，第n条记录在下标n % 容量处
+    有效记录为最近的min(总数, 容量)条。进程运行中读取时，正在填写的记录可能不完整。
+*/
+struct access_record {
+    uint64_t time_us;    // 应答发送完的时间，CLOCK_REALTIME，微秒
+    int32_t fd;          // 连接的socket
+    uint16_t status;     // 状态码
+    uint16_t reserved;
+    uint64_t bytes;      // 应答的字节数，包括响应头
+    uint32_t latency_us; // 从工作线程开始处理到应答发送完的时间，微秒
+    uint32_t reserved2;
+};
+
+class access_log {
+public:
+    // 创建或者截断path，预留records条记录的空间，失败时抛出异常
+    access_log(const char *path, size_t records);
+    ~access_log();
+
+    void append(int fd, int status, uint64_t bytes, long long latency_ns);
+
+private:
+    struct header {
+        char magic[8];
+        uint32_t record_size;
+        uint32_t reserved;
+        uint64_t capacity;
+        std::atomic<uint64_t> next;
+        char pad[32];
+    };
+
+    int m_fd;
+    void *m_map;
+    size_t m_map_size;
+    header *m_header;
+    access_record *m_records;
+    uint64_t m_capacity;
+};
+
+#endif
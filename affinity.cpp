@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+#include "log.h"
+
+int parse_cpu_list(const char *text, int *cpus, int max_cpus) {
+    int count = 0;
+    const char *p = text;
+    while(*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if(*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first) {
+                return -1;
+            }
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; ++cpu) {
+            if(count >= max_cpus) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        if(*p == ',') {
+            ++p;
+        } else if(*p != '\0') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+bool pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+        LOG_WARN("无法将线程绑定到CPU %d", cpu);
+        return false;
+    }
+    return true;
+}
+
+int cpu_to_node(int cpu) {
+    // /sys/devices/system/cpu/cpuN/ 下有一个 nodeM 的链接
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(!dir) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+void *alloc_on_node(size_t size, int node) {
+    // 只保留虚拟地址，物理页在第一次访问时才分配
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(addr == MAP_FAILED) {
+        return NULL;
+    }
+    if(node >= 0 && node < (int)(sizeof(unsigned long) * 8)) {
+        // 优先从指定节点分配，节点内存不足时退回其他节点
+        unsigned long mask = 1UL << node;
+        if(syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+            LOG_WARN("mbind: %s", strerror(errno));
+        }
+    }
+    return addr;
+}
+
+void free_on_node(void *addr, size_t size) {
+    if(addr) {
+        munmap(addr, size);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+#include <pthread.h>
+#include <stddef.h>
+
+// 线程绑核与NUMA内存放置的辅助函数，不依赖libnuma
+
+#define MAX_CPU_LIST 1024 // CPU列表中最多的CPU个数
+
+// 解析形如 "0-3,8,10-11" 的CPU列表，返回CPU个数，格式错误返回-1
+int parse_cpu_list(const char *text, int *cpus, int max_cpus);
+
+// 把线程绑定到指定CPU上
+bool pin_thread(pthread_t thread, int cpu);
+
+// 查询CPU所在的NUMA节点，查询不到返回-1
+int cpu_to_node(int cpu);
+
+// 分配按需分页的内存，node不小于0时优先从该NUMA节点分配物理页，失败返回NULL
+void *alloc_on_node(size_t size, int node);
+
+// 释放alloc_on_node分配的内存
+void free_on_node(void *addr, size_t size);
+
+#endif
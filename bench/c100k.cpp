@@ -0,0 +1,244 @@
+/*
+    空闲长连接的内存测试
+    建立大量长连接，每条连接发送一个带Connection: keep-alive的请求并收完响应，之后保持空闲，
+    读取服务器进程建立连接前后的常驻内存（/proc/pid/status中的VmRSS），输出平均每条连接占用的内存。
+    测量的是服务器用户态的内存，socket本身的内核内存不在其中。
+    连接数超过本机临时端口数（默认约28000个）时用-s把源地址分散到127.0.0.2开始的多个回环地址上。
+    客户端和服务器都需要足够的文件描述符（ulimit -n），服务器会自动把软限制提高到硬限制。
+    编译：g++ -O2 bench/c100k.cpp -o c100k.out
+    运行：./c100k.out -P 服务器pid [-c 连接数] [-s 源地址个数] [-d 保持秒数] [-u 路径] ip port
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_EVENT_NUMBER 1024
+#define MAX_CONNECTING 1024 // 同时在建立中的连接数，避免监听队列溢出
+
+// 单条连接的状态
+struct idle_conn {
+    int sockfd;
+    int state;         // 0 连接中，1 等待响应，2 空闲
+    long long body_left; // 响应体还没收到的字节数，-1表示还在读响应头
+    int header_len;
+    char header[1024];
+};
+
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// 服务器进程的常驻内存，单位KB
+static long read_rss(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if(!fp) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while(fgets(line, sizeof(line), fp)) {
+        if(strncmp(line, "VmRSS:", 6) == 0) {
+            rss = atol(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+// 读取响应，返回1表示收完，0表示还没有收完，-1表示出错
+static int recv_response(idle_conn *c) {
+    char buf[4096];
+    while(true) {
+        int n = recv(c->sockfd, buf, sizeof(buf), 0);
+        if(n == -1) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        if(n == 0) {
+            return -1;
+        }
+        int pos = 0;
+        if(c->body_left < 0) {
+            while(pos < n && c->header_len < (int)sizeof(c->header) - 1) {
+                c->header[c->header_len++] = buf[pos++];
+                if(c->header_len >= 4 && memcmp(c->header + c->header_len - 4, "\r\n\r\n", 4) == 0) {
+                    break;
+                }
+            }
+            c->header[c->header_len] = '\0';
+            if(c->header_len < 4 || strcmp(c->header + c->header_len - 4, "\r\n\r\n") != 0) {
+                if(c->header_len >= (int)sizeof(c->header) - 1) {
+                    return -1;
+                }
+                continue;
+            }
+            char *cl = strcasestr(c->header, "Content-Length:");
+            c->body_left = cl ? atoll(cl + 15) : 0;
+        }
+        c->body_left -= n - pos;
+        if(c->body_left <= 0) {
+            return 1;
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s -P server_pid [-c connections] [-s source_addresses] [-d seconds] [-u path] ip port\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int conn_number = 10000;
+    int source_number = 0;
+    int duration = 0;
+    int pid = 0;
+    const char *path = "/index.html";
+    int opt;
+    while((opt = getopt(argc, argv, "P:c:s:d:u:")) != -1) {
+        switch(opt) {
+            case 'P': pid = atoi(optarg); break;
+            case 'c': conn_number = atoi(optarg); break;
+            case 's': source_number = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'u': path = optarg; break;
+            default:
+                usage(basename(argv[0]));
+                return 1;
+        }
+    }
+    if(argc - optind < 2 || pid <= 0 || conn_number <= 0 || source_number < 0 || source_number > 250) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur != RLIM_INFINITY && (long long)rl.rlim_cur < conn_number + 16) {
+        printf("文件描述符上限为%lld，不够%d个连接\n", (long long)rl.rlim_cur, conn_number);
+        return 1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    inet_pton(AF_INET, argv[optind], &address.sin_addr);
+    address.sin_port = htons(atoi(argv[optind + 1]));
+    char request[1024];
+    int request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nConnection: keep-alive\r\nHost: %s\r\n\r\n", path, argv[optind]);
+
+    long rss_before = read_rss(pid);
+    if(rss_before < 0) {
+        printf("无法读取进程%d的内存\n", pid);
+        return 1;
+    }
+
+    idle_conn *cs = new idle_conn[conn_number];
+    int epollfd = epoll_create(5);
+    epoll_event events[MAX_EVENT_NUMBER];
+    int opened = 0, pending = 0, idle = 0, errors = 0;
+    long long begin = now_ms();
+    while(idle + errors < conn_number) {
+        // 限制同时在建立和等待响应的连接数
+        while(opened < conn_number && pending < MAX_CONNECTING) {
+            idle_conn *c = cs + opened++;
+            c->state = 0;
+            c->body_left = -1;
+            c->header_len = 0;
+            c->sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if(c->sockfd == -1) {
+                ++errors;
+                continue;
+            }
+            if(source_number > 0) {
+                struct sockaddr_in local;
+                memset(&local, 0, sizeof(local));
+                local.sin_family = AF_INET;
+                local.sin_addr.s_addr = htonl(0x7f000002 + opened % source_number);
+                bind(c->sockfd, (struct sockaddr*)&local, sizeof(local));
+            }
+            if(connect(c->sockfd, (struct sockaddr*)&address, sizeof(address)) == -1 && errno != EINPROGRESS) {
+                close(c->sockfd);
+                c->sockfd = -1;
+                ++errors;
+                continue;
+            }
+            epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.ptr = c;
+            epoll_ctl(epollfd, EPOLL_CTL_ADD, c->sockfd, &ev);
+            ++pending;
+        }
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, 1000);
+        if(num == 0 && now_ms() - begin > 60000) {
+            printf("超时，%d个连接没有完成\n", pending);
+            break;
+        }
+        for(int i = 0; i < num; ++i) {
+            idle_conn *c = (idle_conn *)events[i].data.ptr;
+            int ret;
+            if(c->state == 0) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+                ret = err == 0 && send(c->sockfd, request, request_len, 0) == request_len ? 0 : -1;
+                if(ret == 0) {
+                    c->state = 1;
+                    epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->sockfd, &ev);
+                }
+            } else {
+                ret = recv_response(c);
+            }
+            if(ret == 1) {
+                // 之后不再关心这条连接上的事件
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c->sockfd, 0);
+                c->state = 2;
+                ++idle;
+                --pending;
+            } else if(ret == -1) {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c->sockfd, 0);
+                close(c->sockfd);
+                c->sockfd = -1;
+                ++errors;
+                --pending;
+            }
+        }
+    }
+    double seconds = (now_ms() - begin) / 1e3;
+
+    // 等服务器处理完最后的事件、工作线程还回缓冲区
+    sleep(1);
+    long rss_after = read_rss(pid);
+    printf("空闲连接：%d个，失败%d个，用时%.2fs\n", idle, errors, seconds);
+    printf("服务器常驻内存：%ldKB -> %ldKB，平均每个连接%.0f字节\n", rss_before, rss_after,
+        idle > 0 ? (rss_after - rss_before) * 1024.0 / idle : 0.0);
+
+    if(duration > 0) {
+        sleep(duration);
+    }
+    for(int i = 0; i < conn_number && i < opened; ++i) {
+        if(cs[i].sockfd != -1) {
+            close(cs[i].sockfd);
+        }
+    }
+    close(epollfd);
+    delete []cs;
+    return 0;
+}
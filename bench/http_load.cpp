@@ -0,0 +1,634 @@
+/*
+    HTTP压测工具
+    每个线程拥有一个epoll实例和若干条连接，压测结束后输出每秒请求数和延迟分位数。
+    闭环模式（默认）：连接上收到一个完整响应后立即发送下一个请求。
+    开环模式（-R 每秒请求数）：请求按固定速率排定发送时间，和服务器有多快无关；
+        连接都忙时到期的请求排队等待，延迟从排定的时间算起，服务器变慢期间本该发出的请求也被计入，
+        避免闭环测量中的协调遗漏（coordinated omission）。
+    -a 为短连接模式：每个请求都新建连接并带上Connection: close，延迟包括建立连接，另外输出每秒接受的连接数。
+    -p 为流水线深度：每条连接上最多同时有这么多个请求在途。
+    -f 回放记录下来的请求：文件中以/开头的行是一个GET的路径，其余是原样记录的请求头，请求之间用空行分隔
+        （例如浏览器请求baowen.txt），依次循环发送。记录中的Connection头被替换，请求体不回放。
+    -j 输出一行JSON，便于回归对比；-n 为JSON中的场景名。
+    编译：g++ -O2 bench/http_load.cpp -pthread -o http_load.out
+    运行：./http_load.out [-a] [-p 深度] [-t 线程数] [-c 连接数] [-d 秒数] [-R 每秒请求数] [-u 路径 | -f 请求文件] [-j] [-n 场景名] ip port
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+
+#define MAX_THREAD 256
+#define MAX_EVENT_NUMBER 1024
+#define RESPONSE_BUFFER_SIZE 4096
+#define MAX_DEPTH 1024
+
+// 延迟直方图：每个2的幂区间分成32个桶，相对误差约3%，单位纳秒
+#define SUB_BITS 5
+#define MAX_BITS 40
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) << SUB_BITS)
+
+// 压测参数
+static struct sockaddr_in server_address;
+static int thread_number = 1;
+static int conn_number = 64;
+static int duration = 10;
+static int pipeline_depth = 1;
+static bool short_conn = false;
+static double target_rate = 0; // 开环模式的总速率，0为闭环
+static std::vector<std::string> requests; // 依次发送的请求
+static size_t max_request_len = 0;
+static volatile bool stop_load = false;
+
+enum CONN_STATE { DISCONNECTED = 0, CONNECTING, CONNECTED };
+
+// 单条连接的状态
+struct load_conn {
+    int sockfd;
+    int state;
+    char *out;         // 待发送的请求，容量为流水线深度个最长的请求
+    int out_len;
+    int out_off;
+    long long *starts; // 在途请求的开始时间，按发送顺序排列
+    int inflight_head;
+    int inflight;
+    long long body_left; // 当前响应还未收到的响应体字节数，-1表示还在读响应头
+    int header_len;    // 已缓存的响应头字节数
+    char header[RESPONSE_BUFFER_SIZE];
+};
+
+// 每个线程的统计结果
+struct load_result {
+    long long requests;
+    long long connections; // 成功建立的连接数
+    long long errors;
+    long long status[6];   // 按状态码的百位计数
+    long long late;        // 开环模式下结束时还没能发出的请求
+    long long buckets[BUCKETS];
+};
+
+// 每个线程的上下文
+struct load_thread {
+    int id;
+    int epollfd;
+    int timerfd;       // 开环模式下在下一个请求到期时唤醒epoll_wait
+    load_conn *conns;
+    int conn_count;
+    size_t next_request;
+    load_result *result;
+};
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long value) {
+    if(value < (1u << SUB_BITS)) {
+        return value;
+    }
+    int e = 63 - __builtin_clzll(value);
+    if(e >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    int sub = (value >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+    return ((e - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+// 桶的上界
+static unsigned long long bucket_upper(int bucket) {
+    if(bucket < (1 << SUB_BITS)) {
+        return bucket;
+    }
+    int e = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    unsigned long long sub = bucket & ((1 << SUB_BITS) - 1);
+    return (((1ULL << SUB_BITS) + sub) << (e - SUB_BITS)) + (1ULL << (e - SUB_BITS)) - 1;
+}
+
+static unsigned long long percentile(const long long *buckets, long long total, double q) {
+    if(total == 0) {
+        return 0;
+    }
+    long long rank = (long long)(q * total);
+    if(rank >= total) {
+        rank = total - 1;
+    }
+    long long seen = 0;
+    for(int i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i];
+        if(seen > rank) {
+            return bucket_upper(i);
+        }
+    }
+    return bucket_upper(BUCKETS - 1);
+}
+
+// 把一个原样记录的请求头改成本次压测要用的：换行统一为\r\n，去掉Connection头再加上自己的
+static std::string rewrite_request(const std::string &raw, const char *connection) {
+    std::string out;
+    size_t pos = 0;
+    bool first = true;
+    while(pos < raw.size()) {
+        size_t end = raw.find('\n', pos);
+        if(end == std::string::npos) {
+            end = raw.size();
+        }
+        std::string line = raw.substr(pos, end - pos);
+        pos = end + 1;
+        if(!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        if(line.empty()) {
+            continue;
+        }
+        if(!first && strncasecmp(line.c_str(), "Connection:", 11) == 0) {
+            continue;
+        }
+        out += line;
+        out += "\r\n";
+        first = false;
+    }
+    out += "Connection: ";
+    out += connection;
+    out += "\r\n\r\n";
+    return out;
+}
+
+// 读取请求文件，返回读到的请求数
+static int load_trace(const char *file, const char *host, const char *connection) {
+    FILE *fp = fopen(file, "r");
+    if(!fp) {
+        return -1;
+    }
+    std::string block;
+    char line[8192];
+    bool more = true;
+    while(more) {
+        more = fgets(line, sizeof(line), fp) != NULL;
+        bool blank = !more || line[0] == '\n' || (line[0] == '\r' && line[1] == '\n');
+        if(more && line[0] == '/') {
+            // 只有路径的行
+            line[strcspn(line, "\r\n")] = '\0';
+            char buf[10000];
+            snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", line, host, connection);
+            requests.push_back(buf);
+            continue;
+        }
+        if(blank) {
+            if(!block.empty()) {
+                requests.push_back(rewrite_request(block, connection));
+                block.clear();
+            }
+            continue;
+        }
+        block += line;
+    }
+    fclose(fp);
+    return requests.size();
+}
+
+// 发起非阻塞连接并注册到epoll上，连接完成后会触发EPOLLOUT
+static bool connect_server(load_thread *t, load_conn *c) {
+    c->body_left = -1;
+    c->header_len = 0;
+    c->state = CONNECTING;
+    c->sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(c->sockfd == -1) {
+        c->state = DISCONNECTED;
+        return false;
+    }
+    int nodelay = 1;
+    setsockopt(c->sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if(connect(c->sockfd, (struct sockaddr*)&server_address, sizeof(server_address)) == -1
+        && errno != EINPROGRESS) {
+        close(c->sockfd);
+        c->sockfd = -1;
+        c->state = DISCONNECTED;
+        return false;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(t->epollfd, EPOLL_CTL_ADD, c->sockfd, &ev);
+    return true;
+}
+
+// 关闭连接，在途和没发出去的请求都作废
+static void close_server(load_thread *t, load_conn *c) {
+    if(c->sockfd != -1) {
+        epoll_ctl(t->epollfd, EPOLL_CTL_DEL, c->sockfd, 0);
+        close(c->sockfd);
+        c->sockfd = -1;
+    }
+    c->state = DISCONNECTED;
+    c->out_len = c->out_off = 0;
+    c->inflight = 0;
+}
+
+// 发送缓存的请求，返回false表示连接出错
+static bool flush_requests(load_conn *c) {
+    while(c->out_off < c->out_len) {
+        int n = send(c->sockfd, c->out + c->out_off, c->out_len - c->out_off, 0);
+        if(n == -1) {
+            return errno == EAGAIN;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return true;
+}
+
+// 连接上还能再发一个请求
+static bool has_room(load_conn *c) {
+    if(short_conn) {
+        return c->state == DISCONNECTED;
+    }
+    return c->state != DISCONNECTED && c->inflight < pipeline_depth;
+}
+
+// 在连接上发出下一个请求，start为计算延迟的起点，返回false表示连接出错
+static bool issue(load_thread *t, load_conn *c, long long start) {
+    if(c->state == DISCONNECTED && !connect_server(t, c)) {
+        return false;
+    }
+    const std::string &req = requests[t->next_request];
+    t->next_request = (t->next_request + 1) % requests.size();
+    memcpy(c->out + c->out_len, req.data(), req.size());
+    c->out_len += req.size();
+    c->starts[(c->inflight_head + c->inflight) % pipeline_depth] = start;
+    ++c->inflight;
+    return c->state != CONNECTED || flush_requests(c);
+}
+
+// 读取响应，返回完成的响应个数，-1表示连接出错
+static int recv_response(load_thread *t, load_conn *c) {
+    char buf[RESPONSE_BUFFER_SIZE];
+    int done = 0;
+    load_result *result = t->result;
+    while(true) {
+        int n = recv(c->sockfd, buf, sizeof(buf), 0);
+        if(n == -1) {
+            return errno == EAGAIN ? done : -1;
+        }
+        if(n == 0) {
+            return -1;
+        }
+        int pos = 0;
+        while(pos < n) {
+            if(c->body_left < 0) {
+                // 缓存响应头，直到遇到空行
+                while(pos < n && c->header_len < RESPONSE_BUFFER_SIZE - 1) {
+                    c->header[c->header_len++] = buf[pos++];
+                    if(c->header_len >= 4 && memcmp(c->header + c->header_len - 4, "\r\n\r\n", 4) == 0) {
+                        break;
+                    }
+                }
+                c->header[c->header_len] = '\0';
+                if(c->header_len < 4 || strcmp(c->header + c->header_len - 4, "\r\n\r\n") != 0) {
+                    if(c->header_len >= RESPONSE_BUFFER_SIZE - 1) {
+                        return -1;
+                    }
+                    continue;
+                }
+                char *cl = strcasestr(c->header, "Content-Length:");
+                c->body_left = cl ? atoll(cl + 15) : 0;
+            }
+            long long take = n - pos;
+            if(take > c->body_left) {
+                take = c->body_left;
+            }
+            pos += take;
+            c->body_left -= take;
+            if(c->body_left == 0) {
+                // 一个完整的响应
+                if(c->inflight == 0) {
+                    return -1;
+                }
+                long long latency = now_ns() - c->starts[c->inflight_head];
+                c->inflight_head = (c->inflight_head + 1) % pipeline_depth;
+                --c->inflight;
+                ++result->buckets[bucket_of(latency > 0 ? latency : 0)];
+                int status = c->header_len > 12 ? atoi(c->header + 9) / 100 : 0;
+                ++result->status[status >= 1 && status <= 5 ? status : 0];
+                ++done;
+                c->body_left = -1;
+                c->header_len = 0;
+                if(short_conn) {
+                    // 短连接模式下一个连接只发一个请求
+                    return done;
+                }
+            }
+        }
+    }
+}
+
+// 开环模式下把到期的请求分给有空位的连接，返回下一个请求到期的时间
+static long long dispatch_due(load_thread *t, long long begin, long long interval, long long &issued, int &cursor) {
+    long long now = now_ns();
+    long long due = (now - begin) / interval + 1;
+    while(issued < due) {
+        // 从上次的位置开始找一个有空位的连接
+        int i = 0;
+        for(; i < t->conn_count && !has_room(t->conns + cursor); ++i) {
+            cursor = (cursor + 1) % t->conn_count;
+        }
+        if(i == t->conn_count) {
+            // 所有连接都忙，到期的请求继续排队，它们的延迟仍然从排定的时间算起
+            break;
+        }
+        load_conn *c = t->conns + cursor;
+        if(!issue(t, c, begin + issued * interval)) {
+            ++t->result->errors;
+            close_server(t, c);
+            if(!short_conn) {
+                connect_server(t, c);
+            }
+        }
+        ++issued;
+        cursor = (cursor + 1) % t->conn_count;
+    }
+    return begin + issued * interval;
+}
+
+static void* load_worker(void *arg) {
+    load_thread *t = (load_thread *)arg;
+    load_result *result = t->result;
+    t->conn_count = conn_number / thread_number + (t->id < conn_number % thread_number ? 1 : 0);
+    t->conns = new load_conn[t->conn_count];
+    t->epollfd = epoll_create(5);
+    t->next_request = t->id % requests.size();
+    epoll_event events[MAX_EVENT_NUMBER];
+    bool open_loop = target_rate > 0;
+    // 每个线程负责总速率的一份
+    long long interval = open_loop ? (long long)(1e9 * thread_number / target_rate) : 0;
+    if(open_loop && interval <= 0) {
+        interval = 1;
+    }
+    long long begin = now_ns();
+    long long issued = 0;
+    int cursor = 0;
+    t->timerfd = -1;
+    if(open_loop) {
+        // epoll_wait的超时只精确到毫秒，请求间隔通常短得多，用timerfd按纳秒唤醒，不必空转
+        t->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(t->epollfd, EPOLL_CTL_ADD, t->timerfd, &ev);
+    }
+
+    for(int i = 0; i < t->conn_count; ++i) {
+        load_conn *c = t->conns + i;
+        c->sockfd = -1;
+        c->state = DISCONNECTED;
+        c->out = new char[pipeline_depth * max_request_len];
+        c->out_len = c->out_off = 0;
+        c->starts = new long long[pipeline_depth];
+        c->inflight_head = c->inflight = 0;
+        if(open_loop) {
+            // 长连接先建立好，请求到期时再发
+            if(!short_conn && !connect_server(t, c)) {
+                ++result->errors;
+            }
+            continue;
+        }
+        for(int d = 0; d < pipeline_depth; ++d) {
+            if(!issue(t, c, now_ns())) {
+                ++result->errors;
+                close_server(t, c);
+                break;
+            }
+        }
+    }
+
+    while(!stop_load) {
+        if(open_loop) {
+            // 所有连接都忙时不设定时器，等有响应回来再分派
+            long long next = dispatch_due(t, begin, interval, issued, cursor);
+            if(next > now_ns()) {
+                struct itimerspec its;
+                memset(&its, 0, sizeof(its));
+                its.it_value.tv_sec = next / 1000000000LL;
+                its.it_value.tv_nsec = next % 1000000000LL;
+                timerfd_settime(t->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+            }
+        }
+        int num = epoll_wait(t->epollfd, events, MAX_EVENT_NUMBER, 100);
+        for(int i = 0; i < num; ++i) {
+            load_conn *c = (load_conn *)events[i].data.ptr;
+            if(!c) {
+                uint64_t expirations;
+                ssize_t ret = read(t->timerfd, &expirations, sizeof(expirations));
+                (void)ret;
+                continue;
+            }
+            if(c->state == CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0 || !(events[i].events & EPOLLOUT)) {
+                    ++result->errors;
+                    close_server(t, c);
+                    if(!open_loop) {
+                        issue(t, c, now_ns());
+                    } else if(!short_conn) {
+                        connect_server(t, c);
+                    }
+                    continue;
+                }
+                // 连接建立完成，之后只关心读事件，发送缓冲区满时再关心写事件
+                c->state = CONNECTED;
+                ++result->connections;
+                epoll_event ev;
+                ev.events = EPOLLIN;
+                ev.data.ptr = c;
+                epoll_ctl(t->epollfd, EPOLL_CTL_MOD, c->sockfd, &ev);
+                if(!flush_requests(c)) {
+                    ++result->errors;
+                    close_server(t, c);
+                    if(!open_loop) {
+                        issue(t, c, now_ns());
+                    }
+                }
+                continue;
+            }
+            int done = recv_response(t, c);
+            if(done > 0) {
+                result->requests += done;
+            }
+            if(done < 0 || (short_conn && done > 0)) {
+                // 连接出错或者短连接的请求已完成
+                if(done < 0) {
+                    ++result->errors;
+                }
+                close_server(t, c);
+                if(open_loop) {
+                    // 短连接等下一个到期的请求再连接
+                    if(!short_conn && !connect_server(t, c)) {
+                        ++result->errors;
+                    }
+                    continue;
+                }
+                for(int d = 0; d < pipeline_depth; ++d) {
+                    if(!issue(t, c, now_ns())) {
+                        ++result->errors;
+                        close_server(t, c);
+                        break;
+                    }
+                }
+                continue;
+            }
+            if(!open_loop) {
+                // 闭环：收到几个响应就补发几个请求，保持流水线深度
+                for(int d = 0; d < done; ++d) {
+                    if(!issue(t, c, now_ns())) {
+                        ++result->errors;
+                        close_server(t, c);
+                        issue(t, c, now_ns());
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    if(open_loop) {
+        long long due = (now_ns() - begin) / interval + 1;
+        result->late = due > issued ? due - issued : 0;
+    }
+
+    for(int i = 0; i < t->conn_count; ++i) {
+        if(t->conns[i].sockfd != -1) {
+            close(t->conns[i].sockfd);
+        }
+        delete[] t->conns[i].out;
+        delete[] t->conns[i].starts;
+    }
+    if(t->timerfd != -1) {
+        close(t->timerfd);
+    }
+    close(t->epollfd);
+    delete []t->conns;
+    return result;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-a] [-p depth] [-t threads] [-c connections] [-d seconds] [-R rate] [-u path | -f trace] [-j] [-n name] ip port\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char *path = "/index.html";
+    const char *trace = NULL;
+    const char *name = "";
+    bool json = false;
+    int opt;
+    while((opt = getopt(argc, argv, "ap:t:c:d:u:R:f:jn:")) != -1) {
+        switch(opt) {
+            case 'a': short_conn = true; break;
+            case 'p': pipeline_depth = atoi(optarg); break;
+            case 't': thread_number = atoi(optarg); break;
+            case 'c': conn_number = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'u': path = optarg; break;
+            case 'R': target_rate = atof(optarg); break;
+            case 'f': trace = optarg; break;
+            case 'j': json = true; break;
+            case 'n': name = optarg; break;
+            default: break;
+        }
+    }
+    if(argc - optind < 2 || thread_number <= 0 || thread_number > MAX_THREAD || conn_number < thread_number
+        || pipeline_depth <= 0 || pipeline_depth > MAX_DEPTH || target_rate < 0) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    if(short_conn) {
+        pipeline_depth = 1;
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    inet_pton(AF_INET, argv[optind], &server_address.sin_addr);
+    server_address.sin_port = htons(atoi(argv[optind + 1]));
+    const char *connection = short_conn ? "close" : "keep-alive";
+    if(trace) {
+        if(load_trace(trace, argv[optind], connection) <= 0) {
+            printf("无法从%s读取请求\n", trace);
+            return 1;
+        }
+    } else {
+        char request[1024];
+        snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nConnection: %s\r\nHost: %s\r\n\r\n",
+            path, connection, argv[optind]);
+        requests.push_back(request);
+    }
+    for(size_t i = 0; i < requests.size(); ++i) {
+        if(requests[i].size() > max_request_len) {
+            max_request_len = requests[i].size();
+        }
+    }
+
+    pthread_t threads[MAX_THREAD];
+    load_thread contexts[MAX_THREAD];
+    load_result *results = new load_result[thread_number];
+    memset(results, 0, sizeof(load_result) * thread_number);
+    long long begin = now_ns();
+    for(int i = 0; i < thread_number; ++i) {
+        contexts[i].id = i;
+        contexts[i].result = results + i;
+        pthread_create(threads + i, NULL, load_worker, contexts + i);
+    }
+    sleep(duration);
+    stop_load = true;
+    load_result total;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < thread_number; ++i) {
+        pthread_join(threads[i], NULL);
+        total.requests += results[i].requests;
+        total.connections += results[i].connections;
+        total.errors += results[i].errors;
+        total.late += results[i].late;
+        for(int s = 0; s < 6; ++s) {
+            total.status[s] += results[i].status[s];
+        }
+        for(int b = 0; b < BUCKETS; ++b) {
+            total.buckets[b] += results[i].buckets[b];
+        }
+    }
+    double seconds = (now_ns() - begin) / 1e9;
+    double p50 = percentile(total.buckets, total.requests, 0.5) / 1e3;
+    double p99 = percentile(total.buckets, total.requests, 0.99) / 1e3;
+    double p999 = percentile(total.buckets, total.requests, 0.999) / 1e3;
+    double max = percentile(total.buckets, total.requests, 1.0) / 1e3;
+    if(json) {
+        printf("{\"name\":\"%s\",\"mode\":\"%s\",\"rate\":%.0f,\"threads\":%d,\"connections\":%d,\"depth\":%d,"
+            "\"keepalive\":%s,\"requests\":%lld,\"errors\":%lld,\"late\":%lld,\"non_2xx\":%lld,\"seconds\":%.2f,"
+            "\"rps\":%.0f,\"conn_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+            name, target_rate > 0 ? "open" : "closed", target_rate, thread_number, conn_number, pipeline_depth,
+            short_conn ? "false" : "true", total.requests, total.errors, total.late, total.requests - total.status[2],
+            seconds, total.requests / seconds, total.connections / seconds, p50, p99, p999, max);
+    } else {
+        printf("requests: %lld, connections: %lld, errors: %lld, time: %.2fs, rps: %.0f, conn/s: %.0f\n",
+            total.requests, total.connections, total.errors, seconds, total.requests / seconds, total.connections / seconds);
+        printf("latency: p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus", p50, p99, p999, max);
+        if(target_rate > 0) {
+            printf(", %lld requests still due at the end", total.late);
+        }
+        printf("\nstatus: 2xx %lld, 3xx %lld, 4xx %lld, 5xx %lld, other %lld\n", total.status[2], total.status[3],
+            total.status[4], total.status[5], total.status[0] + total.status[1]);
+    }
+    delete[] results;
+    return 0;
+}
@@ -0,0 +1,480 @@
+/*
+    组件级微基准测试
+    不经过socket，直接驱动服务器中最耗CPU的几个部件，输出每次操作的纳秒数和内存分配次数：
+        parse_line、parse_request      对内存中的请求逐行切分、解析请求行和请求头（http_conn_probe驱动私有函数）
+        process_read                   解析并在文件缓存、元数据缓存中找到目标文件
+        header_200、response_404       生成200的响应头、预先生成好的404应答
+        request_cycle                  工作线程处理一个请求的全部步骤：解析、找文件、生成应答、释放这一批的资源
+        invalidate_race/304、/416      另一个线程不停地让目标文件的缓存失效，同时处理304和416的请求，
+                                       检查状态码和应答中的ETag，用-fsanitize=address编译时还能发现释放后使用
+        threadpool_handoff             交给线程池一个任务并等到它开始执行的往返时间
+        threadpool_throughput          一个线程连续追加、两个工作线程执行，每个任务的平均开销
+        timer_adjust/add_cancel/tick   时间轮中有1万、10万、100万个定时器时重新设置、添加并取消、推进一个滴答
+    每个测试先用少量次数试跑，再把次数加倍直到运行时间超过-t毫秒，结果取最后一次。
+    内存分配次数通过替换malloc系列函数统计（依赖glibc的__libc_malloc），所有线程的分配都计入，
+    用-fsanitize=address编译时不统计。
+    编译：g++ -O2 -I. bench/micro_bench.cpp $(ls *.cpp | grep -v main.cpp) -pthread -lz -o micro_bench.out
+    运行：./micro_bench.out [-t 毫秒] [-f 名字中的子串] [-d 网页根目录]，在仓库根目录运行时根目录默认为resources
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sched.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "http_conn.h"
+#include "threadpool.h"
+#include "timer_wheel.h"
+
+static std::atomic<long long> alloc_count(0);
+
+// 替换glibc的malloc系列函数，只计数，实际分配仍由glibc完成。
+// AddressSanitizer要接管分配才能发现释放后使用，这时不替换，分配次数都显示为0
+#ifndef __SANITIZE_ADDRESS__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    void *p = __libc_memalign(alignment, size);
+    if(!p) {
+        return ENOMEM;
+    }
+    *out = p;
+    return 0;
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+}
+#endif
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long min_time_ns = 200000000LL;
+static const char *filter = NULL;
+
+// 把次数加倍直到一次运行超过min_time_ns，fn(n)执行n次操作
+template<typename F>
+static void run(const char *name, F fn) {
+    if(filter && !strstr(name, filter)) {
+        return;
+    }
+    long long n = 16;
+    while(true) {
+        long long allocs = alloc_count.load(std::memory_order_relaxed);
+        long long begin = now_ns();
+        fn(n);
+        long long elapsed = now_ns() - begin;
+        allocs = alloc_count.load(std::memory_order_relaxed) - allocs;
+        if(elapsed >= min_time_ns || n >= (1LL << 40)) {
+            printf("%-36s %12.1f ns/op %10.3f allocs/op %12lld ops\n", name, (double)elapsed / n, (double)allocs / n, n);
+            fflush(stdout);
+            return;
+        }
+        // 按这次的速度估计需要的次数，至多放大10倍
+        long long next = elapsed > 0 ? (long long)(n * 1.2 * min_time_ns / elapsed) : n * 10;
+        n = next > n * 10 ? n * 10 : (next > n ? next : n * 2);
+    }
+}
+
+// 不需要socket和反应堆，直接调用http_conn的私有函数
+struct http_conn_probe {
+    static void open(http_conn &c) {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        c.init(-1, addr, NULL);
+    }
+
+    // 只切分行，不解析内容
+    static int split_lines(http_conn &c, const std::string &request) {
+        c.feed(request.data(), request.size());
+        int lines = 0;
+        while(c.parse_line() == http_conn::LINE_OK) {
+            c.m_start_line = c.m_checked_idx;
+            ++lines;
+        }
+        c.finish_request();
+        return lines;
+    }
+
+    static http_conn::HTTP_CODE parse(http_conn &c, const std::string &request) {
+        c.feed(request.data(), request.size());
+        http_conn::HTTP_CODE ret = c.parse_request();
+        c.finish_request();
+        return ret;
+    }
+
+    // 找文件时要用到工作区中的file_stat
+    static http_conn::HTTP_CODE read(http_conn &c, const std::string &request) {
+        c.feed(request.data(), request.size());
+        c.attach_batch();
+        http_conn::HTTP_CODE ret = c.process_read();
+        c.finish_request();
+        c.release_batch();
+        return ret;
+    }
+
+    // 工作线程处理一个请求的完整步骤，和process()相同，只是不交还给反应堆
+    static bool cycle(http_conn &c, const std::string &request) {
+        c.feed(request.data(), request.size());
+        c.attach_batch();
+        http_conn::HTTP_CODE ret = c.process_read();
+        bool ok = c.process_write(ret);
+        if(ok) {
+            c.retire_response();
+        }
+        c.finish_request();
+        c.release_batch();
+        return ok;
+    }
+
+    // 和cycle相同，返回生成的应答的状态码，头部中没有etag时返回-1
+    static int respond(http_conn &c, const std::string &request, const char *etag) {
+        c.feed(request.data(), request.size());
+        c.attach_batch();
+        http_conn::HTTP_CODE ret = c.process_read();
+        int status = 0;
+        if(c.process_write(ret)) {
+            status = c.m_batch->holds[c.m_hold_count].status;
+            if(!memmem(c.m_write_buf + c.m_response_start, c.m_write_idx - c.m_response_start, etag, strlen(etag))) {
+                status = -1;
+            }
+            c.retire_response();
+        }
+        c.finish_request();
+        c.release_batch();
+        return status;
+    }
+
+    // 借来工作区，准备好生成200应答所需的状态：MIME类型、验证器、保持连接
+    static void prepare_headers(http_conn &c, const file_validators *validators) {
+        c.attach_batch();
+        c.m_linger = true;
+        c.m_mime = lookup_mime("/index.html");
+        c.m_vary = true;
+        c.m_validators = validators;
+    }
+
+    static bool header_200(http_conn &c, off_t length) {
+        c.m_write_idx = 0;
+        return c.add_status_line(200) && c.add_headers(length);
+    }
+
+    static bool response_404(http_conn &c) {
+        c.m_write_idx = 0;
+        c.m_segment_count = 0;
+        return c.process_write(http_conn::NO_RESOURCE);
+    }
+
+    static void close(http_conn &c) {
+        c.release_batch();
+        c.release_read_buffer();
+        c.reset_request();
+    }
+};
+
+// 请求按\n分行，统一换成\r\n
+static std::string crlf(const char *text) {
+    std::string out;
+    for(const char *p = text; *p; ++p) {
+        if(*p == '\n' && (p == text || p[-1] != '\r')) {
+            out += '\r';
+        }
+        out += *p;
+    }
+    return out;
+}
+
+static const char *const request_names[] = { "curl", "browser", "conditional" };
+static const char *const request_texts[] = {
+    "GET /index.html HTTP/1.1\nHost: 127.0.0.1:9999\nUser-Agent: curl/7.81.0\nAccept: */*\n\n",
+    // 和baowen.txt同一个浏览器的请求
+    "GET /index.html HTTP/1.1\nHost: 192.168.31.41:9999\nConnection: keep-alive\nUpgrade-Insecure-Requests: 1\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/101.0.4951.54 Safari/537.36 Edg/101.0.1210.39\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.9\n"
+    "Accept-Encoding: gzip, deflate\nAccept-Language: zh-CN,zh;q=0.9,en;q=0.8,en-GB;q=0.7,en-US;q=0.6\n\n",
+    "GET /images/image1.jpg HTTP/1.1\nHost: www.example.com\nConnection: keep-alive\n"
+    "If-None-Match: \"1a2b3c-4d5e-17b0c8f2a1d3e4f5\"\nIf-Modified-Since: Sat, 28 May 2022 08:00:00 GMT\n\n",
+};
+
+static void bench_http() {
+    static http_conn conn;
+    http_conn_probe::open(conn);
+    std::vector<std::string> requests;
+    for(size_t i = 0; i < sizeof(request_texts) / sizeof(request_texts[0]); ++i) {
+        requests.push_back(crlf(request_texts[i]));
+    }
+    char name[64];
+    volatile long long sink = 0;
+    for(size_t i = 0; i < requests.size(); ++i) {
+        // 根目录不对时测到的是404的路径，没有意义
+        if(http_conn_probe::read(conn, requests[i]) != http_conn::FILE_REQUEST) {
+            printf("%s请求的文件不在%s中，用-d指定网页根目录\n", request_names[i], doc_root);
+            exit(1);
+        }
+    }
+    for(size_t i = 0; i < requests.size(); ++i) {
+        const std::string &req = requests[i];
+        snprintf(name, sizeof(name), "parse_line/%s", request_names[i]);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                sink += http_conn_probe::split_lines(conn, req);
+            }
+        });
+        snprintf(name, sizeof(name), "parse_request/%s", request_names[i]);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                sink += http_conn_probe::parse(conn, req);
+            }
+        });
+        snprintf(name, sizeof(name), "process_read/%s", request_names[i]);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                sink += http_conn_probe::read(conn, req);
+            }
+        });
+    }
+
+    // 响应头用index.html的真实验证器
+    struct stat st;
+    std::string index = std::string(doc_root) + "/index.html";
+    file_validators validators;
+    memset(&st, 0, sizeof(st));
+    stat(index.c_str(), &st);
+    make_validators(st, validators);
+    http_conn_probe::prepare_headers(conn, &validators);
+    run("header_200", [&](long long n) {
+        for(long long k = 0; k < n; ++k) {
+            sink += http_conn_probe::header_200(conn, st.st_size);
+        }
+    });
+    run("response_404", [&](long long n) {
+        for(long long k = 0; k < n; ++k) {
+            sink += http_conn_probe::response_404(conn);
+        }
+    });
+    http_conn_probe::close(conn);
+
+    for(size_t i = 0; i < requests.size(); ++i) {
+        const std::string &req = requests[i];
+        snprintf(name, sizeof(name), "request_cycle/%s", request_names[i]);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                sink += http_conn_probe::cycle(conn, req);
+            }
+        });
+    }
+    http_conn_probe::close(conn);
+}
+
+// 304和416的应答不发送文件，但头部要带上文件的验证器，验证器在缓存项中，
+// 缓存项被删除后只靠这个请求的引用维持，引用要到应答头生成之后才能释放
+static void bench_invalidate_race() {
+    static http_conn conn;
+    http_conn_probe::open(conn);
+    std::string path = std::string(doc_root) + "/index.html";
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0) {
+        printf("%s不存在，用-d指定网页根目录\n", path.c_str());
+        exit(1);
+    }
+    file_validators validators;
+    make_validators(st, validators);
+    static const char *const names[] = { "invalidate_race/304", "invalidate_race/416" };
+    static const int expect[] = { 304, 416 };
+    std::string requests[] = {
+        crlf(("GET /index.html HTTP/1.1\nHost: 127.0.0.1\nIf-None-Match: " + std::string(validators.etag) + "\n\n").c_str()),
+        crlf("GET /index.html HTTP/1.1\nHost: 127.0.0.1\nRange: bytes=99999999-\n\n"),
+    };
+    std::atomic<bool> stop(false);
+    std::thread invalidator([&] {
+        while(!stop.load(std::memory_order_relaxed)) {
+            http_conn::m_file_cache->invalidate(path.c_str());
+            http_conn::m_stat_cache->invalidate(path.c_str());
+        }
+    });
+    volatile long long sink = 0;
+    for(int i = 0; i < 2; ++i) {
+        run(names[i], [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                int status = http_conn_probe::respond(conn, requests[i], validators.etag);
+                if(status != expect[i]) {
+                    printf("%s: 应答状态为%d，或者头部中没有%s\n", names[i], status, validators.etag);
+                    exit(1);
+                }
+                sink += status;
+            }
+        });
+    }
+    stop.store(true);
+    invalidator.join();
+    http_conn_probe::close(conn);
+}
+
+// 线程池的测试任务，执行时只做标记
+struct probe_task {
+    std::atomic<long long> done;
+    void process() { done.fetch_add(1, std::memory_order_release); }
+};
+
+static void bench_threadpool() {
+    {
+        threadpool<probe_task> pool(1, 10000);
+        probe_task task;
+        task.done.store(0);
+        run("threadpool_handoff", [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                long long expect = task.done.load(std::memory_order_relaxed) + 1;
+                while(!pool.append(&task)) {
+                    sched_yield();
+                }
+                while(task.done.load(std::memory_order_acquire) != expect) {
+                    // 单核机器上让出CPU，工作线程才能运行
+                    sched_yield();
+                }
+            }
+        });
+    }
+    {
+        threadpool<probe_task> pool(2, 10000);
+        probe_task task;
+        task.done.store(0);
+        run("threadpool_throughput", [&](long long n) {
+            long long target = task.done.load(std::memory_order_relaxed) + n;
+            for(long long k = 0; k < n; ++k) {
+                while(!pool.append(&task)) {
+                    sched_yield();
+                }
+            }
+            while(task.done.load(std::memory_order_acquire) != target) {
+                sched_yield();
+            }
+        });
+    }
+}
+
+static unsigned int next_random(unsigned int &seed) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void bench_timer() {
+    // 超时分布在接下来的600个滴答（100毫秒一个滴答时为1分钟）中
+    const int SPREAD = 600;
+    static const int sizes[] = { 10000, 100000, 1000000 };
+    char name[64];
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int count = sizes[s];
+        timer_node *nodes = new timer_node[count + 1];
+        memset(nodes, 0, sizeof(timer_node) * (count + 1));
+        timer_wheel *wheel = new timer_wheel(0);
+        unsigned int seed = 2463534242u;
+        for(int i = 0; i < count; ++i) {
+            wheel->schedule(nodes + i, 1 + next_random(seed) % SPREAD);
+        }
+        long long expired = 0;
+
+        // 收到请求时把连接的定时器往后推，是最常见的操作
+        snprintf(name, sizeof(name), "timer_adjust/%d", count);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                timer_node *node = nodes + next_random(seed) % count;
+                wheel->schedule(node, wheel->now() + 1 + next_random(seed) % SPREAD);
+            }
+        });
+        snprintf(name, sizeof(name), "timer_add_cancel/%d", count);
+        run(name, [&](long long n) {
+            timer_node *extra = nodes + count;
+            for(long long k = 0; k < n; ++k) {
+                wheel->schedule(extra, wheel->now() + 1 + next_random(seed) % SPREAD);
+                wheel->cancel(extra);
+            }
+        });
+        // 到期的定时器重新设置，时间轮中的定时器数保持不变
+        snprintf(name, sizeof(name), "timer_tick/%d", count);
+        run(name, [&](long long n) {
+            for(long long k = 0; k < n; ++k) {
+                wheel->advance(wheel->now() + 1, [&](timer_node *node) {
+                    ++expired;
+                    wheel->schedule(node, wheel->now() + SPREAD);
+                });
+            }
+        });
+        delete wheel;
+        delete[] nodes;
+    }
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-t min_ms] [-f filter] [-d doc_root]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    doc_root = "resources";
+    int opt;
+    while((opt = getopt(argc, argv, "t:f:d:")) != -1) {
+        switch(opt) {
+            case 't': min_time_ns = atoll(optarg) * 1000000LL; break;
+            case 'f': filter = optarg; break;
+            case 'd': doc_root = optarg; break;
+            default:
+                usage(basename(argv[0]));
+                return 1;
+        }
+    }
+    if(min_time_ns <= 0) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+    // 和服务器一样使用文件缓存和元数据缓存，没有inotify监视，测试期间文件不能变化
+    http_conn::m_file_cache = new file_cache(64 << 20);
+    http_conn::m_stat_cache = new stat_cache(1024);
+
+    bench_http();
+    bench_invalidate_race();
+    bench_threadpool();
+    bench_timer();
+
+    delete http_conn::m_file_cache;
+    delete http_conn::m_stat_cache;
+    return 0;
+}
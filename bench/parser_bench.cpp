@@ -0,0 +1,172 @@
+/*
+    HTTP请求解析吞吐测试
+    对一组真实的请求（浏览器请求baowen.txt、带Cookie的请求、条件GET、curl的短请求）反复做解析服务器要做的扫描：
+    找出每一行的行尾，在请求头中找冒号并识别名字。分别用逐字节循环、SSE4.2和AVX2找行尾和冒号，
+    用原来的strncasecmp链和完美哈希识别名字，输出每秒能解析的请求数和字节数。
+    编译：g++ -O2 bench/parser_bench.cpp http_scan.cpp -o parser_bench.out
+    运行：./parser_bench.out [-n 轮数] [-f 请求文件]，请求文件中的\n会被换成\r\n
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string>
+#include <vector>
+#include "../http_scan.h"
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *builtin_requests[] = {
+    "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:9999\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n\r\n",
+    "GET /static/app.js HTTP/1.1\r\nHost: www.example.com\r\nConnection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\nReferer: https://www.example.com/\r\nAccept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=6f1c2a9be0d34c7f8a5e21b7c9d04e13; theme=dark; _ga=GA1.2.1234567890.1700000000; _gid=GA1.2.987654321.1700000000\r\n"
+    "If-None-Match: \"1a2b3c-4d5e-17b0c8f2a1d3e4f5\"\r\nIf-Modified-Since: Sat, 28 May 2022 08:00:00 GMT\r\n\r\n",
+    "GET /video.mp4 HTTP/1.1\r\nHost: media.example.com\r\nConnection: keep-alive\r\nRange: bytes=1048576-\r\n"
+    "If-Range: \"1a2b3c-4d5e-17b0c8f2a1d3e4f5\"\r\nUser-Agent: VLC/3.0.18 LibVLC/3.0.18\r\n\r\n",
+};
+
+// 原来的解析方式
+static const char *scan_bytewise(const char *p, const char *end, char a, char b) {
+    for(; p < end; ++p) {
+        if(*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+static int lookup_chain(const char *text, int len) {
+    (void)len;
+    static const char *names[] = { "Connection:", "Content-Length:", "Accept-Encoding:", "If-None-Match:",
+        "If-Modified-Since:", "Range:", "If-Range:", "Host:" };
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if(strncasecmp(text, names[i], strlen(names[i])) == 0) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static int lookup_hash(const char *text, int len) {
+    return lookup_header(text, len);
+}
+
+typedef int (*lookup_fn)(const char *text, int len);
+
+// 扫描一个请求的所有行，返回识别出的请求头个数，防止被优化掉
+static int parse(const char *p, const char *end, scan_fn scan, lookup_fn lookup) {
+    int found = 0;
+    bool first = true;
+    while(p < end) {
+        const char *eol = scan(p, end, '\r', '\n');
+        if(eol == p) {
+            break; // 空行
+        }
+        if(first) {
+            const char *sp = scan(p, eol, ' ', '\t');
+            found += sp - p;
+            first = false;
+        } else {
+            const char *colon = scan(p, eol, ':', ':');
+            found += lookup(p, colon - p);
+        }
+        p = eol + 2;
+    }
+    return found;
+}
+
+static void run(const char *name, const std::vector<std::string> &requests, long long rounds,
+                scan_fn scan, lookup_fn lookup) {
+    long long bytes = 0;
+    int sink = 0;
+    long long begin = now_ns();
+    for(long long r = 0; r < rounds; ++r) {
+        for(size_t i = 0; i < requests.size(); ++i) {
+            const char *p = requests[i].data();
+            sink += parse(p, p + requests[i].size(), scan, lookup);
+            bytes += requests[i].size();
+        }
+    }
+    double seconds = (now_ns() - begin) / 1e9;
+    long long count = rounds * requests.size();
+    printf("%-28s %10.0f req/s %8.0f MB/s %7.1f ns/req (%d)\n", name, count / seconds,
+        bytes / seconds / 1e6, seconds * 1e9 / count, sink & 1);
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-n rounds] [-f request_file]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long long rounds = 1000000;
+    const char *file = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "n:f:")) != -1) {
+        switch(opt) {
+            case 'n': rounds = atoll(optarg); break;
+            case 'f': file = optarg; break;
+            default:
+                usage(basename(argv[0]));
+                return 1;
+        }
+    }
+    if(rounds <= 0) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+
+    std::vector<std::string> requests;
+    for(size_t i = 0; i < sizeof(builtin_requests) / sizeof(builtin_requests[0]); ++i) {
+        requests.push_back(builtin_requests[i]);
+    }
+    if(file) {
+        FILE *fp = fopen(file, "rb");
+        if(!fp) {
+            perror(file);
+            return 1;
+        }
+        std::string raw, request;
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            raw.append(buf, n);
+        }
+        fclose(fp);
+        // 统一成\r\n结尾，末尾补上空行
+        for(size_t i = 0; i < raw.size(); ++i) {
+            if(raw[i] == '\n' && (i == 0 || raw[i - 1] != '\r')) {
+                request += '\r';
+            }
+            request += raw[i];
+        }
+        while(request.size() >= 2 && request.compare(request.size() - 2, 2, "\r\n") == 0) {
+            request.resize(request.size() - 2);
+        }
+        request += "\r\n\r\n";
+        requests.push_back(request);
+    }
+
+    printf("dispatch: %s, %zu requests x %lld rounds\n", scanner_name(), requests.size(), rounds);
+    run("bytewise + strncasecmp", requests, rounds, scan_bytewise, lookup_chain);
+    run("bytewise + perfect hash", requests, rounds, scan_bytewise, lookup_hash);
+#ifdef HTTP_SCAN_X86
+    if(cpu_has_sse42()) {
+        run("sse4.2 + perfect hash", requests, rounds, scan_sse42, lookup_hash);
+    }
+    if(cpu_has_avx2()) {
+        run("avx2 + perfect hash", requests, rounds, scan_avx2, lookup_hash);
+    }
+#endif
+    run("dispatched + perfect hash", requests, rounds, find_either, lookup_hash);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# 宏基准测试套件
+# 编译服务器和压测工具，在本机空闲端口上以resources为根目录启动服务器，依次跑下列场景，
+# 每个场景输出一行JSON追加到结果文件，便于不同提交之间对比：
+#   keepalive   长连接请求小文件（闭环）
+#   close       每个请求新建连接
+#   pipeline    每条连接16个流水线请求
+#   large       长连接请求67KB的图片
+#   notfound    长连接请求不存在的文件
+#   open_rate   开环固定速率，延迟包含排队等待的时间
+#   trace       回放bench/trace.txt中记录的请求
+# 用法：bench/run_suite.sh [结果文件]，在仓库根目录运行
+# 可以用环境变量调整：DURATION（每个场景的秒数，默认10）、THREADS（压测线程数，默认2）、
+# CONNS（连接数，默认64）、RATE（开环速率，默认20000）、SERVER_ARGS（服务器的额外参数）
+set -e
+
+cd "$(dirname "$0")/.."
+RESULT=${1:-bench_results.jsonl}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-2}
+CONNS=${CONNS:-64}
+RATE=${RATE:-20000}
+PORT=${PORT:-$((20000 + $$ % 20000))}
+BUILD=$(mktemp -d)
+
+g++ -O2 *.cpp -pthread -lz -o "$BUILD/webserver.out"
+g++ -O2 bench/http_load.cpp -pthread -o "$BUILD/http_load.out"
+
+"$BUILD/webserver.out" -d resources $SERVER_ARGS "$PORT" > "$BUILD/server.log" 2>&1 &
+SERVER=$!
+trap 'kill -INT $SERVER 2>/dev/null; wait $SERVER 2>/dev/null; rm -rf "$BUILD"' EXIT
+# 等服务器开始监听
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    if "$BUILD/http_load.out" -t 1 -c 1 -d 1 127.0.0.1 "$PORT" | grep -q "errors: 0"; then
+        break
+    fi
+done
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+run() {
+    name=$1
+    shift
+    line=$("$BUILD/http_load.out" -j -n "$name" -t "$THREADS" -d "$DURATION" "$@" 127.0.0.1 "$PORT")
+    # 补上提交号，结果文件里可以混放多次运行的结果
+    line="{\"commit\":\"$COMMIT\",${line#\{}"
+    echo "$line"
+    echo "$line" >> "$RESULT"
+}
+
+run keepalive -c "$CONNS" -u /index.html
+run close -c "$CONNS" -a -u /index.html
+run pipeline -c "$CONNS" -p 16 -u /index.html
+run large -c "$CONNS" -u /images/image1.jpg
+run notfound -c "$CONNS" -u /not_found.html
+run open_rate -c "$CONNS" -R "$RATE" -u /index.html
+run trace -c "$CONNS" -f bench/trace.txt
@@ -0,0 +1,161 @@
+/*
+    线程池入队出队吞吐测试
+    若干生产者线程不停地向线程池追加任务，统计每秒完成的任务数和任务从入队到开始执行的等待时间分位数，
+    对比最初的 链表+互斥锁+信号量 实现、无锁环形队列+自旋futex 实现、批量追加以及工作窃取模式。
+    -m 开启混合负载：每heavy_every个任务中有一个任务要执行heavy_us微秒，用来观察工作窃取对尾延迟的影响。
+    编译：g++ -O2 threadpool_bench.cpp -pthread -o threadpool_bench.out
+    运行：./threadpool_bench.out [-p 生产者线程数] [-w 工作线程数] [-n 每个生产者的任务数] [-b 批量大小] [-m heavy_every:heavy_us]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
+#include <algorithm>
+#include "../threadpool.h"
+
+#define MAX_BATCH 1024
+#define MAX_PRODUCER 256
+
+static std::atomic<long long> done_count(0);
+static int heavy_every = 0; // 每多少个任务有一个重任务，0表示没有
+static int heavy_us = 0;    // 重任务的执行时间
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 测试任务，记录从入队到开始执行的等待时间
+struct bench_task {
+    long long enqueue_ns;
+    long long wait_ns;
+    bool heavy;
+
+    void process() {
+        long long begin = now_ns();
+        wait_ns = begin - enqueue_ns;
+        if(heavy) {
+            while(now_ns() - begin < heavy_us * 1000LL) {}
+        }
+        done_count.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+template<typename Pool>
+struct producer_arg {
+    Pool *pool;
+    bench_task *tasks;
+    long long count;
+    int batch;
+};
+
+template<typename Pool>
+static void* producer(void *arg) {
+    producer_arg<Pool> *p = (producer_arg<Pool> *)arg;
+    bench_task *batch[MAX_BATCH];
+    long long next = 0;
+    while(next < p->count) {
+        int n = p->count - next < p->batch ? (int)(p->count - next) : p->batch;
+        long long now = now_ns();
+        for(int i = 0; i < n; ++i) {
+            batch[i] = p->tasks + next + i;
+            batch[i]->enqueue_ns = now;
+        }
+        int sent = p->batch > 1 ? p->pool->append_batch(batch, n) : (p->pool->append(batch[0]) ? 1 : 0);
+        if(sent == 0) {
+            // 队列满，让出CPU等待工作线程消费
+            sched_yield();
+        }
+        next += sent;
+    }
+    return NULL;
+}
+
+template<typename Pool>
+static void run_bench(const char *name, SCHED_MODE mode, int producers, int workers, long long count, int batch) {
+    Pool *pool = new Pool(workers, 10000, mode);
+    pthread_t threads[MAX_PRODUCER];
+    producer_arg<Pool> args[MAX_PRODUCER];
+    long long total = count * producers;
+    bench_task *tasks = new bench_task[total];
+    for(long long i = 0; i < total; ++i) {
+        tasks[i].heavy = heavy_every > 0 && i % heavy_every == 0;
+    }
+
+    done_count = 0;
+    long long begin = now_ns();
+    for(int i = 0; i < producers; ++i) {
+        args[i].pool = pool;
+        args[i].tasks = tasks + i * count;
+        args[i].count = count;
+        args[i].batch = batch;
+        pthread_create(threads + i, NULL, producer<Pool>, args + i);
+    }
+    for(int i = 0; i < producers; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    while(done_count.load() < total) {
+        sched_yield();
+    }
+    double seconds = (now_ns() - begin) / 1e9;
+
+    long long *waits = new long long[total];
+    for(long long i = 0; i < total; ++i) {
+        waits[i] = tasks[i].wait_ns;
+    }
+    std::sort(waits, waits + total);
+    printf("%-28s batch %4d: %.2f Mtasks/s, %.1f ns/task, wait p50 %lld ns, p99 %lld ns, p999 %lld ns\n",
+        name, batch, total / seconds / 1e6, seconds * 1e9 / total,
+        waits[total / 2], waits[total * 99 / 100], waits[total * 999 / 1000]);
+    delete[] waits;
+    delete pool;
+    delete[] tasks;
+}
+
+static void usage(const char *prog) {
+    printf("usage: %s [-p producers] [-w workers] [-n tasks_per_producer] [-b batch] [-m heavy_every:heavy_us]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int producers = 2;
+    int workers = 4;
+    long long count = 1000000;
+    int batch = 32;
+    int opt;
+    while((opt = getopt(argc, argv, "p:w:n:b:m:")) != -1) {
+        switch(opt) {
+            case 'p': producers = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'n': count = atoll(optarg); break;
+            case 'b': batch = atoi(optarg); break;
+            case 'm':
+                if(sscanf(optarg, "%d:%d", &heavy_every, &heavy_us) != 2) {
+                    usage(basename(argv[0]));
+                    return 1;
+                }
+                break;
+            default:
+                usage(basename(argv[0]));
+                return 1;
+        }
+    }
+    if(producers <= 0 || producers > MAX_PRODUCER || batch <= 0 || batch > MAX_BATCH || count <= 0) {
+        usage(basename(argv[0]));
+        return 1;
+    }
+
+    typedef threadpool<bench_task, list_queue, sem_waiter> list_sem_pool;
+    typedef threadpool<bench_task> ring_futex_pool;
+
+    run_bench<list_sem_pool>("list + mutex + sem", SHARED_QUEUE, producers, workers, count, 1);
+    run_bench<ring_futex_pool>("ring + spin/futex", SHARED_QUEUE, producers, workers, count, 1);
+    run_bench<ring_futex_pool>("ring + spin/futex", SHARED_QUEUE, producers, workers, count, batch);
+    run_bench<ring_futex_pool>("work stealing", WORK_STEALING, producers, workers, count, batch);
+    return 0;
+}
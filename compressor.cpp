@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <exception>
+#include <zlib.h>
+
+#include "compressor.h"
+
+gzip_compressor::gzip_compressor(file_cache *cache) : m_cache(cache), m_thread(0), m_stop(false) {
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+gzip_compressor::~gzip_compressor() {
+    stop();
+    join();
+}
+
+void gzip_compressor::start() {
+    if(pthread_create(&m_thread, NULL, worker, this) != 0) {
+        throw std::exception();
+    }
+}
+
+void gzip_compressor::stop() {
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuecond.broadcast();
+    m_queuelocker.unlock();
+}
+
+void gzip_compressor::join() {
+    if(m_thread) {
+        pthread_join(m_thread, NULL);
+        m_thread = 0;
+    }
+}
+
+void gzip_compressor::variant_key(char *buf, size_t len, const char *path, const struct stat &st) {
+    // 换行符不会出现在请求的路径中，不会和真实路径冲突
+    snprintf(buf, len, "%s\ngzip %lld.%09ld %lld", path, (long long)st.st_mtim.tv_sec,
+        (long)st.st_mtim.tv_nsec, (long long)st.st_size);
+}
+
+void gzip_compressor::submit(const char *path, const char *key, const struct stat &st) {
+    m_queuelocker.lock();
+    if(m_stop || m_pending.count(key) || m_skipped.count(key)) {
+        m_queuelocker.unlock();
+        return;
+    }
+    if((int)m_queue.size() >= MAX_QUEUE) {
+        ++m_stats.dropped;
+        m_queuelocker.unlock();
+        return;
+    }
+    job j;
+    j.path = path;
+    j.key = key;
+    j.st = st;
+    m_queue.push_back(j);
+    m_pending.insert(j.key);
+    m_queuecond.signal();
+    m_queuelocker.unlock();
+}
+
+void* gzip_compressor::worker(void *arg) {
+    gzip_compressor *c = (gzip_compressor *) arg;
+    c->run();
+    return c;
+}
+
+void gzip_compressor::run() {
+    while(true) {
+        m_queuelocker.lock();
+        while(!m_stop && m_queue.empty()) {
+            m_queuecond.wait(m_queuelocker.get());
+        }
+        if(m_stop) {
+            m_queuelocker.unlock();
+            break;
+        }
+        job j = m_queue.front();
+        m_queue.pop_front();
+        m_queuelocker.unlock();
+
+        off_t size = 0;
+        char *data = compress(j, size);
+        // 缓存中的文件状态除了大小都是原文件的，应答的Content-Length取自st_size
+        struct stat variant = j.st;
+        variant.st_size = size;
+        bool stored = data && m_cache->store(j.key.c_str(), data, size, variant);
+
+        m_queuelocker.lock();
+        m_pending.erase(j.key);
+        if(data) {
+            // 没有放入缓存只是因为准入策略，之后请求变多时还可以再提交
+            if(stored) {
+                ++m_stats.compressed;
+                m_stats.bytes_in += j.st.st_size;
+                m_stats.bytes_out += size;
+            }
+        } else {
+            ++m_stats.skipped;
+            if((int)m_skipped.size() >= MAX_SKIPPED) {
+                m_skipped.clear();
+            }
+            m_skipped.insert(j.key);
+        }
+        m_queuelocker.unlock();
+    }
+}
+
+char *gzip_compressor::compress(const job &j, off_t &out_size) {
+    if(j.st.st_size > MAX_FILE_SIZE) {
+        return NULL;
+    }
+    int fd = open(j.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return NULL;
+    }
+    // 文件在提交之后被修改过，读到的内容和键里的版本对不上
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size != j.st.st_size || st.st_mtim.tv_sec != j.st.st_mtim.tv_sec
+        || st.st_mtim.tv_nsec != j.st.st_mtim.tv_nsec) {
+        close(fd);
+        return NULL;
+    }
+    char *in = new char[st.st_size > 0 ? st.st_size : 1];
+    off_t done = 0;
+    while(done < st.st_size) {
+        ssize_t n = pread(fd, in + done, st.st_size - done, done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if(done < st.st_size) {
+        delete[] in;
+        return NULL;
+    }
+
+    // windowBits为15 + 16时输出gzip格式
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete[] in;
+        return NULL;
+    }
+    uLong bound = deflateBound(&zs, st.st_size);
+    char *out = new char[bound];
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = st.st_size;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    out_size = zs.total_out;
+    deflateEnd(&zs);
+    delete[] in;
+
+    // 压缩后没有明显变小的文件（比如本来就压缩过的格式）不值得多占一份缓存
+    if(ret != Z_STREAM_END || out_size > st.st_size * 9 / 10) {
+        delete[] out;
+        return NULL;
+    }
+    return out;
+}
+
+void gzip_compressor::stats(compressor_stats &out) {
+    m_queuelocker.lock();
+    out = m_stats;
+    m_queuelocker.unlock();
+}
@@ -0,0 +1,73 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+#include <pthread.h>
+#include <sys/stat.h>
+#include <deque>
+#include <set>
+#include <string>
+#include <atomic>
+#include "locker.h"
+#include "file_cache.h"
+
+// 压缩线程的统计信息
+struct compressor_stats {
+    long long compressed;   // 压缩并放入缓存的文件数
+    long long skipped;      // 压缩效果不好、文件过大或者读取失败而放弃的文件数
+    long long dropped;      // 队列满时丢弃的任务数
+    long long bytes_in;
+    long long bytes_out;
+};
+
+/*
+    后台gzip压缩线程
+    请求可以压缩的文件但没有.gz文件时，工作线程只提交一个任务，这一次仍然发送未压缩的内容，
+    压缩线程读取文件、压缩后以 variant_key(路径, 修改时间) 为键放入file_cache，之后的请求直接发送压缩的版本。
+    键里带有修改时间，文件被修改后旧的压缩版本不会再被命中，由LRU淘汰。
+    同一个键只会排队一次，压缩效果不好的键会被记住，不会反复压缩。
+*/
+class gzip_compressor {
+public:
+    explicit gzip_compressor(file_cache *cache);
+    ~gzip_compressor();
+
+    void start();
+    void stop();
+    void join();
+
+    // 提交压缩任务，只加锁操作队列，不做任何IO
+    void submit(const char *path, const char *key, const struct stat &st);
+
+    // 生成压缩版本在缓存中的键
+    static void variant_key(char *buf, size_t len, const char *path, const struct stat &st);
+
+    void stats(compressor_stats &out);
+
+private:
+    static const int MAX_QUEUE = 1024;          // 最多排队的任务数
+    static const int MAX_SKIPPED = 10000;       // 最多记住的压缩效果不好的键
+    static const off_t MAX_FILE_SIZE = 16 << 20; // 超过这个大小的文件不压缩
+    static const int LEVEL = 6;
+
+    struct job {
+        std::string path;
+        std::string key;
+        struct stat st;
+    };
+
+    static void* worker(void *arg);
+    void run();
+    // 读取并压缩文件，成功时返回压缩后的内容
+    char *compress(const job &j, off_t &out_size);
+
+    file_cache *m_cache;
+    pthread_t m_thread;
+    locker m_queuelocker;
+    cond m_queuecond;
+    std::deque<job> m_queue;
+    std::set<std::string> m_pending;  // 排队或者正在压缩的键
+    std::set<std::string> m_skipped;  // 压缩效果不好的键
+    bool m_stop;
+    compressor_stats m_stats;
+};
+
+#endif
@@ -0,0 +1,298 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "file_cache.h"
+
+// count-min sketch每一行使用不同的乘法哈希
+static const uint32_t sketch_seeds[] = { 0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu };
+
+file_cache::file_cache(size_t budget) : m_shards(NULL), m_shard_budget(budget / SHARD_NUMBER),
+    m_max_entry(budget / SHARD_NUMBER / MAX_ENTRY_FRACTION), m_epoch(0) {
+    m_shards = new shard[SHARD_NUMBER];
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        memset(s.buckets, 0, sizeof(s.buckets));
+        memset(s.sketch, 0, sizeof(s.sketch));
+        s.head = s.tail = NULL;
+        s.bytes = s.entries = 0;
+        s.samples = 0;
+        s.hits = s.misses = s.inserts = s.evictions = s.rejects = 0;
+    }
+}
+
+file_cache::~file_cache() {
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        while(s.head) {
+            unlink(s, s.head);
+        }
+    }
+    delete[] m_shards;
+}
+
+// FNV-1a
+uint32_t file_cache::hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+    for(const unsigned char *p = (const unsigned char *)path; *p; ++p) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+cached_file *file_cache::find(shard &s, uint32_t hash, const char *path) {
+    cached_file *file = s.buckets[(hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    while(file) {
+        if(file->hash == hash && file->path == path) {
+            return file;
+        }
+        file = file->hnext;
+    }
+    return NULL;
+}
+
+// 从哈希表和LRU链表中摘除，并释放缓存本身持有的引用
+void file_cache::unlink(shard &s, cached_file *file) {
+    cached_file **p = &s.buckets[(file->hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    while(*p != file) {
+        p = &(*p)->hnext;
+    }
+    *p = file->hnext;
+
+    if(file->prev) {
+        file->prev->next = file->next;
+    } else {
+        s.head = file->next;
+    }
+    if(file->next) {
+        file->next->prev = file->prev;
+    } else {
+        s.tail = file->prev;
+    }
+    s.bytes -= file->size;
+    --s.entries;
+    release(file);
+}
+
+void file_cache::move_to_front(shard &s, cached_file *file) {
+    if(s.head == file) {
+        return;
+    }
+    file->prev->next = file->next;
+    if(file->next) {
+        file->next->prev = file->prev;
+    } else {
+        s.tail = file->prev;
+    }
+    file->prev = NULL;
+    file->next = s.head;
+    s.head->prev = file;
+    s.head = file;
+}
+
+// 记录一次访问，访问次数达到阈值后所有计数器减半，让频率反映的是最近一段时间的热度
+void file_cache::record(shard &s, uint32_t hash) {
+    for(int i = 0; i < SKETCH_DEPTH; ++i) {
+        unsigned char &counter = s.sketch[i][(hash * sketch_seeds[i]) >> 20];
+        if(counter < SKETCH_MAX) {
+            ++counter;
+        }
+    }
+    if(++s.samples >= SKETCH_WIDTH * 10) {
+        for(int i = 0; i < SKETCH_DEPTH; ++i) {
+            for(int j = 0; j < SKETCH_WIDTH; ++j) {
+                s.sketch[i][j] >>= 1;
+            }
+        }
+        s.samples /= 2;
+    }
+}
+
+int file_cache::frequency(shard &s, uint32_t hash) {
+    int freq = SKETCH_MAX;
+    for(int i = 0; i < SKETCH_DEPTH; ++i) {
+        int counter = s.sketch[i][(hash * sketch_seeds[i]) >> 20];
+        if(counter < freq) {
+            freq = counter;
+        }
+    }
+    return freq;
+}
+
+cached_file *file_cache::get(const char *path) {
+    uint32_t hash = hash_path(path);
+    shard &s = shard_of(hash);
+    s.lock.lock();
+    record(s, hash);
+    cached_file *file = find(s, hash, path);
+    if(!file) {
+        ++s.misses;
+        s.lock.unlock();
+        return NULL;
+    }
+    move_to_front(s, file);
+    file->refs.fetch_add(1, std::memory_order_relaxed);
+    ++s.hits;
+    s.lock.unlock();
+    return file;
+}
+
+// 分片已满时，只有比LRU尾部更常被访问的文件才能进入缓存，需要持有分片的锁
+bool file_cache::admit(shard &s, uint32_t hash, off_t size) {
+    if(s.bytes + size > m_shard_budget && s.tail && frequency(s, hash) <= frequency(s, s.tail->hash)) {
+        ++s.rejects;
+        return false;
+    }
+    return true;
+}
+
+cached_file *file_cache::load(const char *path, int fd, const struct stat &st, unsigned long epoch) {
+    if(!S_ISREG(st.st_mode) || (size_t)st.st_size > m_max_entry) {
+        return NULL;
+    }
+    uint32_t hash = hash_path(path);
+    shard &s = shard_of(hash);
+
+    s.lock.lock();
+    cached_file *file = find(s, hash, path);
+    if(file) {
+        file->refs.fetch_add(1, std::memory_order_relaxed);
+        s.lock.unlock();
+        return file;
+    }
+    if(!admit(s, hash, st.st_size)) {
+        s.lock.unlock();
+        return NULL;
+    }
+    s.lock.unlock();
+
+    // 在锁外读文件
+    char *data = new char[st.st_size > 0 ? st.st_size : 1];
+    off_t done = 0;
+    while(done < st.st_size) {
+        ssize_t n = pread(fd, data + done, st.st_size - done, done);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            delete[] data;
+            return NULL;
+        }
+        done += n;
+    }
+    return insert(path, hash, data, st.st_size, st, epoch);
+}
+
+bool file_cache::store(const char *key, char *data, off_t size, const struct stat &st) {
+    uint32_t hash = hash_path(key);
+    shard &s = shard_of(hash);
+    s.lock.lock();
+    bool admitted = (size_t)size <= m_max_entry && admit(s, hash, size);
+    s.lock.unlock();
+    if(!admitted) {
+        delete[] data;
+        return false;
+    }
+    release(insert(key, hash, data, size, st, epoch()));
+    return true;
+}
+
+// 把读好的内容放入缓存，返回增加了引用计数的文件
+cached_file *file_cache::insert(const char *path, uint32_t hash, char *data, off_t size,
+                                const struct stat &st, unsigned long epoch) {
+    shard &s = shard_of(hash);
+    cached_file *file = new cached_file;
+    file->data = data;
+    file->size = size;
+    file->st = st;
+    make_validators(st, file->validators);
+    file->refs.store(2, std::memory_order_relaxed); // 缓存和调用者各一个
+    file->hash = hash;
+    file->path = path;
+    file->prev = NULL;
+
+    s.lock.lock();
+    if(m_epoch.load(std::memory_order_acquire) != epoch) {
+        // 读文件期间有文件被修改，不缓存可能过时的内容，这一次仍然可以用它应答
+        ++s.rejects;
+        s.lock.unlock();
+        file->refs.store(1, std::memory_order_relaxed);
+        return file;
+    }
+    cached_file *existing = find(s, hash, path);
+    if(existing) {
+        // 其他线程已经先读入了同一个文件
+        existing->refs.fetch_add(1, std::memory_order_relaxed);
+        s.lock.unlock();
+        delete[] file->data;
+        delete file;
+        return existing;
+    }
+    while(s.tail && s.bytes + file->size > m_shard_budget) {
+        unlink(s, s.tail);
+        ++s.evictions;
+    }
+    cached_file **bucket = &s.buckets[(hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    file->hnext = *bucket;
+    *bucket = file;
+    file->next = s.head;
+    if(s.head) {
+        s.head->prev = file;
+    } else {
+        s.tail = file;
+    }
+    s.head = file;
+    s.bytes += file->size;
+    ++s.entries;
+    ++s.inserts;
+    s.lock.unlock();
+    return file;
+}
+
+void file_cache::release(cached_file *file) {
+    if(file->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete[] file->data;
+        delete file;
+    }
+}
+
+void file_cache::invalidate(const char *path) {
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    uint32_t hash = hash_path(path);
+    shard &s = shard_of(hash);
+    s.lock.lock();
+    cached_file *file = find(s, hash, path);
+    if(file) {
+        unlink(s, file);
+    }
+    s.lock.unlock();
+}
+
+void file_cache::clear() {
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        while(s.head) {
+            unlink(s, s.head);
+        }
+        s.lock.unlock();
+    }
+}
+
+void file_cache::stats(file_cache_stats &out) {
+    memset(&out, 0, sizeof(out));
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        out.hits += s.hits;
+        out.misses += s.misses;
+        out.inserts += s.inserts;
+        out.evictions += s.evictions;
+        out.rejects += s.rejects;
+        out.bytes += s.bytes;
+        out.entries += s.entries;
+        s.lock.unlock();
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "locker.h"
+#include "validators.h"
+
+// 缓存中的一个文件，内容整个读入内存，多个连接可以同时用writev发送同一块内存
+struct cached_file {
+    char *data;           // 文件内容
+    off_t size;           // 文件大小
+    struct stat st;       // 读入时的文件状态
+    file_validators validators; // 由st生成的ETag和Last-Modified
+    std::atomic<int> refs; // 引用计数，缓存本身持有一个，每个正在发送它的连接持有一个
+
+    uint32_t hash;
+    std::string path;
+    cached_file *hnext;   // 哈希桶中的下一个
+    cached_file *prev;    // LRU链表，靠近头部的是最近访问的
+    cached_file *next;
+};
+
+// 文件缓存的统计信息
+struct file_cache_stats {
+    long long hits;
+    long long misses;
+    long long inserts;
+    long long evictions;
+    long long rejects;     // 被准入策略拒绝的次数
+    long long bytes;       // 当前缓存的字节数
+    long long entries;     // 当前缓存的文件数
+};
+
+/*
+    进程内共享的静态文件缓存
+    按路径的哈希分成若干分片，每个分片一把锁、一个哈希表和一条LRU链表，字节预算平均分给各个分片。
+    淘汰策略为LRU，准入策略为TinyLFU：每个分片用一个count-min sketch统计最近的访问频率，
+    分片已满时，新文件的频率要高于LRU尾部的文件才会被缓存，避免一次性的访问把热点文件挤出去。
+    命中时不做任何文件系统调用，文件被修改后由fs_watcher调用invalidate删除缓存。
+    invalidate和clear会先增加epoch再删除，load时如果epoch和查找前读取的不同，说明期间
+    可能有文件被修改，读到的内容可能已经过时，就不放入缓存。
+*/
+class file_cache {
+public:
+    // budget为所有分片总的字节预算，单个文件超过分片预算的 1/MAX_ENTRY_FRACTION 时不缓存
+    explicit file_cache(size_t budget);
+    ~file_cache();
+
+    // 查找文件，命中时返回的文件已经增加了引用计数，用完后调用release
+    cached_file *get(const char *path);
+
+    // 未命中时由调用者打开文件后调用，按准入策略决定是否读入缓存，epoch为查找文件之前读取的epoch()，
+    // 缓存成功返回增加了引用计数的文件，否则返回NULL，调用者直接发送文件
+    cached_file *load(const char *path, int fd, const struct stat &st, unsigned long epoch);
+
+    // 放入已经生成好的内容，比如压缩后的文件，key可以是任意字符串，data的所有权交给缓存，
+    // 同样经过准入策略，返回是否放入了缓存
+    bool store(const char *key, char *data, off_t size, const struct stat &st);
+
+    // 释放get或load返回的文件
+    static void release(cached_file *file);
+
+    // 删除某个路径的缓存
+    void invalidate(const char *path);
+    // 删除所有缓存
+    void clear();
+    unsigned long epoch() { return m_epoch.load(std::memory_order_acquire); }
+
+    void stats(file_cache_stats &out);
+
+    // 路径的哈希值（FNV-1a），各个按路径索引的缓存共用
+    static uint32_t hash_path(const char *path);
+
+private:
+    static const int SHARD_NUMBER = 16;
+    static const int BUCKET_NUMBER = 1024;     // 每个分片的哈希桶个数
+    static const int SKETCH_DEPTH = 4;
+    static const int SKETCH_WIDTH = 4096;      // 每个分片count-min sketch每一行的计数器个数
+    static const int SKETCH_MAX = 15;          // 计数器上限，和TinyLFU一样只需要4位
+    static const int MAX_ENTRY_FRACTION = 4;
+
+    struct shard {
+        locker lock;
+        cached_file *buckets[BUCKET_NUMBER];
+        cached_file *head;   // LRU链表头，最近访问
+        cached_file *tail;   // LRU链表尾，最先被淘汰
+        size_t bytes;
+        size_t entries;
+        unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH];
+        int samples;         // 自上次衰减以来的访问次数，达到阈值时所有计数器减半
+        long long hits, misses, inserts, evictions, rejects;
+    };
+
+    shard &shard_of(uint32_t hash) { return m_shards[hash % SHARD_NUMBER]; }
+
+    // 以下函数都需要持有分片的锁
+    cached_file *find(shard &s, uint32_t hash, const char *path);
+    void unlink(shard &s, cached_file *file);
+    void move_to_front(shard &s, cached_file *file);
+    void record(shard &s, uint32_t hash);
+    int frequency(shard &s, uint32_t hash);
+    bool admit(shard &s, uint32_t hash, off_t size);
+
+    cached_file *insert(const char *path, uint32_t hash, char *data, off_t size,
+                        const struct stat &st, unsigned long epoch);
+
+    shard *m_shards;
+    size_t m_shard_budget;
+    size_t m_max_entry;
+    std::atomic<unsigned long> m_epoch;
+};
+
+#endif
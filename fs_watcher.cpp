@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <stdint.h>
+#include <exception>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "fs_watcher.h"
+#include "log.h"
+
+// 目录上关心的事件，文件内容、属性的变化以及目录项的增删改名
+static const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE
+    | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+fs_watcher::fs_watcher(const char *root, stat_cache *metas, file_cache *files) :
+    m_inotifyfd(-1), m_stopfd(-1), m_thread(0), m_root(root), m_metas(metas), m_files(files), m_filter(NULL) {
+    m_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_inotifyfd == -1) {
+        LOG_ERROR("inotify_init1: %s", strerror(errno));
+        throw std::exception();
+    }
+    m_stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_stopfd == -1) {
+        LOG_ERROR("eventfd: %s", strerror(errno));
+        close(m_inotifyfd);
+        throw std::exception();
+    }
+    add_tree(m_root);
+    if(m_dirs.empty()) {
+        // 连根目录都无法监视，缓存无法保持一致
+        close(m_inotifyfd);
+        close(m_stopfd);
+        throw std::exception();
+    }
+}
+
+fs_watcher::~fs_watcher() {
+    close(m_inotifyfd);
+    close(m_stopfd);
+}
+
+void fs_watcher::add_tree(const std::string &dir) {
+    int wd = inotify_add_watch(m_inotifyfd, dir.c_str(), WATCH_MASK);
+    if(wd == -1) {
+        // 通常是超过了fs.inotify.max_user_watches
+        LOG_ERROR("inotify_add_watch: %s", strerror(errno));
+        return;
+    }
+    m_dirs[wd] = dir;
+
+    DIR *d = opendir(dir.c_str());
+    if(!d) {
+        return;
+    }
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        // 不跟随符号链接，经过符号链接的路径不会被缓存；有的文件系统不提供d_type，要lstat
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if(entry->d_type == DT_DIR
+            || (entry->d_type == DT_UNKNOWN && lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+            add_tree(path);
+        }
+    }
+    closedir(d);
+}
+
+void fs_watcher::invalidate(const std::string &path) {
+    m_metas->invalidate(path.c_str());
+    if(m_files) {
+        m_files->invalidate(path.c_str());
+    }
+}
+
+void fs_watcher::clear() {
+    m_metas->clear();
+    if(m_files) {
+        m_files->clear();
+    }
+}
+
+void fs_watcher::start() {
+    if(pthread_create(&m_thread, NULL, worker, this) != 0) {
+        throw std::exception();
+    }
+}
+
+void fs_watcher::stop() {
+    uint64_t one = 1;
+    ::write(m_stopfd, &one, sizeof(one));
+}
+
+void fs_watcher::join() {
+    if(m_thread) {
+        pthread_join(m_thread, NULL);
+        m_thread = 0;
+    }
+}
+
+void* fs_watcher::worker(void *arg) {
+    fs_watcher *w = (fs_watcher *) arg;
+    w->loop();
+    return w;
+}
+
+void fs_watcher::loop() {
+    // inotify_event后面跟着变长的文件名，按inotify_event对齐
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    fds[0].fd = m_inotifyfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stopfd;
+    fds[1].events = POLLIN;
+
+    while(true) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("poll: %s", strerror(errno));
+            break;
+        }
+        if(fds[1].revents) {
+            break;
+        }
+        while(true) {
+            ssize_t len = ::read(m_inotifyfd, buf, sizeof(buf));
+            if(len <= 0) {
+                break;
+            }
+            for(char *p = buf; p < buf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *) p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if(ev->mask & IN_Q_OVERFLOW) {
+                    // 丢失了事件，不知道哪些路径变了
+                    clear();
+                    continue;
+                }
+                std::map<int, std::string>::iterator it = m_dirs.find(ev->wd);
+                if(it == m_dirs.end()) {
+                    continue;
+                }
+                if(ev->mask & IN_IGNORED) {
+                    // 目录已经被删除，监视被内核移除
+                    m_dirs.erase(it);
+                    continue;
+                }
+                if(ev->len == 0) {
+                    // 目录本身被删除或者改名，下面的路径都已经失效
+                    if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                        clear();
+                    }
+                    continue;
+                }
+                std::string path = it->second + "/" + ev->name;
+                if(m_filter && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    m_filter->add(path.c_str());
+                    // 链接指向的目录下的文件不会以链接路径报告，标记链接，经过它的路径不再被过滤器拒绝
+                    struct stat st;
+                    if(!(ev->mask & IN_ISDIR) && lstat(path.c_str(), &st) == 0 && S_ISLNK(st.st_mode)) {
+                        m_filter->add_link(path.c_str());
+                    }
+                }
+                if(ev->mask & IN_ISDIR) {
+                    if(ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        add_tree(path);
+                        // 目录在建立监视之前可能已经有内容了，比如整个目录被移动进来
+                        if(m_filter) {
+                            m_filter->add_tree(path);
+                        }
+                    } else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        clear();
+                    }
+                    continue;
+                }
+                invalidate(path);
+            }
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef FS_WATCHER_H
+#define FS_WATCHER_H
+#include <pthread.h>
+#include <map>
+#include <string>
+#include "stat_cache.h"
+#include "file_cache.h"
+#include "path_filter.h"
+
+/*
+    网站根目录的inotify监视线程
+    启动时递归监视根目录下的所有子目录，目录中的文件被修改、删除、改名或者权限变化时，
+    立即让对应路径的元数据缓存和文件内容缓存失效，新建的子目录会自动加入监视。
+    子目录被删除或者改名时无法逐个找出其中缓存过的路径，事件队列溢出时可能丢失了事件，
+    这两种情况直接清空所有缓存。
+    只监视真实的目录，不跟随符号链接，http_conn不缓存经过符号链接的路径。
+    设置了路径过滤器时，新建或者改名得到的路径会加入过滤器。
+*/
+class fs_watcher {
+public:
+    // 初始化inotify并监视root下的所有目录，失败时抛出异常，file_cache可以为NULL
+    fs_watcher(const char *root, stat_cache *metas, file_cache *files);
+    ~fs_watcher();
+
+    // 在start之前设置，过滤器应该在监视建立之后再遍历根目录，这样不会漏掉中间新建的文件
+    void set_filter(path_filter *filter) { m_filter = filter; }
+
+    void start();
+    void stop();
+    void join();
+
+    int watch_count() { return (int)m_dirs.size(); }
+
+private:
+    static void* worker(void *arg);
+    void loop();
+    // 监视dir及其所有子目录
+    void add_tree(const std::string &dir);
+    void invalidate(const std::string &path);
+    void clear();
+
+    int m_inotifyfd;
+    int m_stopfd;      // eventfd，写入后监视线程退出
+    pthread_t m_thread;
+    std::string m_root;
+    std::map<int, std::string> m_dirs; // 监视描述符到目录路径，只由监视线程访问
+    stat_cache *m_metas;
+    file_cache *m_files;
+    path_filter *m_filter;
+};
+
+#endif
@@ -1,132 +1,309 @@
 #include "http_conn.h"
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
+#include "reactor.h"
+// 定义HTTP响应的一些状态信息，状态行由status_line给出
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_503_form = "The server is overloaded, please try again later.\n";
 
 // 对static变量初始化
-int http_conn::m_epollfd = -1;  
-int http_conn::m_user_count = 0;  
+std::atomic<int> http_conn::m_user_count(0);
+file_cache *http_conn::m_file_cache = NULL;
+body_handler http_conn::m_body_handler = NULL;
+stat_cache *http_conn::m_stat_cache = NULL;
+path_filter *http_conn::m_path_filter = NULL;
+gzip_compressor *http_conn::m_compressor = NULL;
+access_log *http_conn::m_access_log = NULL;
+bool http_conn::m_stats_enabled = false;
 
-// 网页的根目录
-const char* doc_root = "/home/cly/workplace/learning_cpp/linux_coding/webserver/resources";
-
-// 设置文件描述符非阻塞
-void setnonblocking(int fd){
-    int old_flag = fcntl(fd, F_GETFL);
-    int new_flag = old_flag | O_NONBLOCK;
-    fcntl(fd, F_SETFL, new_flag);
-}
+// 预先生成的完整404应答，下标1为保持连接，0为关闭连接
+// 不存在的路径可能非常多，直接复制整个应答，只在head_len处插入Date头
+struct prebuilt_response {
+    char data[256];
+    int head_len; // 除结尾空行以外的响应头
+    int len;
+};
 
-// 添加文件描述符到epoll中
-void addfd(int epollfd, int fd, bool one_shot){
-    epoll_event event;
-    event.data.fd = fd;
-    // event.events = EPOLLIN | EPOLLRDHUP;
-    event.events = EPOLLIN | EPOLLRDHUP;
-
-    // 避免一个socket事件被多次触发
-    if(one_shot){
-        event.events | EPOLLONESHOT;
+static const prebuilt_response *prebuilt_404() {
+    static prebuilt_response responses[2];
+    static bool built = false;
+    if(!built) {
+        for(int linger = 0; linger < 2; ++linger) {
+            int status_len;
+            const char *status = status_line(404, status_len);
+            const mime_type *mime = html_mime();
+            responses[linger].head_len = snprintf(responses[linger].data, sizeof(responses[linger].data),
+                "%.*sContent-Length: %d\r\nContent-Type: %s\r\nConnection: %s\r\n", status_len, status,
+                (int)strlen(error_404_form), mime->type, linger ? "keep-alive" : "close");
+            responses[linger].len = responses[linger].head_len + snprintf(responses[linger].data + responses[linger].head_len,
+                sizeof(responses[linger].data) - responses[linger].head_len, "\r\n%s", error_404_form);
+        }
+        built = true;
     }
-    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞，利于边沿触发
-    setnonblocking(fd);
+    return responses;
 }
+// 在main之前生成，之后多个工作线程只读
+static const prebuilt_response *prebuilt_404_responses = prebuilt_404();
 
-// 从epoll中删除文件描述符
-void delfd(int epollfd, int fd){
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
+// 过载时的503应答，总是关闭连接，Retry-After让客户端过一会儿再来
+static const prebuilt_response *prebuilt_503() {
+    static prebuilt_response response;
+    int status_len;
+    const char *status = status_line(503, status_len);
+    response.head_len = snprintf(response.data, sizeof(response.data),
+        "%.*sContent-Length: %d\r\nContent-Type: %s\r\nRetry-After: %d\r\nConnection: close\r\n", status_len, status,
+        (int)strlen(error_503_form), html_mime()->type, http_conn::RETRY_AFTER_SECONDS);
+    response.len = response.head_len + snprintf(response.data + response.head_len,
+        sizeof(response.data) - response.head_len, "\r\n%s", error_503_form);
+    return &response;
 }
+static const prebuilt_response *prebuilt_503_response = prebuilt_503();
 
-// 修改文件描述符，重置socket上的EPOLLONSHOT事件
-// 确保下一次可读时，EPOLLIN可以再次被触发
-void modfd(int epollfd, int fd, int ev){
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = ev | EPOLLONESHOT | EPOLLRDBAND;
-    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
-}
+// sendfile单次调用最多能发送的字节数
+const size_t MAX_SENDFILE_CHUNK = 0x7ffff000;
 
-// 从epoll中删除文件描述符
-void removefd(int epollfd, int fd){
-    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
-    close(fd);
-}
+// 网页的根目录，可以用启动参数修改
+const char* doc_root = "/home/cly/workplace/learning_cpp/linux_coding/webserver/resources";
 
 // 初始化连接
-void http_conn::init(int sockfd, const sockaddr_in &addr){
+void http_conn::init(int sockfd, const sockaddr_in &addr, reactor *owner){
     m_sockfd = sockfd;
     m_address = addr;
-
-    // 设置端口复用
-    int reuse = 1;
-    int ret = setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    if(ret == -1){
-        perror("setsocketopt");
-        exit(-1);
-    }
-
-    // 添加到epoll对象中
-    addfd(m_epollfd, sockfd, true);
+    m_reactor = owner;
+    m_file_fd = -1;
+    m_meta = NULL;
+    m_cached = NULL;
+    m_multipart_buf = NULL;
+    m_timer.data = this;
+    // 代数加一、计数清零，上一个连接迟到的end_task不会再改动它
+    m_busy.store(((m_busy.load(std::memory_order_relaxed) >> 16) + 1) << 16, std::memory_order_relaxed);
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_read_idx = 0;
+    m_batch = NULL;
+    m_checked_idx = 0;
+    m_start_line = 0;
+    m_write_block = NULL;
     m_user_count++;
+    metrics::add(M_ACCEPTED);
 
+    reset_request();
     init();
 }
-// 初始化连接其他信息
+// 初始化一批应答的发送状态
+// 工作区在process()中开始生成应答时才借来
 void http_conn::init() {
 
-    bytes_to_send = 0;
-    bytes_have_send = 0;
+    m_segments = m_batch ? m_batch->segments : NULL;
+    m_segment_count = 0;
+    m_segment_capacity = m_batch ? 2 * MAX_PIPELINE : 0;
+    m_segment_idx = 0;
+    m_hold_count = 0;
+    m_write_buf = m_batch ? m_batch->write : NULL;
+    m_write_size = m_batch ? WRITE_BUFFER_SIZE : 0;
+    m_write_idx = 0;
+    m_keep_alive = false;
+}
 
+// 初始化一个请求的解析状态
+void http_conn::reset_request() {
     m_check_state = CHECK_STATE_REQUESTLINE; // 初始化状态为解析请求行
     m_linger = false;
+    m_accept_gzip = false;
+    m_vary = false;
+    m_gzip = false;
+    m_if_none_match = 0;
+    m_if_modified_since = 0;
+    m_range = 0;
+    m_if_range = 0;
+    m_validators = NULL;
+    m_mime = html_mime();
 
-    m_checked_idx = 0;
-    m_start_line = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
     m_method = GET;
     m_version = 0;
     m_url =  0;
     m_host = 0;
     
     m_content_length = 0;
-    
+    m_body_left = 0;
+}
+
+// 丢弃已经处理完的请求（请求行和请求头，请求体在交给处理函数时已经丢弃），
+// 流水线上后续请求的数据移到读缓冲区开头
+void http_conn::finish_request() {
+    int consumed = m_checked_idx;
+    if ( consumed > m_read_idx ) {
+        consumed = m_read_idx;
+    }
+    m_read_idx -= consumed;
+    if ( m_read_idx == 0 ) {
+        // 没有后续请求的数据，还回读缓冲区，等待下一个请求的长连接不占用任何块
+        release_read_buffer();
+    } else if ( m_read_size == buffer_pool::BLOCK_SIZE && m_read_idx <= READ_BUFFER_SIZE ) {
+        // 剩下的数据放得下时把大块换回小块
+        char* slab = buffer_pool::get_slab();
+        memcpy( slab, m_read_buf + consumed, m_read_idx );
+        buffer_pool::put( m_read_buf );
+        m_read_buf = slab;
+        m_read_size = READ_BUFFER_SIZE;
+    } else if ( consumed > 0 ) {
+        memmove( m_read_buf, m_read_buf + consumed, m_read_idx );
+    }
+    m_checked_idx = 0;
+    m_start_line = 0;
+    reset_request();
+}
+
+// 把读缓冲区搬到to，解析出的指向读缓冲区的指针按同样的偏移调整
+void http_conn::move_read_buffer( char* to, int size ) {
+    char* from = m_read_buf;
+    memcpy( to, from, m_read_idx );
+    char** pointers[] = { &m_url, &m_version, &m_host, &m_if_none_match, &m_if_modified_since, &m_range, &m_if_range };
+    for ( size_t i = 0; i < sizeof( pointers ) / sizeof( pointers[0] ); ++i ) {
+        if ( *pointers[i] ) {
+            *pointers[i] = to + ( *pointers[i] - from );
+        }
+    }
+    put_buffer( from, m_read_size );
+    m_read_buf = to;
+    m_read_size = size;
+}
+
+void http_conn::release_read_buffer() {
+    if ( m_read_buf ) {
+        put_buffer( m_read_buf, m_read_size );
+        m_read_buf = NULL;
+        m_read_size = 0;
+    }
+    m_read_idx = 0;
+}
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, WRITE_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
+// 按大小还给对应的池
+void http_conn::put_buffer( char* buffer, int size ) {
+    if ( size == buffer_pool::BLOCK_SIZE ) {
+        buffer_pool::put( buffer );
+    } else {
+        buffer_pool::put_slab( buffer );
+    }
+}
+
+// 开始生成一批应答时借来工作区
+void http_conn::attach_batch() {
+    static_assert( sizeof( response_batch ) <= buffer_pool::SLAB_SIZE, "response_batch must fit in a slab" );
+    m_batch = (response_batch*)buffer_pool::get_slab();
+    m_batch_start = metrics::now_ns();
+    init();
+}
+
+// 流水线上的应答头在工作区的写缓冲区中放不下时，后面的应答写到一个借来的大块中，
+// 已经生成的段仍然指向工作区。每批最多借一个块
+bool http_conn::grow_write_buffer() {
+    if ( m_write_block ) {
+        return false;
+    }
+    m_write_block = buffer_pool::get();
+    m_write_buf = m_write_block;
+    m_write_size = buffer_pool::BLOCK_SIZE;
+    m_write_idx = 0;
+    return true;
+}
+
+// 请求解析之后就不能退回读缓冲区，所以在解析下一个请求之前确认写缓冲区放得下它的应答。
+// /__stats的响应体也写在写缓冲区中，工作区放不下时可以接到块上，块已经借了就要预留整个响应体
+bool http_conn::reserve_response() {
+    if ( m_write_size - m_write_idx < RESPONSE_RESERVE ) {
+        return grow_write_buffer();
+    }
+    return ! m_write_block || ! m_stats_enabled || m_write_size - m_write_idx >= RESPONSE_RESERVE + STATS_BODY_SIZE;
+}
+
+// 当前应答占用的文件和缓存交给这一批应答，整批发送完之后一起释放
+void http_conn::retire_response() {
+    response_hold& hold = m_batch->holds[m_hold_count++];
+    hold.cached = m_cached;
+    hold.meta = m_meta;
+    hold.fd = m_meta ? -1 : m_file_fd;
+    hold.multipart = m_multipart_buf;
+    m_cached = NULL;
+    m_meta = NULL;
+    m_file_fd = -1;
+    m_multipart_buf = NULL;
+    m_keep_alive = m_linger;
+}
+
+// 一次send写出503应答，socket的发送缓冲区是空的，写不完的情况可以忽略
+int http_conn::send_unavailable(int sockfd){
+    const prebuilt_response &response = *prebuilt_503_response;
+    int date_len;
+    const char *date = date_header( date_len );
+    char buf[sizeof( response.data ) + 64];
+    char *p = append( buf, response.data, response.head_len );
+    p = append( p, date, date_len );
+    p = append( p, response.data + response.head_len, response.len - response.head_len );
+    int len = p - buf;
+    send( sockfd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT );
+    metrics::response( 503, len );
+    return len;
+}
+
+// 请求在队列中等得太久，处理完客户端多半也已经放弃了，不解析请求，直接拒绝
+void http_conn::shed(){
+    unsigned generation = task_generation();
+    int len = send_unavailable( m_sockfd );
+    if ( m_access_log ) {
+        m_access_log->append( m_sockfd, 503, len, 0 );
+    }
+    close_conn();
+    end_task( generation );
 }
 
 // 关闭连接
 void http_conn::close_conn(){
     if(m_sockfd != -1) {
-        removefd(m_epollfd, m_sockfd);
+        // 先置为-1再关闭，关闭之后文件描述符可能马上被新连接复用
+        int sockfd = m_sockfd;
         m_sockfd = -1;
+        release_batch();
+        release_read_buffer();
+        m_reactor->detach(sockfd);
         m_user_count--;
+        metrics::add(M_CLOSED);
     }
 }
 
 // 非阻塞读数据
+// 连接上有数据时才借一个小块作读缓冲区，用readv同时读到它剩余的空间和栈上的临时缓冲区，
+// 小块放不下时才换成大块，大多数请求只读一次、只用小块
 bool http_conn::read(){
     // printf("一次性读完数据\n");
-    if(m_read_idx >= READ_BUFFER_SIZE) {
+    if(m_read_idx >= buffer_pool::BLOCK_SIZE) {
+        // 请求头超过了最大长度
         return false;
     }
+    if(!m_read_buf) {
+        m_read_buf = buffer_pool::get_slab();
+        m_read_size = READ_BUFFER_SIZE;
+    }
 
     // 读取到的字节
     int bytes_read = 0;
-    while(true) {
-        bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    char extra[buffer_pool::BLOCK_SIZE - READ_BUFFER_SIZE];
+    // 缓冲区满了就先处理已经读到的请求，剩下的数据留在socket中，水平触发会再次通知
+    while(m_read_idx < buffer_pool::BLOCK_SIZE) {
+        if(m_read_idx == m_read_size) {
+            move_read_buffer(buffer_pool::get(), buffer_pool::BLOCK_SIZE);
+        }
+        struct iovec iv[2];
+        iv[0].iov_base = m_read_buf + m_read_idx;
+        iv[0].iov_len = m_read_size - m_read_idx;
+        iv[1].iov_base = extra;
+        iv[1].iov_len = buffer_pool::BLOCK_SIZE - m_read_size;
+        bytes_read = readv(m_sockfd, iv, iv[1].iov_len > 0 ? 2 : 1);
         if(bytes_read == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
             if(errno == EAGAIN || errno == EWOULDBLOCK) {
                 // 没有数据，不算出错
                 break;
@@ -138,15 +315,60 @@ bool http_conn::read(){
             //对方关闭连接
             return false;
         }
-        m_read_idx += bytes_read;
+        if(bytes_read > (int)iv[0].iov_len) {
+            // 小块满了，换成大块，再把临时缓冲区中的数据接在后面
+            m_read_idx += iv[0].iov_len;
+            move_read_buffer(buffer_pool::get(), buffer_pool::BLOCK_SIZE);
+            memcpy(m_read_buf + m_read_idx, extra, bytes_read - iv[0].iov_len);
+            m_read_idx += bytes_read - iv[0].iov_len;
+        } else {
+            m_read_idx += bytes_read;
+        }
     }
     // printf("读取到了数据：\n%s", m_read_buf);
+    if(m_read_idx == 0) {
+        // 没有读到数据，不占着缓冲区
+        release_read_buffer();
+    }
     return true;
 }
 
-// 主状态机，解析请求
+// io_uring后端由反应堆把收到的数据交给连接，读缓冲区的借用和read()一样：
+// 先借一个小块，放不下时换成大块，大块也满了就不再接收，剩下的数据由反应堆保留
+int http_conn::feed(const char *data, int len){
+    if(!m_read_buf) {
+        m_read_buf = buffer_pool::get_slab();
+        m_read_size = READ_BUFFER_SIZE;
+    }
+    int accepted = 0;
+    while(accepted < len && m_read_idx < buffer_pool::BLOCK_SIZE) {
+        if(m_read_idx == m_read_size) {
+            move_read_buffer(buffer_pool::get(), buffer_pool::BLOCK_SIZE);
+        }
+        int n = m_read_size - m_read_idx;
+        if(n > len - accepted) {
+            n = len - accepted;
+        }
+        memcpy(m_read_buf + m_read_idx, data + accepted, n);
+        m_read_idx += n;
+        accepted += n;
+    }
+    if(m_read_idx == 0) {
+        release_read_buffer();
+    }
+    return accepted;
+}
+
+// 解析请求，得到完整的请求之后找到目标文件
 http_conn::HTTP_CODE 
 http_conn::process_read(){
+    HTTP_CODE ret = parse_request();
+    return ret == GET_REQUEST ? do_request() : ret;
+}
+
+// 主状态机，只解析请求，不访问文件系统，返回GET_REQUEST表示得到了一个完整的请求
+http_conn::HTTP_CODE 
+http_conn::parse_request(){
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
 
@@ -160,7 +382,9 @@ http_conn::process_read(){
         // 获取一行数据
         text = get_line();
         m_start_line = m_checked_idx;
-        printf("got 1 http line : %s\n", text);
+        if(m_check_state != CHECK_STATE_CONTENT) {
+            LOG_DEBUG("got 1 http line : %s", text);
+        }
 
         switch(m_check_state) {
             case CHECK_STATE_REQUESTLINE:{
@@ -176,13 +400,14 @@ http_conn::process_read(){
                     return BAD_REQUEST;
                 }
                 else if(ret == GET_REQUEST) {
-                    return do_request();
+                    return GET_REQUEST;
                 }
+                break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content(text);
                 if(ret == GET_REQUEST) {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -192,6 +417,10 @@ http_conn::process_read(){
             }
         }
     }
+    if(line_status == LINE_BAD) {
+        // 单独的\n或者\r，不等后面的数据，回应400之后关闭连接
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
@@ -199,26 +428,31 @@ http_conn::process_read(){
 http_conn::HTTP_CODE 
 http_conn::parse_request_line(char* text){
     // GET / HTTP/1.1
-    m_url = strpbrk(text, " \t"); // 判断第二个参数中的字符哪个在text中最先出现
-    if (! m_url) { 
+    // 行尾的\r\n已经被改成了\0，行长就是到下一行开头的距离减2
+    char* line_end = m_read_buf + m_checked_idx - 2;
+    m_url = (char*)find_either(text, line_end, ' ', '\t'); // 第一个空格或者制表符
+    if (m_url == line_end) { 
         return BAD_REQUEST;
     }
     // GET\0/index.html HTTP/1.1
+    int method_len = m_url - text;
     *m_url++ = '\0';    // 置位空字符，字符串结束符
     char* method = text;
-    if ( strcasecmp(method, "GET") == 0 ) { // 忽略大小写比较
+    if ( method_len == 3 && strncasecmp(method, "GET", 3) == 0 ) { // 忽略大小写比较
         m_method = GET;
+    } else if ( method_len == 4 && strncasecmp(method, "POST", 4) == 0 ) {
+        // 请求体交给m_body_handler，应答和GET一样
+        m_method = POST;
     } else {
         return BAD_REQUEST;
     }
     // /index.html HTTP/1.1
-    // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    m_version = strpbrk( m_url, " \t" );
-    if (!m_version) {
+    m_version = (char*)find_either( m_url, line_end, ' ', '\t' );
+    if (m_version == line_end) {
         return BAD_REQUEST;
     }
     *m_version++ = '\0';
-    if (strcasecmp( m_version, "HTTP/1.1") != 0 ) {
+    if (line_end - m_version != 8 || strncasecmp( m_version, "HTTP/1.1", 8) != 0 ) {
         return BAD_REQUEST;
     }
     /**
@@ -235,6 +469,23 @@ http_conn::parse_request_line(char* text){
     m_check_state = CHECK_STATE_HEADER; // 检查状态变成检查头
     return NO_REQUEST;
 }
+// Accept-Encoding中是否有gzip（或者*），并且没有用q=0明确拒绝
+static bool accepts_gzip( const char* text ) {
+    while ( *text ) {
+        text += strspn( text, " \t," );
+        const char* end = text + strcspn( text, "," );
+        int name_len = strcspn( text, " \t;," );
+        if ( ( name_len == 4 && strncasecmp( text, "gzip", 4 ) == 0 )
+            || ( name_len == 6 && strncasecmp( text, "x-gzip", 6 ) == 0 )
+            || ( name_len == 1 && text[0] == '*' ) ) {
+            const char* q = strstr( text, "q=" );
+            return !( q && q < end && atof( q + 2 ) == 0 );
+        }
+        text = end;
+    }
+    return false;
+}
+
 // 解析请求头
 http_conn::HTTP_CODE 
 http_conn::parse_headers(char* text){
@@ -244,47 +495,107 @@ http_conn::parse_headers(char* text){
         // 状态机转移到CHECK_STATE_CONTENT状态
         if ( m_content_length != 0 ) {
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_left = m_content_length;
             return NO_REQUEST;
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
-    } else if ( strncasecmp( text, "Connection:", 11 ) == 0 ) {
-        // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn( text, " \t" );
-        if ( strcasecmp( text, "keep-alive" ) == 0 ) {
-            m_linger = true;
-        }
-    } else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 ) {
-        // 处理Content-Length头部字段
-        text += 15;
-        text += strspn( text, " \t" );
-        m_content_length = atol(text);
-    } else if ( strncasecmp( text, "Host:", 5 ) == 0 ) {
-        // 处理Host头部字段
-        text += 5;
-        text += strspn( text, " \t" );
-        m_host = text;
-    } else {
-        printf( "oop! unknow header %s\n", text );
+    }
+
+    // 冒号之前是请求头的名字，用完美哈希一次找到，值跳过开头的空白
+    char* line_end = m_read_buf + m_checked_idx - 2;
+    char* colon = (char*)find_either( text, line_end, ':', ':' );
+    if ( colon == line_end ) {
+        return BAD_REQUEST;
+    }
+    HEADER_ID id = lookup_header( text, colon - text );
+    char* value = colon + 1;
+    value += strspn( value, " \t" );
+    switch ( id ) {
+        case HEADER_CONNECTION:
+            // 处理Connection 头部字段  Connection: keep-alive
+            if ( strcasecmp( value, "keep-alive" ) == 0 ) {
+                m_linger = true;
+            }
+            break;
+        case HEADER_CONTENT_LENGTH: {
+            // 处理Content-Length头部字段
+            char* end = NULL;
+            errno = 0;
+            long long length = strtoll( value, &end, 10 );
+            if ( end == value || *end != '\0' || length < 0 || errno == ERANGE ) {
+                // 长度不对就无法确定请求在哪里结束
+                return BAD_REQUEST;
+            }
+            m_content_length = length;
+            break;
+        }
+        case HEADER_TRANSFER_ENCODING:
+            // 不支持分块的请求体，同样无法确定请求在哪里结束
+            if ( strcasecmp( value, "identity" ) != 0 ) {
+                return BAD_REQUEST;
+            }
+            break;
+        case HEADER_ACCEPT_ENCODING:
+            // 处理Accept-Encoding头部字段  Accept-Encoding: gzip, deflate
+            m_accept_gzip = accepts_gzip( value );
+            break;
+        case HEADER_IF_NONE_MATCH:
+            // 处理If-None-Match头部字段  If-None-Match: "1a2b-3c-4d5e"
+            m_if_none_match = value;
+            break;
+        case HEADER_IF_MODIFIED_SINCE:
+            // 处理If-Modified-Since头部字段  If-Modified-Since: Sat, 28 May 2022 08:00:00 GMT
+            m_if_modified_since = value;
+            break;
+        case HEADER_RANGE:
+            // 处理Range头部字段  Range: bytes=0-499, -500
+            m_range = value;
+            break;
+        case HEADER_IF_RANGE:
+            // 处理If-Range头部字段，值为ETag或者Last-Modified
+            m_if_range = value;
+            break;
+        case HEADER_HOST:
+            // 处理Host头部字段
+            m_host = value;
+            break;
+        case HEADER_UNKNOWN:
+            LOG_DEBUG( "unknown header %s", text );
+            break;
+        default:
+            // 认识但不需要处理的请求头
+            break;
     }
     return NO_REQUEST;
 }
 // 解析请求体
 http_conn::HTTP_CODE 
 http_conn::parse_content(char *text){
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
-    {
-        text[ m_content_length ] = '\0';
-        return GET_REQUEST;
+    // 请求体不必一次收完，已经到达的部分先交给处理函数，然后从读缓冲区中删掉，
+    // 请求行和请求头留在原处，do_request还要用到
+    int len = m_read_idx - m_checked_idx;
+    if ( len > m_body_left ) {
+        len = m_body_left;
     }
-    return NO_REQUEST;
+    if ( len > 0 ) {
+        m_body_left -= len;
+        if ( m_body_handler ) {
+            m_body_handler( m_url, text, len, m_body_left == 0 );
+        }
+        // 请求体之后可能紧跟着流水线上的下一个请求
+        memmove( text, text + len, m_read_idx - m_checked_idx - len );
+        m_read_idx -= len;
+    }
+    return m_body_left == 0 ? GET_REQUEST : NO_REQUEST;
 }
 
 // 解析一行，判断依据\r\n
 http_conn::LINE_STATUS 
 http_conn::parse_line(){
     char tmp;
+    // 向量化地跳过行中间的普通字符，直接停在第一个\r或者\n上
+    m_checked_idx = find_either(m_read_buf + m_checked_idx, m_read_buf + m_read_idx, '\r', '\n') - m_read_buf;
     for(; m_checked_idx < m_read_idx; ++m_checked_idx) {
         tmp = m_read_buf[m_checked_idx];
         if(tmp == '\r') {
@@ -304,7 +615,7 @@ http_conn::parse_line(){
         else if(tmp == '\n'){
             // 这种情况为，上次读到'\r'结束了，所以这一次读到的才是'\n'
             // 同样也处理掉这两个字符，并把m_checked_idx移动到下一行的行首，返回
-            if(m_checked_idx > 1 && m_read_buf[m_check_state-1] == '\r'){
+            if(m_checked_idx > 1 && m_read_buf[m_checked_idx-1] == '\r'){
                 m_read_buf[m_checked_idx-1] = '\0';
                 m_read_buf[m_checked_idx++] = '\0';
                 return LINE_OK;
@@ -315,225 +626,845 @@ http_conn::parse_line(){
     return LINE_OPEN;
 }
 
+// 路径中没有 "//"、"/./"、"/../" 这样的写法时，同一个文件只有这一种路径，
+// 才能用inotify报告的路径让缓存失效，其他写法的请求不经过缓存
+static bool is_canonical(const char *url) {
+    for(const char *p = strchr(url, '/'); p; p = strchr(p + 1, '/')) {
+        if(p[1] == '/' || p[1] == '.') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 解析之后的根目录，根目录本身可以是符号链接
+static char resolved_root[PATH_MAX];
+static int resolve_root() {
+    if ( ! realpath( doc_root, resolved_root ) ) {
+        return -1;
+    }
+    return strlen( resolved_root );
+}
+
+// path（以doc_root开头）解析符号链接之后是否还是它自己。inotify只报告真实路径上的变化，
+// 经过符号链接的路径（包括链接本身）放入缓存之后永远不会失效，所以不缓存。
+// 只在未命中、准备放入缓存时调用，命中的请求仍然不需要任何系统调用
+static bool resolves_to_itself( const char* path ) {
+    static const int root_len = resolve_root();
+    int doc_len = strlen( doc_root );
+    while ( doc_len > 1 && doc_root[doc_len - 1] == '/' ) {
+        --doc_len;
+    }
+    const char* rest = path + doc_len;
+    while ( rest[0] == '/' && rest[1] == '/' ) {
+        ++rest;
+    }
+    char resolved[PATH_MAX];
+    return root_len >= 0 && realpath( path, resolved ) && strncmp( resolved, resolved_root, root_len ) == 0
+        && strcmp( resolved + root_len, rest ) == 0;
+}
+
 http_conn::HTTP_CODE 
 http_conn::do_request(){
+    if ( m_stats_enabled && strcmp( m_url, "/__stats" ) == 0 ) {
+        return STATS_REQUEST;
+    }
     // /home/cly/workplace/learning_cpp/linux_coding/webserver/resources
-    strcpy( m_real_file, doc_root );
+    // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url，只在处理这个请求时使用，不放在连接中
+    char real_file[FILENAME_LEN];
     int len = strlen( doc_root );
-    strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if ( stat( m_real_file, &m_file_stat ) < 0 ) {
+    if ( len >= FILENAME_LEN ) {
         return NO_RESOURCE;
     }
+    memcpy( real_file, doc_root, len );
+    strncpy( real_file + len, m_url, FILENAME_LEN - len - 1 );
+    real_file[FILENAME_LEN - 1] = '\0';
+    bool cacheable = is_canonical( m_url );
 
-    // 判断访问权限
-    if ( ! ( m_file_stat.st_mode & S_IROTH ) ) {
-        return FORBIDDEN_REQUEST;
+    HTTP_CODE ret = open_file( real_file, cacheable );
+    if ( ret != FILE_REQUEST ) {
+        return ret;
+    }
+    m_mime = lookup_mime( real_file );
+    if ( m_mime->compressible ) {
+        m_vary = true;
+        if ( m_accept_gzip ) {
+            negotiate_gzip( real_file, cacheable );
+        }
     }
 
-    // 判断是否是目录
-    if ( S_ISDIR( m_file_stat.st_mode ) ) {
-        return BAD_REQUEST;
+    // 缓存中的文件已经生成好了验证器，只需要复制
+    if ( m_cached ) {
+        m_validators = &m_cached->validators;
+    } else if ( m_meta ) {
+        m_validators = &m_meta->validators;
+    } else {
+        make_validators( m_batch->file_stat, m_batch->validators );
+        m_validators = &m_batch->validators;
+    }
+    if ( not_modified() ) {
+        // 不需要发送响应体，但验证器可能在缓存项中，缓存项被删除后只靠这里的引用维持，
+        // 和200一样由retire_response把引用转交给这一批，整批发送完再释放
+        return NOT_MODIFIED;
+    }
+    return FILE_REQUEST;
+}
+
+// If-Range中的ETag（强比较）或者日期和当前版本一致时Range才生效，没有If-Range时总是生效
+static bool if_range_matches( const char* if_range, const file_validators& v ) {
+    if ( !if_range ) {
+        return true;
+    }
+    if ( if_range[0] == '"' ) {
+        return strcmp( if_range, v.etag ) == 0;
+    }
+    if ( strncmp( if_range, "W/", 2 ) == 0 ) {
+        return false;
     }
+    return strcmp( if_range, v.last_modified ) == 0;
+}
 
-    // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射
-    m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-    close( fd );
+// 根据If-None-Match和If-Modified-Since判断客户端缓存的版本是否仍然有效，
+// 两者都有时只看If-None-Match
+bool http_conn::not_modified() {
+    if ( m_if_none_match ) {
+        const char* p = m_if_none_match;
+        int etag_len = strlen( m_validators->etag );
+        while ( *p ) {
+            p += strspn( p, " \t," );
+            if ( *p == '*' ) {
+                return true;
+            }
+            // 弱比较，忽略W/前缀
+            if ( strncmp( p, "W/", 2 ) == 0 ) {
+                p += 2;
+            }
+            int len = strcspn( p, " \t," );
+            if ( len == etag_len && strncmp( p, m_validators->etag, len ) == 0 ) {
+                return true;
+            }
+            p += len;
+        }
+        return false;
+    }
+    if ( m_if_modified_since ) {
+        // 浏览器通常原样带回上一次的Last-Modified，先直接比较字符串
+        if ( strcmp( m_if_modified_since, m_validators->last_modified ) == 0 ) {
+            return true;
+        }
+        struct tm tm;
+        memset( &tm, 0, sizeof( tm ) );
+        const char* end = strptime( m_if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm );
+        if ( !end || *end != '\0' ) {
+            return false;
+        }
+        return m_batch->file_stat.st_mtim.tv_sec <= timegm( &tm );
+    }
+    return false;
+}
+
+// 客户端接受gzip时，优先发送同目录下较新的.gz文件，其次发送缓存中压缩好的版本，
+// 都没有时提交后台压缩任务，这一次仍然发送原文件，请求本身不做任何压缩
+void http_conn::negotiate_gzip( const char* real_file, bool cacheable ) {
+    // 保存原文件
+    cached_file* cached = m_cached;
+    file_meta* meta = m_meta;
+    int fd = m_file_fd;
+    struct stat st = m_batch->file_stat;
+    m_cached = NULL;
+    m_meta = NULL;
+    m_file_fd = -1;
+
+    char gz_path[FILENAME_LEN + 4];
+    snprintf( gz_path, sizeof( gz_path ), "%s.gz", real_file );
+    bool sidecar = open_file( gz_path, cacheable ) == FILE_REQUEST
+        && ( m_batch->file_stat.st_mtim.tv_sec > st.st_mtim.tv_sec
+            || ( m_batch->file_stat.st_mtim.tv_sec == st.st_mtim.tv_sec && m_batch->file_stat.st_mtim.tv_nsec >= st.st_mtim.tv_nsec ) );
+
+    cached_file* variant = NULL;
+    if ( !sidecar ) {
+        // .gz文件不存在或者比原文件旧
+        release_file();
+        if ( cacheable && m_file_cache && m_compressor ) {
+            char key[FILENAME_LEN + 64];
+            gzip_compressor::variant_key( key, sizeof( key ), real_file, st );
+            variant = m_file_cache->get( key );
+            if ( !variant ) {
+                m_compressor->submit( real_file, key, st );
+            }
+        }
+        if ( !variant ) {
+            m_cached = cached;
+            m_meta = meta;
+            m_file_fd = fd;
+            m_batch->file_stat = st;
+            return;
+        }
+    }
+
+    // 换成压缩的版本，释放原文件
+    cached_file* gz_cached = variant ? variant : m_cached;
+    file_meta* gz_meta = m_meta;
+    int gz_fd = m_file_fd;
+    struct stat gz_st = variant ? variant->st : m_batch->file_stat;
+    m_cached = cached;
+    m_meta = meta;
+    m_file_fd = fd;
+    release_file();
+    m_cached = gz_cached;
+    m_meta = gz_meta;
+    m_file_fd = gz_fd;
+    m_batch->file_stat = gz_st;
+    m_gzip = true;
+}
+
+// 查找并打开文件，设置m_batch->file_stat以及发送响应体用的m_cached或者m_file_fd
+http_conn::HTTP_CODE 
+http_conn::open_file( const char* path, bool cacheable ) {
+    // 命中缓存时不需要任何文件系统调用，缓存中只有检查过权限的普通文件
+    if ( cacheable && m_file_cache && ( m_cached = m_file_cache->get( path ) ) ) {
+        m_batch->file_stat = m_cached->st;
+        return FILE_REQUEST;
+    }
+    // 过滤器中没有的路径一定不存在，不需要访问文件系统
+    if ( cacheable && m_path_filter && ! m_path_filter->may_contain( path ) ) {
+        return NO_RESOURCE;
+    }
+    // 在stat之前读取epoch，之后有文件变化时不缓存这一次得到的结果
+    unsigned long file_epoch = m_file_cache ? m_file_cache->epoch() : 0;
+    if ( cacheable && m_stat_cache && ( m_meta = m_stat_cache->get( path ) ) ) {
+        m_batch->file_stat = m_meta->st;
+    } else {
+        unsigned long meta_epoch = m_stat_cache ? m_stat_cache->epoch() : 0;
+        // 获取path文件的相关的状态信息，-1失败，0成功
+        if ( stat( path, &m_batch->file_stat ) < 0 ) {
+            return NO_RESOURCE;
+        }
+
+        // 判断访问权限
+        if ( ! ( m_batch->file_stat.st_mode & S_IROTH ) ) {
+            return FORBIDDEN_REQUEST;
+        }
+
+        // 判断是否是目录
+        if ( S_ISDIR( m_batch->file_stat.st_mode ) ) {
+            return BAD_REQUEST;
+        }
+
+        // 以只读方式打开文件，响应体发送完之前一直保持打开
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if ( fd < 0 ) {
+            return NO_RESOURCE;
+        }
+        if ( cacheable && ( m_stat_cache || m_file_cache ) && ! resolves_to_itself( path ) ) {
+            cacheable = false;
+        }
+        if ( cacheable && m_stat_cache ) {
+            // 文件描述符交给元数据缓存，由所有请求这个路径的连接共享
+            m_meta = m_stat_cache->insert( path, fd, m_batch->file_stat, meta_epoch );
+        } else {
+            m_file_fd = fd;
+        }
+    }
+    if ( m_meta ) {
+        m_file_fd = m_meta->fd;
+    }
+
+    // 按准入策略读入缓存，成功后就不再需要文件描述符
+    if ( cacheable && m_file_cache
+        && ( m_cached = m_file_cache->load( path, m_file_fd, m_batch->file_stat, file_epoch ) ) ) {
+        release_fd();
+    }
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
-void http_conn::unmap() {
-    if( m_file_address )
+// 释放响应体使用的文件描述符，属于元数据缓存时只释放引用
+void http_conn::release_fd() {
+    if( m_meta )
+    {
+        stat_cache::release( m_meta );
+        m_meta = NULL;
+    }
+    else if( m_file_fd != -1 )
+    {
+        close( m_file_fd );
+    }
+    m_file_fd = -1;
+}
+
+// 关闭当前应答正在使用的文件，释放缓存的引用和多区间应答的缓冲区
+void http_conn::release_file() {
+    release_fd();
+    if( m_cached )
+    {
+        file_cache::release( m_cached );
+        m_cached = NULL;
+    }
+    if( m_multipart_buf )
+    {
+        delete[] m_multipart_buf;
+        m_multipart_buf = NULL;
+    }
+}
+
+// 释放这一批所有应答占用的资源
+void http_conn::release_batch() {
+    release_file();
+    for( int i = 0; i < m_hold_count; ++i )
+    {
+        response_hold& hold = m_batch->holds[i];
+        if( hold.cached ) {
+            file_cache::release( hold.cached );
+        }
+        if( hold.meta ) {
+            stat_cache::release( hold.meta );
+        }
+        if( hold.fd != -1 ) {
+            close( hold.fd );
+        }
+        delete[] hold.multipart;
+    }
+    m_hold_count = 0;
+    if( m_write_block )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        buffer_pool::put( m_write_block );
+        m_write_block = NULL;
     }
+    if( m_batch )
+    {
+        if( m_segments != m_batch->segments ) {
+            delete[] m_segments;
+        }
+        buffer_pool::put_slab( (char*)m_batch );
+        m_batch = NULL;
+    }
+    m_segments = NULL;
+    m_segment_capacity = 0;
+    m_write_buf = NULL;
+    m_write_size = 0;
+}
+
+// 解析Range: bytes=a-b, a-, -n，偏移量用无符号64位解析并和文件大小比较，不会溢出。
+// 返回在文件范围内的区间个数；-1表示所有区间都超出文件范围，应答416；
+// 0表示忽略Range发送整个文件：单位不是bytes、语法错误、区间过多或者区间总长超过文件（重叠的区间）
+int http_conn::parse_range( off_t size, off_t* starts, off_t* lengths ) {
+    const char* p = m_range;
+    if ( strncasecmp( p, "bytes=", 6 ) != 0 ) {
+        return 0;
+    }
+    p += 6;
+    int count = 0;
+    int specs = 0;
+    unsigned long long total = 0;
+    while ( true ) {
+        p += strspn( p, " \t" );
+        if ( *p == '\0' ) {
+            break;
+        }
+        if ( *p == ',' ) {
+            ++p;
+            continue;
+        }
+        if ( ++specs > MAX_RANGES ) {
+            return 0;
+        }
+        unsigned long long first = 0, last = 0;
+        bool has_first = false, has_last = false;
+        // 数字太长时直接视为很大的值，只需要和文件大小比较
+        while ( *p >= '0' && *p <= '9' ) {
+            first = first > ( 1ULL << 62 ) ? first : first * 10 + ( *p++ - '0' );
+            has_first = true;
+        }
+        if ( *p++ != '-' ) {
+            return 0;
+        }
+        while ( *p >= '0' && *p <= '9' ) {
+            last = last > ( 1ULL << 62 ) ? last : last * 10 + ( *p++ - '0' );
+            has_last = true;
+        }
+        p += strspn( p, " \t" );
+        if ( *p != ',' && *p != '\0' ) {
+            return 0;
+        }
+        unsigned long long start, end; // [start, end]
+        if ( !has_first ) {
+            // 最后last个字节
+            if ( !has_last ) {
+                return 0;
+            }
+            if ( last == 0 || size == 0 ) {
+                continue;
+            }
+            start = last >= (unsigned long long)size ? 0 : size - last;
+            end = size - 1;
+        } else {
+            if ( has_last && last < first ) {
+                return 0;
+            }
+            if ( first >= (unsigned long long)size ) {
+                continue;
+            }
+            start = first;
+            end = ( !has_last || last >= (unsigned long long)size ) ? size - 1 : last;
+        }
+        starts[count] = start;
+        lengths[count] = end - start + 1;
+        total += end - start + 1;
+        ++count;
+    }
+    if ( specs == 0 ) {
+        return 0;
+    }
+    if ( count == 0 ) {
+        return -1;
+    }
+    return total > (unsigned long long)size ? 0 : count;
+}
+
+// 添加一个待发送的段，data为NULL时是当前文件中的区间
+void http_conn::add_segment( const char* data, off_t offset, off_t length ) {
+    if ( m_segment_count == m_segment_capacity ) {
+        // 工作区中的段只够整批普通应答使用，多区间应答的段多时换成两倍大小的数组
+        int capacity = m_segment_capacity * 2;
+        body_segment* segments = new body_segment[capacity];
+        memcpy( segments, m_segments, m_segment_count * sizeof( body_segment ) );
+        if ( m_segments != m_batch->segments ) {
+            delete[] m_segments;
+        }
+        m_segments = segments;
+        m_segment_capacity = capacity;
+    }
+    m_batch->holds[m_hold_count].bytes += length;
+    body_segment& seg = m_segments[m_segment_count++];
+    seg.data = data;
+    seg.offset = offset;
+    seg.length = length;
+    seg.fd = data ? -1 : m_file_fd;
+}
+
+// 生成多区间应答的分段头，返回false时写缓冲区或者分段缓冲区不够
+bool http_conn::setup_ranges( int count, const off_t* starts, const off_t* lengths ) {
+    static std::atomic<unsigned long> boundary_seq( 0 );
+    // 每个分段头不超过160字节
+    const int part_len = 160;
+    m_multipart_buf = new char[32 + ( count + 1 ) * part_len];
+    snprintf( m_multipart_buf, 32, "%08lx%08lx", (unsigned long)getpid() & 0xffffffff,
+        boundary_seq.fetch_add( 1, std::memory_order_relaxed ) & 0xffffffff );
+
+    const char* source = m_cached ? m_cached->data : NULL;
+    char* part = m_multipart_buf + 32;
+    off_t content_length = 0;
+    int header = m_segment_count;
+    add_segment( m_write_buf + m_response_start, 0, 0 ); // 响应头，长度在最后填上
+    for ( int i = 0; i < count; ++i ) {
+        char* p = append( part, LITERAL( "\r\n--" ) );
+        p = append( p, m_multipart_buf, BOUNDARY_LEN );
+        p = append( p, LITERAL( "\r\nContent-Type: " ) );
+        p = append( p, m_mime->type, m_mime->type_len );
+        p = append( p, LITERAL( "\r\nContent-Range: bytes " ) );
+        p = append_uint( p, starts[i] );
+        *p++ = '-';
+        p = append_uint( p, starts[i] + lengths[i] - 1 );
+        *p++ = '/';
+        p = append_uint( p, m_batch->file_stat.st_size );
+        p = append( p, LITERAL( "\r\n\r\n" ) );
+        int len = p - part;
+        add_segment( part, 0, len );
+        add_segment( source, starts[i], lengths[i] );
+        content_length += len + lengths[i];
+        part = p;
+    }
+    char* p = append( part, LITERAL( "\r\n--" ) );
+    p = append( p, m_multipart_buf, BOUNDARY_LEN );
+    p = append( p, LITERAL( "--\r\n" ) );
+    int len = p - part;
+    add_segment( part, 0, len );
+    content_length += len;
+
+    add_status_line( 206 );
+    if ( ! add_headers( content_length ) ) {
+        return false;
+    }
+    m_segments[header].length = m_write_idx - m_response_start;
+    return true;
+}
+
+// 取出下一次要发送的内容，跳过已经发完的段
+int http_conn::next_send( struct iovec* iov, int max_iov, size_t max_file, int& fd, off_t& offset, size_t& length, bool& more ) {
+    while ( m_segment_idx < m_segment_count && m_segments[m_segment_idx].length == 0 ) {
+        ++m_segment_idx;
+    }
+    if ( m_segment_idx == m_segment_count ) {
+        return -1;
+    }
+    body_segment* seg = &m_segments[m_segment_idx];
+    if ( !seg->data ) {
+        fd = seg->fd;
+        offset = seg->offset;
+        length = seg->length > (off_t)max_file ? max_file : (size_t)seg->length;
+        more = length < (size_t)seg->length || m_segment_idx + 1 < m_segment_count;
+        return 0;
+    }
+    int count = 0;
+    int i = m_segment_idx;
+    for ( ; i < m_segment_count && m_segments[i].data && count < max_iov; ++i ) {
+        if ( m_segments[i].length > 0 ) {
+            iov[count].iov_base = (char*)m_segments[i].data + m_segments[i].offset;
+            iov[count++].iov_len = m_segments[i].length;
+        }
+    }
+    more = i < m_segment_count;
+    return count;
 }
 
 // 非阻塞写数据
+// 依次发送应答的各段：连续的内存段（响应头、缓存的文件内容、分段头）用一次sendmsg分散写出，
+// 文件区间用sendfile从文件直接发送，不经过用户态拷贝。
+// 遇到EAGAIN时已发送的进度保存在各段中，等下一次EPOLLOUT从断点继续。
 bool http_conn::write(){
-    int temp = 0;
-    
-    if ( bytes_to_send == 0 ) {
-        // 将要发送的字节为0，这一次响应结束。
-        modfd( m_epollfd, m_sockfd, EPOLLIN ); 
-        init();
-        return true;
-    }
+    ssize_t temp = 0;
 
-    while(1) {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+    while ( m_segment_idx < m_segment_count ) {
+        struct iovec iv[MAX_IOV];
+        int fd;
+        off_t offset;
+        size_t length;
+        bool more;
+        int count = next_send( iv, MAX_IOV, MAX_SENDFILE_CHUNK, fd, offset, length, more );
+        if ( count < 0 ) {
+            break;
+        }
+        if ( count > 0 ) {
+            struct msghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_iov = iv;
+            msg.msg_iovlen = count;
+            // 后面还有段要发送时带上MSG_MORE，让内核把响应头和文件的开头合并成满的报文段
+            temp = sendmsg( m_sockfd, &msg, more ? MSG_MORE : 0 );
+        } else {
+            temp = sendfile( m_sockfd, fd, &offset, length );
+            if ( temp == 0 ) {
+                // 文件在发送过程中被截断，已经发出的Content-Length无法兑现，只能关闭连接
+                release_batch();
+                return false;
+            }
+        }
         if ( temp <= -1 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if( errno == EAGAIN ) {
-                modfd( m_epollfd, m_sockfd, EPOLLOUT );
+                m_reactor->resume( m_sockfd, true );
                 return true;
             }
-            unmap();
+            release_batch();
             return false;
         }
+        consume( temp );
+    }
 
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
+    // 没有数据要发送了
+    if ( ! finish_send() ) {
+        return false;
+    }
+    // 读缓冲区中还有流水线上后续请求的数据时，由反应堆直接交给线程池处理，不等待EPOLLIN
+    if ( m_read_idx == 0 ) {
+        m_reactor->resume( m_sockfd, false );
+    }
+    return true;
+}
 
-        if (bytes_have_send >= m_iv[0].iov_len)
-        {
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
+// 整批应答发送完，短连接返回false，长连接准备处理下一批
+bool http_conn::finish_send() {
+    long long now = metrics::now_ns();
+    metrics::record( H_WRITE, now - m_batch_ready );
+    for ( int i = 0; i < m_hold_count; ++i ) {
+        const response_hold& hold = m_batch->holds[i];
+        metrics::response( hold.status, hold.bytes );
+        if ( m_access_log ) {
+            m_access_log->append( m_sockfd, hold.status, hold.bytes, now - m_batch_start );
         }
-        else
-        {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
-        }
-
-        if (bytes_to_send <= 0)
-        {
-            // 没有数据要发送了
-            unmap();
-            modfd(m_epollfd, m_sockfd, EPOLLIN);
+    }
+    release_batch();
+    if ( ! m_keep_alive ) {
+        return false;
+    }
+    init();
+    return true;
+}
 
-            if (m_linger)
-            {
-                init();
-                return true;
-            }
-            else
-            {
-                return false;
-            }
-        }   
+// 发送了bytes字节后推进各段，文件段的offset也一起前进
+void http_conn::consume( size_t bytes ) {
+    while ( bytes > 0 && m_segment_idx < m_segment_count ) {
+        body_segment& seg = m_segments[m_segment_idx];
+        off_t take = (off_t)bytes < seg.length ? (off_t)bytes : seg.length;
+        seg.offset += take;
+        seg.length -= take;
+        bytes -= take;
+        if ( seg.length == 0 ) {
+            ++m_segment_idx;
+        }
     }
 }
 
-// 往写缓冲中写入待发送的数据
-bool http_conn::add_response( const char* format, ... ) {
-    if( m_write_idx >= WRITE_BUFFER_SIZE ) {
+// 往写缓冲中追加一段数据，响应头都由预先生成的片段拼接而成，不经过printf
+bool http_conn::add_response( const char* data, int len ) {
+    if( len > m_write_size - m_write_idx ) {
         return false;
     }
-    va_list arg_list;
-    va_start( arg_list, format );
-    int len = vsnprintf( m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list );
-    if( len >= ( WRITE_BUFFER_SIZE - 1 - m_write_idx ) ) {
+    memcpy( m_write_buf + m_write_idx, data, len );
+    m_write_idx += len;
+    return true;
+}
+
+bool http_conn::add_number( unsigned long long value ) {
+    // 最多20位
+    if( m_write_size - m_write_idx < 20 ) {
         return false;
     }
-    m_write_idx += len;
-    va_end( arg_list );
+    m_write_idx += format_uint( m_write_buf + m_write_idx, value );
     return true;
 }
 
-bool http_conn::add_status_line( int status, const char* title ) {
-    return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+bool http_conn::add_status_line( int status ) {
+    m_batch->holds[m_hold_count].status = status;
+    int len;
+    const char* line = status_line( status, len );
+    return add_response( line, len );
 }
 
-bool http_conn::add_headers(int content_len) {
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
-    return true;
+bool http_conn::add_headers(off_t content_len) {
+    return add_content_length(content_len) && add_content_type() && add_validators()
+        && add_encoding() && add_linger() && add_date() && add_blank_line();
 }
 
-bool http_conn::add_content_length(int content_len) {
-    return add_response( "Content-Length: %d\r\n", content_len );
+bool http_conn::add_content_length(off_t content_len) {
+    return add_response( LITERAL( "Content-Length: " ) ) && add_number( content_len )
+        && add_response( LITERAL( "\r\n" ) );
 }
 
 bool http_conn::add_linger()
 {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    if ( m_linger ) {
+        return add_response( LITERAL( "Connection: keep-alive\r\n" ) );
+    }
+    return add_response( LITERAL( "Connection: close\r\n" ) );
+}
+
+bool http_conn::add_date()
+{
+    int len;
+    const char* date = date_header( len );
+    return add_response( date, len );
+}
+
+// 文件应答带上ETag和Last-Modified，直接复制已经生成好的头部，错误应答没有验证器
+bool http_conn::add_validators()
+{
+    if ( !m_validators ) {
+        return true;
+    }
+    // 文件应答都支持Range
+    return add_response( m_validators->headers, m_validators->headers_len )
+        && add_response( LITERAL( "Accept-Ranges: bytes\r\n" ) );
+}
+
+bool http_conn::add_encoding()
+{
+    if ( m_gzip && ! add_response( LITERAL( "Content-Encoding: gzip\r\n" ) ) ) {
+        return false;
+    }
+    if ( m_vary ) {
+        return add_response( LITERAL( "Vary: Accept-Encoding\r\n" ) );
+    }
+    return true;
 }
 
 bool http_conn::add_blank_line()
 {
-    return add_response( "%s", "\r\n" );
+    return add_response( LITERAL( "\r\n" ) );
 }
 
 bool http_conn::add_content( const char* content )
 {
-    return add_response( "%s", content );
+    return add_response( content, strlen( content ) );
 }
 
 bool http_conn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+    if ( m_multipart_buf ) {
+        return add_response( LITERAL( "Content-Type: multipart/byteranges; boundary=" ) )
+            && add_response( m_multipart_buf, BOUNDARY_LEN ) && add_response( LITERAL( "\r\n" ) );
+    }
+    return add_response( LITERAL( "Content-Type: " ) ) && add_response( m_mime->type, m_mime->type_len )
+        && add_response( LITERAL( "\r\n" ) );
 }
 
 // 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
 bool http_conn::process_write(HTTP_CODE ret) {
-    // printf("read ret:%d\n", ret);
+    m_response_start = m_write_idx;
+    // 当前应答的状态码和长度记在下一个要转交的hold中
+    m_batch->holds[m_hold_count].status = 0;
+    m_batch->holds[m_hold_count].bytes = 0;
     switch (ret)
     {
         case INTERNAL_ERROR:
-            add_status_line( 500, error_500_title );
+            add_status_line( 500 );
             add_headers( strlen( error_500_form ) );
             if ( ! add_content( error_500_form ) ) {
                 return false;
             }
             break;
         case BAD_REQUEST:
-            add_status_line( 400, error_400_title );
+            add_status_line( 400 );
             add_headers( strlen( error_400_form ) );
             if ( ! add_content( error_400_form ) ) {
                 return false;
             }
             break;
-        case NO_RESOURCE:
-            add_status_line( 404, error_404_title );
-            add_headers( strlen( error_404_form ) );
-            if ( ! add_content( error_404_form ) ) {
+        case NO_RESOURCE: {
+            const prebuilt_response &response = prebuilt_404_responses[m_linger ? 1 : 0];
+            m_batch->holds[m_hold_count].status = 404;
+            if ( ! add_response( response.data, response.head_len ) || ! add_date()
+                || ! add_response( response.data + response.head_len, response.len - response.head_len ) ) {
                 return false;
             }
             break;
+        }
+        case NOT_MODIFIED:
+            // 304没有响应体
+            add_status_line( 304 );
+            add_validators();
+            add_encoding();
+            add_linger();
+            add_date();
+            add_blank_line();
+            break;
         case FORBIDDEN_REQUEST:
-            add_status_line( 403, error_403_title );
+            add_status_line( 403 );
             add_headers(strlen( error_403_form));
             if ( ! add_content( error_403_form ) ) {
                 return false;
             }
             break;
-        case FILE_REQUEST:
-            add_status_line(200, ok_200_title );
-            add_headers(m_file_stat.st_size);
-            m_iv[ 0 ].iov_base = m_write_buf;
-            m_iv[ 0 ].iov_len = m_write_idx;
-            m_iv[ 1 ].iov_base = m_file_address;
-            m_iv[ 1 ].iov_len = m_file_stat.st_size;
-            m_iv_count = 2;
-
-            bytes_to_send = m_write_idx + m_file_stat.st_size;
-
+        case FILE_REQUEST: {
+            // 响应体由write()从缓存的内存或者用sendfile从文件描述符发送
+            const char* source = m_cached ? m_cached->data : NULL;
+            off_t starts[MAX_RANGES], lengths[MAX_RANGES];
+            // 同一个文件先后可能发送原文件或者压缩版本，没有If-Range的客户端会把两者的片段拼在一起，只对原文件处理Range
+            int count = m_range && !m_gzip && if_range_matches( m_if_range, *m_validators )
+                ? parse_range( m_batch->file_stat.st_size, starts, lengths ) : 0;
+            if ( count == -1 ) {
+                // 416，不需要发送文件，引用仍然保留到这一批发送完，add_headers还要读验证器
+                add_status_line( 416 );
+                add_response( LITERAL( "Content-Range: bytes */" ) );
+                add_number( m_batch->file_stat.st_size );
+                add_response( LITERAL( "\r\n" ) );
+                add_headers( 0 );
+                break;
+            }
+            if ( count > 1 ) {
+                return setup_ranges( count, starts, lengths );
+            }
+            if ( count == 1 ) {
+                add_status_line( 206 );
+                add_response( LITERAL( "Content-Range: bytes " ) );
+                add_number( starts[0] );
+                add_response( LITERAL( "-" ) );
+                add_number( starts[0] + lengths[0] - 1 );
+                add_response( LITERAL( "/" ) );
+                add_number( m_batch->file_stat.st_size );
+                add_response( LITERAL( "\r\n" ) );
+            } else {
+                add_status_line( 200 );
+                starts[0] = 0;
+                lengths[0] = m_batch->file_stat.st_size;
+            }
+            if ( ! add_headers( lengths[0] ) ) {
+                return false;
+            }
+            add_segment( m_write_buf + m_response_start, 0, m_write_idx - m_response_start );
+            add_segment( source, starts[0], lengths[0] );
             return true;
+        }
+        case STATS_REQUEST: {
+            // 每次请求都重新汇总所有线程的指标，响应体和响应头一起放在写缓冲区中
+            static thread_local char body[STATS_BODY_SIZE];
+            static thread_local metrics::snapshot snap;
+            metrics::collect( metrics::shared(), snap );
+            int body_len = metrics::format_prometheus( snap, body, sizeof( body ) );
+            if ( m_write_size - m_write_idx < body_len + RESPONSE_RESERVE ) {
+                if ( ! grow_write_buffer() ) {
+                    return false;
+                }
+                m_response_start = 0;
+            }
+            m_mime = lookup_mime( "/__stats.txt" );
+            add_status_line( 200 );
+            add_headers( body_len );
+            if ( ! add_response( body, body_len ) ) {
+                return false;
+            }
+            break;
+        }
         default:
             return false;
     }
 
-    m_iv[ 0 ].iov_base = m_write_buf;
-    m_iv[ 0 ].iov_len = m_write_idx;
-    m_iv_count = 1;
-    bytes_to_send = m_write_idx;
+    add_segment( m_write_buf + m_response_start, 0, m_write_idx - m_response_start );
     return true;
 }
 
 // 由线程池的工作线程调用，这是处理HTTP请求的入口函数
 void http_conn::process() {
     // 解析 HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == NO_REQUEST) {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        return;
+    // 流水线：依次处理读缓冲区中所有完整的请求，应答排在一起，由一次EPOLLOUT合并发送
+    int responses = 0;
+    unsigned generation = task_generation();
+    if(!m_batch) {
+        attach_batch();
     }
-    // printf("read ret:%d\n", read_ret);
-    // printf("parse request, create response...\n");
-    
-    // 生成相应
-    bool write_ret = process_write(read_ret);
-    if(!write_ret) {
-        close_conn();
+    while(true) {
+        long long parse_begin = metrics::now_ns();
+        HTTP_CODE read_ret = process_read();
+        if(read_ret != NO_REQUEST) {
+            metrics::record(H_PARSE, metrics::now_ns() - parse_begin);
+        }
+        if(read_ret == NO_REQUEST && m_read_idx >= buffer_pool::BLOCK_SIZE) {
+            // 读缓冲区已经是最大的块，还是放不下请求头
+            read_ret = BAD_REQUEST;
+        }
+        if(read_ret == NO_REQUEST) {
+            // 剩下的数据不是完整的请求，解析状态保留到下次读到数据
+            break;
+        }
+        if(read_ret == BAD_REQUEST) {
+            // 无法确定这个请求在哪里结束，后面的数据也没法解析，应答之后关闭连接
+            m_linger = false;
+        }
+        // 生成相应
+        if(!process_write(read_ret)) {
+            close_conn();
+            end_task(generation);
+            return;
+        }
+        retire_response();
+        finish_request();
+        ++responses;
+        if(!m_keep_alive || responses >= MAX_PIPELINE || !reserve_response()) {
+            // 剩下的请求等这一批发送完之后再处理
+            break;
+        }
+    }
+    if(responses == 0) {
+        // 请求还不完整，等待期间不占用工作区
+        release_batch();
+    } else {
+        m_batch_ready = metrics::now_ns();
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
+    m_reactor->resume(m_sockfd, responses > 0);
+    // 最后一步，之后本线程不再访问这个连接，反应堆的超时处理可以关闭它了。
+    // 交还之后连接可能已经被关闭、槽位被新连接复用，代数不同时end_task什么也不做
+    end_task(generation);
 }
\ No newline at end of file
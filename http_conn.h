@@ -11,20 +11,56 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include <stdarg.h>
+#include <sys/sendfile.h>
 #include <string.h>
 #include <sys/uio.h>
 #include <errno.h>
+#include <limits.h>
+#include <atomic>
 #include "locker.h"
+#include "file_cache.h"
+#include "stat_cache.h"
+#include "path_filter.h"
+#include "compressor.h"
+#include "timer_wheel.h"
+#include "io_buffer.h"
+#include "http_scan.h"
+#include "http_response.h"
+#include "access_log.h"
+#include "log.h"
+#include "metrics.h"
 
-class http_conn {
+extern const char* doc_root; // 网页的根目录
+
+class reactor;
+
+/*
+    请求体的处理函数，请求体的数据每到达一段就在工作线程中调用一次，调用之后数据就被丢弃，
+    请求体不会在内存中累积。last为true时是最后一段，没有请求体的请求不会调用
+*/
+typedef void (*body_handler)(const char *url, const char *data, int len, bool last);
+
+// 对齐到缓存行，连接表中每个连接的热数据都从缓存行开头开始
+class alignas(64) http_conn {
 public:
-    static int m_epollfd;  // 所有的socket上的时间都被注册到同一个epollfd上
-    static int m_user_count;  // 统计用户的数量
+    static std::atomic<int> m_user_count;  // 统计用户的数量，多个反应堆会同时修改
+    static file_cache *m_file_cache; // 所有连接共享的静态文件缓存，NULL表示不缓存
+    static stat_cache *m_stat_cache; // 所有连接共享的路径元数据缓存，NULL表示每个请求都stat和open
+    static path_filter *m_path_filter; // 存在路径的布隆过滤器，一定不存在的路径直接返回404，NULL表示不过滤
+    static gzip_compressor *m_compressor; // 后台压缩线程，NULL表示只使用预先压缩好的.gz文件
+    static body_handler m_body_handler; // 请求体的处理函数，NULL表示丢弃请求体
+    static access_log *m_access_log; // 二进制访问日志，NULL表示不记录
+    static bool m_stats_enabled; // 是否响应/__stats，输出Prometheus文本格式的运行指标
+    static const int STATS_BODY_SIZE = 8192; // /__stats响应体的最大长度
     static const int FILENAME_LEN = 200;  // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048; // 读缓冲区大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+    static const int READ_BUFFER_SIZE = buffer_pool::SLAB_SIZE; // 读缓冲区先借一个小块，放不下时换成大块
+    static const int WRITE_BUFFER_SIZE = 2048; // 工作区中写缓冲区的大小，放不下时接着写到一个大块中
+    static const int RESPONSE_RESERVE = 512; // 写缓冲区剩余空间少于这个值时不再生成下一个应答
+    static const int MAX_PIPELINE = 16; // 一次最多连续处理的流水线请求数，它们的应答合并发送
+    static const int MAX_RANGES = 16; // 一个Range请求最多的区间数，超过时忽略Range发送整个文件
+    static const int MAX_IOV = 64; // 一次sendmsg最多分散写出的内存段数
+    static const int BOUNDARY_LEN = 16; // 多区间应答的分隔符长度
+    static const int RETRY_AFTER_SECONDS = 1; // 过载时503应答中的Retry-After
     
     // HTTP请求方法，这里只支持GET
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
@@ -47,8 +83,11 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        NOT_MODIFIED        :   客户端缓存的版本仍然有效，返回304
+        RANGE_NOT_SATISFIABLE : Range中没有一个区间在文件范围内，返回416
+        STATS_REQUEST       :   请求的是/__stats，返回运行指标
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, NOT_MODIFIED, RANGE_NOT_SATISFIABLE, STATS_REQUEST };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
@@ -61,48 +100,150 @@ public:
     ~http_conn() {}
 
     void process(); // 处理客户端
-    void init(int sockfd, const sockaddr_in &addr); // 初始化连接
+    void init(int sockfd, const sockaddr_in &addr, reactor *owner); // 初始化连接
     void close_conn(); // 关闭连接
     bool read(); // 非阻塞的读
     bool write(); // 非阻塞的写
+    int feed(const char *data, int len); // 追加已经收到的数据，返回读缓冲区接收的字节数
+    // 过载时拒绝：在socket上直接写出预先生成的503应答（Connection: close），返回应答的长度，
+    // 不读请求、不借缓冲区，反应堆用它拒绝新连接和放不进线程池的请求，调用者负责关闭
+    static int send_unavailable(int sockfd);
+    void shed(); // 排队太久的请求由工作线程回应503并关闭连接，代替process()
+
+    // 以下由io_uring后端在反应堆线程中调用，发送生成好的应答
+    // 取出下一次要发送的内容：返回值大于0时iov中是连续的内存段，最多max_iov个；
+    // 返回0时下一段在文件中，需要从fd的offset处读出length（不超过max_file）字节发送；
+    // 返回-1表示没有要发送的内容。more表示这次之后还有要发送的段
+    int next_send(struct iovec *iov, int max_iov, size_t max_file, int &fd, off_t &offset, size_t &length, bool &more);
+    void sent(size_t bytes) { consume(bytes); } // 发送了bytes字节，推进各段
+    bool finish_send(); // 整批发送完，释放这一批的资源，返回是否保持连接
+
+    // 以下由反应堆线程调用，用于超时管理
+    timer_node &timer() { return m_timer; }
+    // 交给线程池之前调用，工作线程处理完毕、不再访问连接时计数减一
+    // 计数的高16位是槽位的代数，每次init加一。工作线程交还连接之后，连接可能马上被关闭、
+    // 槽位被新连接复用，所以工作线程开始处理时记下代数，结束时只在代数没变时才减一
+    void begin_task() { m_busy.fetch_add(1, std::memory_order_relaxed); }
+    unsigned task_generation() { return m_busy.load(std::memory_order_relaxed) >> 16; }
+    void end_task(unsigned generation) {
+        unsigned busy = m_busy.load(std::memory_order_relaxed);
+        while((busy >> 16) == generation
+              && !m_busy.compare_exchange_weak(busy, busy - 1, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+    // 是否有工作线程正在处理或者即将处理这个连接，这时超时也不能关闭它
+    bool busy() { return (m_busy.load(std::memory_order_acquire) & 0xffff) > 0; }
+    bool closed() { return m_sockfd == -1; }
+    // 还没有收到下一个请求的任何数据，否则读缓冲区中留有流水线上后续请求的数据
+    bool waiting_request() { return m_read_idx == 0; }
+    // 应答还没有发送完
+    bool sending() { return m_segment_idx < m_segment_count; }
 
+    // 微基准测试（bench/micro_bench.cpp）不经过socket，直接驱动私有的解析和应答函数
+    friend struct http_conn_probe;
     
 
 private:
+    /*
+        应答由若干段依次组成：响应头、响应体，多区间应答为响应头、每个区间的分段头和内容、结束分隔符。
+        data不为NULL的段在内存中（写缓冲区、缓存的文件内容、分段头），连续的内存段用一次sendmsg分散写出；
+        data为NULL的段是文件fd中的区间，用sendfile发送。发送时offset前进、length减少，
+        遇到EAGAIN时进度就保存在段里，下一次EPOLLOUT从断点继续。
+        流水线上的多个应答的段依次排在一起，一起发送。
+    */
+    struct body_segment {
+        const char *data;
+        off_t offset;
+        off_t length;
+        int fd;
+    };
+    // 已经生成、等待发送的应答占用的资源，整批发送完之后释放
+    struct response_hold {
+        cached_file *cached;
+        file_meta *meta;
+        char *multipart;
+        off_t bytes;       // 应答的字节数和状态码，用于访问日志
+        int status;
+        int fd;            // 不属于meta、需要关闭的文件描述符
+    };
+    /*
+        一批应答的工作区，占buffer_pool的一个小块，工作线程开始处理请求时借来，整批应答发送完就还回去，
+        空闲的长连接不占用它。file_stat和validators只在生成当前应答时使用，其余的一直用到整批发送完
+    */
+    struct response_batch {
+        response_hold holds[MAX_PIPELINE];
+        body_segment segments[2 * MAX_PIPELINE]; // 普通应答只有响应头和响应体两段
+        struct stat file_stat; // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+        file_validators validators; // 不在缓存中的文件现场生成的验证器
+        char write[WRITE_BUFFER_SIZE]; // 流水线上的多个应答的响应头依次排在里面
+    };
+
     /************* 私有数据 *********************/
+    // 热数据：反应堆线程每次事件都会访问，放在对象开头的两个缓存行中
+    timer_node m_timer; // 所属反应堆时间轮中的超时定时器
     int m_sockfd; // 该HTTP连接的socket
-    sockaddr_in m_address;   // 通信需要的地址信息
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
+    reactor *m_reactor; // 该连接所属的反应堆，处理完请求后通过它等待下一个事件
+    std::atomic<unsigned> m_busy; // 低16位是已经交给线程池、还没有处理完的任务数，高16位是槽位的代数
     int m_read_idx; // 标识读缓冲区中以及读入客户端的数据的最后一个字符下标的下一位
-    
-    
+    int m_read_size;  // 读缓冲区的容量，0表示没有读缓冲区
+    int m_segment_idx;         // 下一个要发送的段
+    int m_segment_count;
+    bool m_keep_alive; // 这一批应答中最后一个请求要求保持连接，发送完之后继续处理下一批
+    char *m_read_buf; // 读缓冲区，从buffer_pool借来的小块或者大块，没有数据时为NULL
+    body_segment *m_segments;  // 这一批应答的段，在m_batch中，不够时换成按需分配的数组
+    response_batch *m_batch;   // 这一批应答的工作区，没有正在处理或者发送的应答时为NULL
+
+    // 冷数据：只在工作线程解析请求、生成应答时访问
     int m_checked_idx; // 当前正在分析的字符在读缓冲区的位置
     int m_start_line; // 当前正在解析的行的起始位置
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
-
-    char m_real_file[FILENAME_LEN]; // 客户请求的目标文件的完整路径，其内容等于 doc_root + m_url, doc_root是网站根目录
+    METHOD m_method; // 请求方法
     char *m_url; // 请求目标文件的文件名
     char *m_version; // 协议版本，只支持HTTP1.1
-    METHOD m_method; // 请求方法
     char *m_host; // 主机名
     bool m_linger; // HTTP请求是否要保持连接
-    int m_content_length;  // HTTP请求的消息总长度
-    char *m_file_address; // 客户请求的目标文件被mmap到内存中的起始位置
-    struct stat m_file_stat; // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
+    bool m_accept_gzip; // 客户端是否接受gzip编码
+    bool m_vary; // 应答是否随Accept-Encoding变化，可压缩的文件都需要带上Vary
+    bool m_gzip; // 发送的是否是gzip压缩后的内容
+    const mime_type *m_mime; // 目标文件的MIME类型，由原文件的扩展名决定，发送压缩版本时也不变
+    char *m_if_none_match; // If-None-Match头部字段的值，指向读缓冲区
+    char *m_if_modified_since; // If-Modified-Since头部字段的值，指向读缓冲区
+    char *m_range; // Range头部字段的值，指向读缓冲区
+    char *m_if_range; // If-Range头部字段的值，指向读缓冲区
+    off_t m_content_length;  // HTTP请求的消息总长度
+    off_t m_body_left;      // 请求体还没有交给处理函数的字节数
+    cached_file *m_cached; // 命中缓存时响应体直接从缓存的内存发送，NULL表示没有命中
+    file_meta *m_meta; // 目标文件的元数据，m_file_fd属于它时不为NULL
+    int m_file_fd; // 没有命中缓存时目标文件的文件描述符，响应体用sendfile直接从它发送，-1表示没有文件要发送
+    const file_validators *m_validators; // 目标文件的ETag和Last-Modified，指向缓存或者m_batch中的副本，错误应答为NULL
 
-    char m_write_buf[ WRITE_BUFFER_SIZE ];  // 写缓冲区
-    int m_write_idx;    // 写缓冲区中待发送的字节数
-    struct iovec m_iv[2];   // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
-    int m_iv_count;
-
-    int bytes_to_send;   // 将要发送的数据的字节数
-    int bytes_have_send; // 已经发送的字节数
+    char *m_write_buf;  // 写缓冲区，指向m_batch中的缓冲区或者从buffer_pool借来的大块
+    int m_write_size;   // 写缓冲区的容量
+    int m_write_idx;    // 写缓冲区中待发送的字节数，即响应头（和错误页面）的长度
+    char *m_write_block; // 这一批应答借来的块，之前的响应头仍在m_batch中，整批发送完之后归还
+    int m_response_start; // 当前应答的响应头在写缓冲区中的起始位置
+    int m_segment_capacity;
+    int m_hold_count;
+    char *m_multipart_buf;     // 多区间应答的分隔符和分段头，按需分配
+    sockaddr_in m_address;   // 通信需要的地址信息
+    long long m_batch_start; // 开始处理这一批请求的时间
+    long long m_batch_ready; // 这一批应答全部生成、开始发送的时间
 
     /************* 私有数据 *********************/
     
 
-    void init(); // 初始化连接其余信息
-    HTTP_CODE process_read(); // 解析HTTP请求
+    void init(); // 初始化一批应答的发送状态，读缓冲区中剩余的数据保留
+    void reset_request(); // 初始化一个请求的解析状态
+    void finish_request(); // 丢弃已经处理完的请求的数据，把剩余的数据移到读缓冲区开头
+    void retire_response(); // 当前应答已经生成，把它占用的资源转交给这一批应答
+    bool grow_write_buffer(); // 写缓冲区剩余空间不够下一个应答时接到一个块上
+    bool reserve_response(); // 确保写缓冲区放得下下一个应答，放不下时这一批到此为止
+    void move_read_buffer(char *to, int size); // 把读缓冲区的内容搬到另一块内存中，指向它的指针一起调整
+    void release_read_buffer(); // 还回读缓冲区
+    static void put_buffer(char *buffer, int size); // 按大小把缓冲区还给buffer_pool
+    void attach_batch(); // 借来一批应答的工作区
+    HTTP_CODE process_read(); // 解析HTTP请求并找到目标文件
+    HTTP_CODE parse_request(); // 只解析HTTP请求
     bool process_write( HTTP_CODE ret );   // 填充HTTP应答
 
     /* process_read调用以分析HTTP请求 */
@@ -110,19 +251,32 @@ private:
     HTTP_CODE parse_headers(char* text); // 解析请求头
     HTTP_CODE parse_content(char *text); // 解析请求内容
     HTTP_CODE do_request();
+    HTTP_CODE open_file(const char *path, bool cacheable);
+    void negotiate_gzip(const char *real_file, bool cacheable);
+    bool not_modified();
+    int parse_range(off_t size, off_t *starts, off_t *lengths);
+    bool setup_ranges(int count, const off_t *starts, const off_t *lengths);
+    void add_segment(const char *data, off_t offset, off_t length);
+    void consume(size_t bytes);
     LINE_STATUS parse_line();
     char* get_line() {return m_read_buf + m_start_line; }
     /* process_read调用以分析HTTP请求 */
 
     // 这一组函数被process_write调用以填充HTTP应答。
-    void unmap();
-    bool add_response( const char* format, ... );
+    void release_file();
+    void release_fd();
+    void release_batch();
+    bool add_response( const char* data, int len );
+    bool add_number( unsigned long long value );
     bool add_content( const char* content );
     bool add_content_type();
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_status_line( int status );
+    bool add_headers( off_t content_length );
+    bool add_content_length( off_t content_length );
     bool add_linger();
+    bool add_date();
+    bool add_validators();
+    bool add_encoding();
     bool add_blank_line();
 };
 
@@ -0,0 +1,181 @@
+#include <ctype.h>
+#include <time.h>
+
+#include "http_response.h"
+
+#define STATUS(code, title) case code: len = sizeof("HTTP/1.1 " #code " " title "\r\n") - 1; \
+    return "HTTP/1.1 " #code " " title "\r\n"
+
+const char *status_line(int status, int &len) {
+    switch(status) {
+        STATUS(200, "OK");
+        STATUS(206, "Partial Content");
+        STATUS(304, "Not Modified");
+        STATUS(400, "Bad Request");
+        STATUS(403, "Forbidden");
+        STATUS(404, "Not Found");
+        STATUS(416, "Range Not Satisfiable");
+        STATUS(503, "Service Unavailable");
+        default:
+        STATUS(500, "Internal Error");
+    }
+}
+
+#undef STATUS
+
+#define MIME(ext, type, compressible) { ext, type, sizeof(type) - 1, compressible }
+
+// 按扩展名排序，查找时二分
+static constexpr mime_type mime_table[] = {
+    MIME("avif", "image/avif", false),
+    MIME("bmp", "image/bmp", true),
+    MIME("css", "text/css; charset=utf-8", true),
+    MIME("csv", "text/csv; charset=utf-8", true),
+    MIME("gif", "image/gif", false),
+    MIME("gz", "application/gzip", false),
+    MIME("htm", "text/html; charset=utf-8", true),
+    MIME("html", "text/html; charset=utf-8", true),
+    MIME("ico", "image/x-icon", true),
+    MIME("jpeg", "image/jpeg", false),
+    MIME("jpg", "image/jpeg", false),
+    MIME("js", "text/javascript; charset=utf-8", true),
+    MIME("json", "application/json", true),
+    MIME("map", "application/json", true),
+    MIME("mjs", "text/javascript; charset=utf-8", true),
+    MIME("mp3", "audio/mpeg", false),
+    MIME("mp4", "video/mp4", false),
+    MIME("ogg", "audio/ogg", false),
+    MIME("otf", "font/otf", true),
+    MIME("pdf", "application/pdf", false),
+    MIME("png", "image/png", false),
+    MIME("svg", "image/svg+xml", true),
+    MIME("tar", "application/x-tar", false),
+    MIME("ttf", "font/ttf", true),
+    MIME("txt", "text/plain; charset=utf-8", true),
+    MIME("wasm", "application/wasm", true),
+    MIME("wav", "audio/wav", false),
+    MIME("webm", "video/webm", false),
+    MIME("webp", "image/webp", false),
+    MIME("woff", "font/woff", false),
+    MIME("woff2", "font/woff2", false),
+    MIME("xml", "application/xml", true),
+    MIME("zip", "application/zip", false),
+};
+
+static constexpr mime_type octet_stream = MIME("", "application/octet-stream", false);
+static constexpr mime_type html = MIME("html", "text/html; charset=utf-8", true);
+
+#undef MIME
+
+static constexpr int MIME_NUMBER = sizeof(mime_table) / sizeof(mime_table[0]);
+static constexpr int MAX_EXT_LEN = 8;
+
+static constexpr int compare(const char *a, const char *b) {
+    while(*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+static constexpr bool table_sorted() {
+    for(int i = 1; i < MIME_NUMBER; ++i) {
+        if(compare(mime_table[i - 1].ext, mime_table[i].ext) >= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(table_sorted(), "mime_table must be sorted by extension");
+
+const mime_type *lookup_mime(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if(!dot || strchr(dot, '/')) {
+        return &octet_stream;
+    }
+    char ext[MAX_EXT_LEN + 1];
+    int len = 0;
+    for(const char *p = dot + 1; *p; ++p) {
+        if(len == MAX_EXT_LEN) {
+            return &octet_stream;
+        }
+        ext[len++] = tolower((unsigned char)*p);
+    }
+    ext[len] = '\0';
+    int low = 0, high = MIME_NUMBER - 1;
+    while(low <= high) {
+        int mid = (low + high) / 2;
+        int c = compare(ext, mime_table[mid].ext);
+        if(c == 0) {
+            return &mime_table[mid];
+        }
+        if(c < 0) {
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return &octet_stream;
+}
+
+const mime_type *html_mime() {
+    return &html;
+}
+
+// 每个线程一份，不需要加锁
+struct date_cache {
+    time_t second;
+    int len;
+    char buf[48];
+};
+
+static thread_local date_cache t_date = { -1, 0, { 0 } };
+
+const char *date_header(int &len) {
+    // 粗粒度时钟由vDSO读取，不进入内核，精度对秒级的Date头足够
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if(ts.tv_sec != t_date.second) {
+        struct tm tm;
+        gmtime_r(&ts.tv_sec, &tm);
+        t_date.len = strftime(t_date.buf, sizeof(t_date.buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        t_date.second = ts.tv_sec;
+    }
+    len = t_date.len;
+    return t_date.buf;
+}
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+int format_uint(char *buf, unsigned long long value) {
+    // 先从低位往高位写到临时缓冲区的末尾，每次处理两位
+    char tmp[20];
+    char *p = tmp + sizeof(tmp);
+    while(value >= 100) {
+        int pair = (value % 100) * 2;
+        value /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if(value >= 10) {
+        int pair = value * 2;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    } else {
+        *--p = '0' + value;
+    }
+    int len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
@@ -0,0 +1,46 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+#include <string.h>
+
+/*
+    生成响应头用的零分配工具
+    状态行、MIME类型都是编译期确定的字符串，长度也预先算好，生成应答时只需要memcpy；
+    整数用两位一组的查表转换，不经过printf的格式解析；Date头每个线程每秒只格式化一次。
+*/
+
+// 字符串字面量和它的长度，用于只接受(data, len)的函数
+#define LITERAL(s) s, (int)(sizeof(s) - 1)
+
+// 完整的状态行"HTTP/1.1 200 OK\r\n"，不认识的状态码返回500的状态行
+const char *status_line(int status, int &len);
+
+// 一个扩展名对应的MIME类型
+struct mime_type {
+    const char *ext;     // 小写的扩展名，不带点
+    const char *type;    // Content-Type的值，文本类型带上charset
+    int type_len;
+    bool compressible;   // 是否值得gzip压缩
+};
+
+// 按路径的扩展名查找（不区分大小写），没有扩展名或者不认识时返回application/octet-stream
+const mime_type *lookup_mime(const char *path);
+// 错误页面使用的text/html
+const mime_type *html_mime();
+
+// 当前时间的"Date: ...\r\n"，每个线程缓存一份，跨过一秒时才重新格式化
+const char *date_header(int &len);
+
+// 十进制写出无符号整数，返回写入的字节数，buf至少要有20个字节
+int format_uint(char *buf, unsigned long long value);
+
+// 追加到p并返回新的末尾，调用者保证空间足够
+inline char *append(char *p, const char *data, int len) {
+    memcpy(p, data, len);
+    return p + len;
+}
+
+inline char *append_uint(char *p, unsigned long long value) {
+    return p + format_uint(p, value);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "http_scan.h"
+
+const char *scan_scalar(const char *p, const char *end, char a, char b) {
+    for(; p < end; ++p) {
+        if(*p == a || *p == b) {
+            return p;
+        }
+    }
+    return end;
+}
+
+#ifdef HTTP_SCAN_X86
+// pcmpestri一条指令比较16个字节和最多16个字节的集合，返回第一个命中的下标，没有命中时返回16
+__attribute__((target("sse4.2")))
+const char *scan_sse42(const char *p, const char *end, char a, char b) {
+    const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    while(end - p >= 16) {
+        __m128i data = _mm_loadu_si128((const __m128i *)p);
+        int index = _mm_cmpestri(set, 2, data, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if(index < 16) {
+            return p + index;
+        }
+        p += 16;
+    }
+    // 不足16个字节的尾部逐字节比较，不读越过end的内存
+    return scan_scalar(p, end, a, b);
+}
+
+// 32个字节分别和a、b比较，合并成一个32位的掩码，最低的置位就是第一个命中的字节
+__attribute__((target("avx2")))
+const char *scan_avx2(const char *p, const char *end, char a, char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    while(end - p >= 32) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(data, va), _mm256_cmpeq_epi8(data, vb));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hit);
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    if(end - p >= 16) {
+        const __m128i sa = _mm_set1_epi8(a);
+        const __m128i sb = _mm_set1_epi8(b);
+        __m128i data = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(data, sa), _mm_cmpeq_epi8(data, sb)));
+        if(mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end, a, b);
+}
+
+bool cpu_has_sse42() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+bool cpu_has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#else
+bool cpu_has_sse42() {
+    return false;
+}
+
+bool cpu_has_avx2() {
+    return false;
+}
+#endif
+
+static scan_fn choose_scanner() {
+#ifdef HTTP_SCAN_X86
+    if(cpu_has_avx2()) {
+        return scan_avx2;
+    }
+    if(cpu_has_sse42()) {
+        return scan_sse42;
+    }
+#endif
+    return scan_scalar;
+}
+
+// 在main之前选好，之后多个线程只读
+scan_fn find_either = choose_scanner();
+
+const char *scanner_name() {
+#ifdef HTTP_SCAN_X86
+    if(find_either == scan_avx2) {
+        return "avx2";
+    }
+    if(find_either == scan_sse42) {
+        return "sse4.2";
+    }
+#endif
+    return "scalar";
+}
+
+struct header_entry {
+    const char *name;
+    int len;
+    HEADER_ID id;
+};
+
+static const header_entry known_headers[] = {
+    { "Host", 4, HEADER_HOST },
+    { "Connection", 10, HEADER_CONNECTION },
+    { "Content-Length", 14, HEADER_CONTENT_LENGTH },
+    { "Accept-Encoding", 15, HEADER_ACCEPT_ENCODING },
+    { "If-None-Match", 13, HEADER_IF_NONE_MATCH },
+    { "If-Modified-Since", 17, HEADER_IF_MODIFIED_SINCE },
+    { "Range", 5, HEADER_RANGE },
+    { "If-Range", 8, HEADER_IF_RANGE },
+    { "Transfer-Encoding", 17, HEADER_TRANSFER_ENCODING },
+    { "User-Agent", 10, HEADER_USER_AGENT },
+    { "Accept", 6, HEADER_ACCEPT },
+    { "Accept-Language", 15, HEADER_ACCEPT_LANGUAGE },
+    { "Upgrade-Insecure-Requests", 25, HEADER_UPGRADE_INSECURE_REQUESTS },
+    { "Cookie", 6, HEADER_COOKIE },
+    { "Referer", 7, HEADER_REFERER },
+    { "Cache-Control", 13, HEADER_CACHE_CONTROL },
+    { "Pragma", 6, HEADER_PRAGMA },
+    { "Origin", 6, HEADER_ORIGIN },
+    { "Expect", 6, HEADER_EXPECT },
+    { "DNT", 3, HEADER_DNT },
+};
+
+static const int HEADER_TABLE_SIZE = 64;
+
+// 由长度、首字母和尾字母组成，对上面的名字没有冲突，|0x20把字母转成小写
+static inline unsigned int header_hash(const char *name, int len) {
+    return (len * 2 + (name[0] | 0x20) + (name[len - 1] | 0x20) * 7) & (HEADER_TABLE_SIZE - 1);
+}
+
+static const header_entry *build_header_table() {
+    static header_entry table[HEADER_TABLE_SIZE];
+    for(size_t i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]); ++i) {
+        unsigned int h = header_hash(known_headers[i].name, known_headers[i].len);
+        if(table[h].name) {
+            // 只会在修改了上面的名字列表之后发生，需要重新选择哈希函数
+            fprintf(stderr, "header hash collision: %s %s\n", table[h].name, known_headers[i].name);
+            abort();
+        }
+        table[h] = known_headers[i];
+    }
+    return table;
+}
+
+// 在main之前生成，之后多个工作线程只读
+static const header_entry *header_table = build_header_table();
+
+HEADER_ID lookup_header(const char *name, int len) {
+    if(len <= 0) {
+        return HEADER_UNKNOWN;
+    }
+    const header_entry &e = header_table[header_hash(name, len)];
+    if(e.len == len && strncasecmp(e.name, name, len) == 0) {
+        return e.id;
+    }
+    return HEADER_UNKNOWN;
+}
@@ -0,0 +1,57 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+/*
+    HTTP请求的向量化扫描
+    解析时最常做的是在一段字节中找行尾（\r或\n）、请求行中的空格和请求头中的冒号。
+    find_either一次比较16（SSE4.2）或32（AVX2）个字节，启动时按CPU支持的指令集选择实现，
+    不支持时（包括非x86平台）使用逐字节的版本。编译时不需要额外的-m选项。
+*/
+
+// 在[p, end)中查找第一个等于a或者b的字节，返回它的位置，没有时返回end
+typedef const char *(*scan_fn)(const char *p, const char *end, char a, char b);
+
+extern scan_fn find_either;
+
+const char *scan_scalar(const char *p, const char *end, char a, char b);
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_SCAN_X86
+const char *scan_sse42(const char *p, const char *end, char a, char b);
+const char *scan_avx2(const char *p, const char *end, char a, char b);
+#endif
+
+// 当前使用的实现，"avx2"、"sse4.2"或"scalar"
+const char *scanner_name();
+bool cpu_has_sse42();
+bool cpu_has_avx2();
+
+// 需要处理或者常见的请求头，其余的都是HEADER_UNKNOWN
+enum HEADER_ID {
+    HEADER_UNKNOWN = 0,
+    HEADER_HOST,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE,
+    HEADER_TRANSFER_ENCODING,
+    // 以下不需要处理，识别出来只是为了和真正未知的请求头区分开
+    HEADER_USER_AGENT,
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_UPGRADE_INSECURE_REQUESTS,
+    HEADER_COOKIE,
+    HEADER_REFERER,
+    HEADER_CACHE_CONTROL,
+    HEADER_PRAGMA,
+    HEADER_ORIGIN,
+    HEADER_EXPECT,
+    HEADER_DNT
+};
+
+// 用完美哈希查找请求头的名字（不区分大小写），只需要一次哈希和一次比较
+HEADER_ID lookup_header(const char *name, int len);
+
+#endif
@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "io_buffer.h"
+
+buffer_pool::size_class buffer_pool::m_slabs(0, buffer_pool::SLAB_SIZE, 16384);
+buffer_pool::size_class buffer_pool::m_blocks(1, buffer_pool::BLOCK_SIZE, 1024);
+
+static inline char *next_of(char *block) {
+    char *next;
+    memcpy(&next, block, sizeof(char *));
+    return next;
+}
+
+static inline void set_next(char *block, char *next) {
+    memcpy(block, &next, sizeof(char *));
+}
+
+// 每个线程每种大小一个本地空闲链表，线程退出时还给全局链表
+struct local_cache {
+    char *free[2];
+    int count[2];
+
+    local_cache() {
+        free[0] = free[1] = NULL;
+        count[0] = count[1] = 0;
+    }
+
+    ~local_cache() {
+        buffer_pool::flush(buffer_pool::m_slabs, count[0]);
+        buffer_pool::flush(buffer_pool::m_blocks, count[1]);
+    }
+};
+
+static thread_local local_cache t_cache;
+
+char *buffer_pool::get(size_class &c) {
+    c.in_use.fetch_add(1, std::memory_order_relaxed);
+    if(t_cache.count[c.id] == 0) {
+        refill(c);
+    }
+    char *block = t_cache.free[c.id];
+    if(!block) {
+        return new char[c.size];
+    }
+    t_cache.free[c.id] = next_of(block);
+    --t_cache.count[c.id];
+    return block;
+}
+
+void buffer_pool::put(size_class &c, char *block) {
+    c.in_use.fetch_sub(1, std::memory_order_relaxed);
+    set_next(block, t_cache.free[c.id]);
+    t_cache.free[c.id] = block;
+    if(++t_cache.count[c.id] > LOCAL_MAX) {
+        flush(c, BATCH);
+    }
+}
+
+// 从全局链表取最多BATCH个块到本地缓存
+void buffer_pool::refill(size_class &c) {
+    c.lock.lock();
+    for(int i = 0; i < BATCH && c.free; ++i) {
+        char *block = c.free;
+        c.free = next_of(block);
+        --c.free_count;
+        set_next(block, t_cache.free[c.id]);
+        t_cache.free[c.id] = block;
+        ++t_cache.count[c.id];
+    }
+    c.lock.unlock();
+}
+
+// 把本地缓存开头的count个块还给全局链表，超出上限的释放掉
+void buffer_pool::flush(size_class &c, int count) {
+    char *head = NULL;
+    int moved = 0;
+    c.lock.lock();
+    while(moved < count && t_cache.free[c.id]) {
+        char *block = t_cache.free[c.id];
+        t_cache.free[c.id] = next_of(block);
+        --t_cache.count[c.id];
+        if(c.free_count < c.max_free) {
+            set_next(block, c.free);
+            c.free = block;
+            ++c.free_count;
+        } else {
+            // 在锁外释放
+            set_next(block, head);
+            head = block;
+        }
+        ++moved;
+    }
+    c.lock.unlock();
+    while(head) {
+        char *next = next_of(head);
+        delete[] head;
+        head = next;
+    }
+}
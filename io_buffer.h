@@ -0,0 +1,56 @@
+#ifndef IO_BUFFER_H
+#define IO_BUFFER_H
+#include <atomic>
+#include "locker.h"
+
+/*
+    连接缓冲区池，只有正在处理请求的连接才持有缓冲区
+    有两种大小：SLAB_SIZE的小块用作读缓冲区和一批应答的工作区（段、响应头），连接收到数据时借出，
+    请求处理完、读缓冲区空了或者应答发送完就还回来，空闲的长连接一个块也不占用；
+    BLOCK_SIZE的大块用于请求头超过小块、请求体大量到达或者流水线上的应答头放不下的情况。
+    每个线程在本地缓存若干空闲块，借还都不加锁；本地缓存空了或者满了时，
+    一次和全局空闲链表交换BATCH个块。读缓冲区通常在反应堆线程借出、在工作线程归还，
+    块就这样成批地在线程之间流动。全局空闲块超过上限时直接释放。
+    空闲块的链表指针存在块的开头。
+*/
+class buffer_pool {
+public:
+    static const int SLAB_SIZE = 4096;   // 小块的大小
+    static const int BLOCK_SIZE = 16384; // 大块的大小，也是请求头的最大长度
+
+    static char *get() { return get(m_blocks); }
+    static void put(char *block) { put(m_blocks, block); }
+    static char *get_slab() { return get(m_slabs); }
+    static void put_slab(char *slab) { put(m_slabs, slab); }
+
+    static long long in_use() { return m_blocks.in_use.load(std::memory_order_relaxed); }
+    static long long slabs_in_use() { return m_slabs.in_use.load(std::memory_order_relaxed); }
+
+private:
+    static const int BATCH = 32;        // 线程本地缓存和全局链表之间一次交换的块数
+    static const int LOCAL_MAX = 2 * BATCH; // 线程本地最多缓存的块数
+
+    struct size_class {
+        int id;              // 线程本地缓存的下标
+        int size;
+        int max_free;        // 全局最多缓存的空闲块数
+        locker lock;
+        char *free;          // 全局空闲链表
+        int free_count;
+        std::atomic<long long> in_use; // 借出去的块数
+
+        size_class(int id, int size, int max_free)
+            : id(id), size(size), max_free(max_free), free(NULL), free_count(0), in_use(0) {}
+    };
+
+    static char *get(size_class &c);
+    static void put(size_class &c, char *block);
+    static void refill(size_class &c);
+    static void flush(size_class &c, int count);
+
+    friend struct local_cache;
+    static size_class m_slabs;  // 最多缓存16384个空闲小块，共64MB
+    static size_class m_blocks; // 最多缓存1024个空闲大块，共16MB
+};
+
+#endif
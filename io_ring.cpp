@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <exception>
+
+#include "io_ring.h"
+#include "log.h"
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// 多次接收和提供给内核的缓冲区环从6.0开始支持，DEFER_TASKRUN从6.1开始
+static bool kernel_supported() {
+    struct utsname name;
+    int major = 0, minor = 0;
+    if(uname(&name) != 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 6 || (major == 6 && minor >= 1);
+}
+
+io_ring::io_ring(unsigned entries, unsigned buffer_count, unsigned buffer_size) :
+    m_fd(-1), m_sq_entries(0), m_sq_mask(0), m_sq_head(NULL), m_sq_tail(NULL), m_sqe_tail(0), m_sqes(NULL),
+    m_cq_mask(0), m_cq_head(NULL), m_cq_tail(NULL), m_cqes(NULL), m_ring(NULL), m_ring_size(0), m_sqes_size(0),
+    m_buf_ring(NULL), m_buffers(NULL), m_buffer_count(buffer_count), m_buffer_size(buffer_size),
+    m_buf_tail(0), m_buf_published(0) {
+
+    if(!kernel_supported() || buffer_count == 0 || buffer_count > 32768 || (buffer_count & (buffer_count - 1))) {
+        throw std::exception();
+    }
+
+    // 只有反应堆线程提交，内核的完成工作推迟到它等待完成时才运行，不会打断它处理事件
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN
+                 | IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = entries * 4;
+    m_fd = io_uring_setup(entries, &params);
+    if(m_fd < 0) {
+        LOG_WARN("io_uring_setup: %s", strerror(errno));
+        throw std::exception();
+    }
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        destroy();
+        throw std::exception();
+    }
+
+    // 提交队列和完成队列在同一个映射中
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    m_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    m_ring = mmap(NULL, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_ring == MAP_FAILED) {
+        m_ring = NULL;
+        LOG_ERROR("mmap: %s", strerror(errno));
+        destroy();
+        throw std::exception();
+    }
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe *)mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                  m_fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED) {
+        m_sqes = NULL;
+        LOG_ERROR("mmap: %s", strerror(errno));
+        destroy();
+        throw std::exception();
+    }
+    char *ring = (char *)m_ring;
+    m_sq_entries = params.sq_entries;
+    m_sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+    m_sq_head = (unsigned *)(ring + params.sq_off.head);
+    m_sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    m_sqe_tail = *m_sq_tail;
+    // 提交队列的间接数组固定为恒等映射，第i个位置就是第i个提交队列项
+    unsigned *array = (unsigned *)(ring + params.sq_off.array);
+    for(unsigned i = 0; i < m_sq_entries; ++i) {
+        array[i] = i;
+    }
+    m_cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    m_cq_head = (unsigned *)(ring + params.cq_off.head);
+    m_cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    m_cqes = (io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    // 接收缓冲区环和缓冲区本身都来自匿名映射，缓冲区在内核第一次写入时才分配物理页
+    // 环本身在注册时被内核固定，要先分配好可写的物理页
+    m_buf_ring = (io_uring_buf_ring *)mmap(NULL, m_buffer_count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(m_buf_ring == MAP_FAILED) {
+        m_buf_ring = NULL;
+        LOG_ERROR("mmap: %s", strerror(errno));
+        destroy();
+        throw std::exception();
+    }
+    m_buffers = (char *)mmap(NULL, (size_t)m_buffer_count * m_buffer_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m_buffers == MAP_FAILED) {
+        m_buffers = NULL;
+        LOG_ERROR("mmap: %s", strerror(errno));
+        destroy();
+        throw std::exception();
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)m_buf_ring;
+    reg.ring_entries = m_buffer_count;
+    reg.bgid = BUFFER_GROUP;
+    if(io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        LOG_ERROR("IORING_REGISTER_PBUF_RING: %s", strerror(errno));
+        destroy();
+        throw std::exception();
+    }
+    for(unsigned i = 0; i < m_buffer_count; ++i) {
+        recycle(i);
+    }
+    m_buf_published = m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, (uint16_t)m_buf_tail, __ATOMIC_RELEASE);
+}
+
+io_ring::~io_ring() {
+    destroy();
+}
+
+void io_ring::destroy() {
+    if(m_sqes) {
+        munmap(m_sqes, m_sqes_size);
+        m_sqes = NULL;
+    }
+    if(m_ring) {
+        munmap(m_ring, m_ring_size);
+        m_ring = NULL;
+    }
+    // 先关闭io_uring，内核取消所有请求之后才能释放缓冲区
+    if(m_fd != -1) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    if(m_buffers) {
+        munmap(m_buffers, (size_t)m_buffer_count * m_buffer_size);
+        m_buffers = NULL;
+    }
+    if(m_buf_ring) {
+        munmap(m_buf_ring, m_buffer_count * sizeof(io_uring_buf));
+        m_buf_ring = NULL;
+    }
+}
+
+bool io_ring::enable() {
+    if(io_uring_register(m_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) != 0) {
+        LOG_ERROR("IORING_REGISTER_ENABLE_RINGS: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool io_ring::register_files(unsigned count) {
+    io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if(io_uring_register(m_fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) != 0) {
+        LOG_ERROR("IORING_REGISTER_FILES2: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+io_uring_sqe *io_ring::get_sqe() {
+    if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+        // 提交队列满了，先交给内核
+        submit_and_wait(0);
+        if(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries) {
+            return NULL;
+        }
+    }
+    io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+    ++m_sqe_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int io_ring::submit_and_wait(unsigned wait_nr) {
+    if(m_buf_published != m_buf_tail) {
+        __atomic_store_n(&m_buf_ring->tail, (uint16_t)m_buf_tail, __ATOMIC_RELEASE);
+        m_buf_published = m_buf_tail;
+    }
+    __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    // DEFER_TASKRUN下完成事件只在带GETEVENTS进入内核时才生成，不等待时也带上
+    int ret = io_uring_enter(m_fd, to_submit, wait_nr, IORING_ENTER_GETEVENTS);
+    return ret < 0 ? -errno : ret;
+}
+
+void io_ring::recycle(unsigned bid) {
+    // C++下头文件中的柔性数组bufs带了一个空成员，偏移不是0，直接按数组访问环
+    io_uring_buf *buf = (io_uring_buf *)m_buf_ring + (m_buf_tail & (m_buffer_count - 1));
+    buf->addr = (uint64_t)buffer(bid);
+    buf->len = m_buffer_size;
+    buf->bid = bid;
+    ++m_buf_tail;
+}
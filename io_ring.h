@@ -0,0 +1,82 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// linux/io_uring.h经由linux/fs.h带进来的宏，和buffer_pool::BLOCK_SIZE重名
+#undef BLOCK_SIZE
+
+/*
+    io_uring的最小封装，直接使用系统调用，不依赖liburing
+    一个io_ring只在创建它的反应堆线程中使用：提交队列项在本地累积，submit_and_wait时一次提交并等待完成；
+    完成队列通过共享内存直接读取，不需要系统调用。
+    另外管理一个提供给内核的接收缓冲区环：多次接收的recv从里面挑选缓冲区，
+    应用处理完数据后把缓冲区还回环中。
+    以单发布者、延迟任务运行（SINGLE_ISSUER | DEFER_TASKRUN）的方式创建，需要Linux 6.1以上的内核，
+    创建失败时构造函数抛出异常。
+*/
+class io_ring {
+public:
+    // entries为提交队列的大小，完成队列是它的4倍；接收缓冲区共buffer_count个，每个buffer_size字节
+    io_ring(unsigned entries, unsigned buffer_count, unsigned buffer_size);
+    ~io_ring();
+
+    // 以禁用状态创建，在真正使用它的线程中启用，之后只有这个线程能提交
+    bool enable();
+
+    // 取一个清零的提交队列项，提交队列满时先提交已有的项
+    io_uring_sqe *get_sqe();
+    // 提交累积的项，等待至少wait_nr个完成，返回负的errno表示出错
+    int submit_and_wait(unsigned wait_nr);
+
+    // 依次处理完成队列中所有的项，返回处理的个数
+    template<typename F>
+    unsigned for_each_cqe(F on_cqe) {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = tail - head;
+        for(; head != tail; ++head) {
+            on_cqe(&m_cqes[head & m_cq_mask]);
+        }
+        __atomic_store_n(m_cq_head, tail, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // 注册count个空的固定文件槽位，之后用IORING_OP_FILES_UPDATE填入
+    bool register_files(unsigned count);
+
+    // 接收缓冲区环
+    static const int BUFFER_GROUP = 0;
+    char *buffer(unsigned bid) { return m_buffers + (size_t)bid * m_buffer_size; }
+    unsigned buffer_count() { return m_buffer_count; }
+    // 把缓冲区还给内核，下一次submit_and_wait时一起发布
+    void recycle(unsigned bid);
+
+private:
+    void destroy();
+
+    int m_fd;
+    unsigned m_sq_entries;
+    unsigned m_sq_mask;
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned m_sqe_tail;    // 本地已经填好、还没有发布给内核的位置
+    io_uring_sqe *m_sqes;
+    unsigned m_cq_mask;
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    io_uring_cqe *m_cqes;
+    void *m_ring;           // 提交队列和完成队列共用的映射
+    size_t m_ring_size;
+    size_t m_sqes_size;
+
+    io_uring_buf_ring *m_buf_ring;
+    char *m_buffers;
+    unsigned m_buffer_count;
+    unsigned m_buffer_size;
+    unsigned m_buf_tail;      // 本地的尾部，发布之前内核看不到
+    unsigned m_buf_published; // 已经发布的尾部
+};
+
+#endif
@@ -3,6 +3,10 @@
 #include <pthread.h>
 #include <exception>
 #include <semaphore.h>
+#include <atomic>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 // 线程同步机制封装类
 // 互斥锁类
 
@@ -97,4 +101,83 @@ private:
     sem_t m_sem;
 };
 
+/*
+    线程池的等待策略
+    每个等待策略都需要提供以下接口：
+        template<typename Pred> void wait(Pred ready)  阻塞直到被唤醒，返回后调用者需要自行重新检查条件
+        void notify(int n)                             有n个新任务，唤醒至多n个等待者
+        void notify_all()                              唤醒所有等待者
+*/
+
+// 信号量等待策略，即最初的实现，每个任务一次post，每次等待一次wait
+class sem_waiter {
+public:
+    template<typename Pred>
+    void wait(Pred) {
+        m_sem.wait();
+    }
+
+    void notify(int n) {
+        for(int i = 0; i < n; ++i) {
+            m_sem.post();
+        }
+    }
+
+    void notify_all() {
+        notify(1024);
+    }
+
+private:
+    sem m_sem;
+};
+
+// 先自旋后futex的等待策略
+// 任务到来很密集时，工作线程在自旋阶段就能拿到任务，不需要陷入内核；
+// 只有真正空闲时才睡眠在futex上，生产者只在有等待者时才调用futex唤醒。
+class spin_futex_waiter {
+public:
+    static const int SPIN_COUNT = 128; // 睡眠前的自旋次数
+
+    spin_futex_waiter() : m_epoch(0), m_waiters(0) {}
+
+    template<typename Pred>
+    void wait(Pred ready) {
+        for(int i = 0; i < SPIN_COUNT; ++i) {
+            if(ready()) {
+                return;
+            }
+            cpu_relax();
+        }
+        m_waiters.fetch_add(1);
+        // 先读epoch再检查条件，如果检查之后有通知，epoch会变化，futex_wait会立即返回
+        int epoch = m_epoch.load();
+        if(!ready()) {
+            syscall(SYS_futex, (int *)&m_epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+        }
+        m_waiters.fetch_sub(1);
+    }
+
+    void notify(int n) {
+        m_epoch.fetch_add(1);
+        if(m_waiters.load() > 0) {
+            syscall(SYS_futex, (int *)&m_epoch, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+        }
+    }
+
+    void notify_all() {
+        m_epoch.fetch_add(1);
+        syscall(SYS_futex, (int *)&m_epoch, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL, NULL, 0);
+    }
+
+private:
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    std::atomic<int> m_epoch;   // 每次通知加一，作为futex的等待值
+    std::atomic<int> m_waiters; // 睡眠在futex上的线程数
+};
+
 #endif
\ No newline at end of file
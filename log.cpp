@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+std::atomic<logger::ring *> logger::m_rings(NULL);
+std::atomic<bool> logger::m_running(false);
+int logger::m_fd = STDOUT_FILENO;
+pthread_t logger::m_thread;
+
+static const int PREFIX_MAX = 64;
+static const int OUT_SIZE = 64 * 1024; // 后台线程攒够这么多再写一次
+static const char *const level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+// 线程退出时交出自己的环
+struct logger::ring_owner {
+    ring *owned;
+    ring_owner() : owned(NULL) {}
+    ~ring_owner() {
+        if(owned) {
+            owned->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local logger::ring_owner logger::t_owner;
+
+// 位置pos处开始的len字节，越过环尾时分两段拷贝
+static inline void copy_in(char *data, uint64_t pos, const void *src, int len) {
+    int at = pos & (logger::RING_SIZE - 1);
+    int first = len < logger::RING_SIZE - at ? len : logger::RING_SIZE - at;
+    memcpy(data + at, src, first);
+    memcpy(data, (const char *)src + first, len - first);
+}
+
+static inline void copy_out(const char *data, uint64_t pos, void *dst, int len) {
+    int at = pos & (logger::RING_SIZE - 1);
+    int first = len < logger::RING_SIZE - at ? len : logger::RING_SIZE - at;
+    memcpy(dst, data + at, first);
+    memcpy((char *)dst + first, data, len - first);
+}
+
+bool logger::start(int fd) {
+    m_fd = fd;
+    m_running.store(true, std::memory_order_release);
+    if(pthread_create(&m_thread, NULL, worker, NULL) != 0) {
+        m_running.store(false, std::memory_order_release);
+        return false;
+    }
+    return true;
+}
+
+void logger::stop() {
+    if(!m_running.exchange(false)) {
+        return;
+    }
+    pthread_join(m_thread, NULL);
+}
+
+long long logger::dropped() {
+    long long total = 0;
+    for(ring *r = m_rings.load(std::memory_order_acquire); r; r = r->next) {
+        total += r->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// 接手一个无主的环，没有时新建一个挂到链表头部
+logger::ring *logger::attach() {
+    ring *r = m_rings.load(std::memory_order_acquire);
+    for(; r; r = r->next) {
+        bool expected = false;
+        if(!r->owned.load(std::memory_order_relaxed)
+            && r->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            break;
+        }
+    }
+    if(!r) {
+        r = new ring();
+        r->owned.store(true, std::memory_order_relaxed);
+        r->next = m_rings.load(std::memory_order_relaxed);
+        while(!m_rings.compare_exchange_weak(r->next, r, std::memory_order_release)) {
+        }
+    }
+    r->tid = (int)syscall(SYS_gettid);
+    t_owner.owned = r;
+    return r;
+}
+
+void logger::write(LOG_LEVEL level, const char *format, ...) {
+    char line[PREFIX_MAX + MAX_LINE];
+    char *msg = line + PREFIX_MAX;
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(msg, MAX_LINE, format, ap);
+    va_end(ap);
+    if(len < 0) {
+        return;
+    }
+    if(len >= MAX_LINE) {
+        len = MAX_LINE - 1;
+    }
+    record rec;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec.len = len;
+    rec.level = level;
+
+    ring *r = t_owner.owned ? t_owner.owned : attach();
+    if(!m_running.load(std::memory_order_acquire)) {
+        // 后台线程没有运行，加上前缀直接写出
+        int prefix = format_prefix(line, rec, r->tid);
+        memmove(line + prefix, msg, len);
+        line[prefix + len] = '\n';
+        flush(line, prefix + len + 1);
+        return;
+    }
+
+    uint64_t tail = r->tail.load(std::memory_order_relaxed);
+    uint64_t head = r->head.load(std::memory_order_acquire);
+    int need = sizeof(record) + len;
+    if(RING_SIZE - (tail - head) < (uint64_t)need) {
+        r->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    copy_in(r->data, tail, &rec, sizeof(record));
+    copy_in(r->data, tail + sizeof(record), msg, len);
+    r->tail.store(tail + need, std::memory_order_release);
+}
+
+// 时间精确到毫秒，秒以上的部分每秒只格式化一次
+int logger::format_prefix(char *out, const record &rec, int tid) {
+    static thread_local time_t cached_sec = -1;
+    static thread_local char cached[32];
+    time_t sec = rec.time_ns / 1000000000ULL;
+    if(sec != cached_sec) {
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &tm);
+        cached_sec = sec;
+    }
+    int ms = rec.time_ns / 1000000ULL % 1000;
+    return snprintf(out, PREFIX_MAX, "%s.%03d %s [%d] ", cached, ms, level_names[rec.level], tid);
+}
+
+void logger::flush(const char *out, int len) {
+    while(len > 0) {
+        ssize_t n = ::write(m_fd, out, len);
+        if(n <= 0) {
+            if(n == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        out += n;
+        len -= n;
+    }
+}
+
+// 取出所有环中的日志，out写满时先写出，返回是否取到了日志
+bool logger::drain(char *out, int &out_len) {
+    bool any = false;
+    for(ring *r = m_rings.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        uint64_t tail = r->tail.load(std::memory_order_acquire);
+        while(head != tail) {
+            record rec;
+            copy_out(r->data, head, &rec, sizeof(record));
+            if(OUT_SIZE - out_len < PREFIX_MAX + rec.len + 1) {
+                flush(out, out_len);
+                out_len = 0;
+            }
+            out_len += format_prefix(out + out_len, rec, r->tid);
+            copy_out(r->data, head + sizeof(record), out + out_len, rec.len);
+            out_len += rec.len;
+            out[out_len++] = '\n';
+            head += sizeof(record) + rec.len;
+            any = true;
+        }
+        r->head.store(head, std::memory_order_release);
+    }
+    return any;
+}
+
+void *logger::worker(void *) {
+    static char out[OUT_SIZE];
+    long long reported = 0;
+    while(true) {
+        // 先读取状态再取日志，退出前的最后一轮保证取完stop之前写入的日志
+        bool running = m_running.load(std::memory_order_acquire);
+        int out_len = 0;
+        bool any = drain(out, out_len);
+        long long lost = dropped();
+        if(lost > reported) {
+            if(OUT_SIZE - out_len < PREFIX_MAX) {
+                flush(out, out_len);
+                out_len = 0;
+            }
+            out_len += snprintf(out + out_len, OUT_SIZE - out_len, "日志缓冲区已满，丢弃了%lld条日志\n", lost - reported);
+            reported = lost;
+        }
+        flush(out, out_len);
+        if(!running) {
+            break;
+        }
+        if(!any) {
+            struct timespec ts = { 0, FLUSH_INTERVAL_MS * 1000000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
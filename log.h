@@ -0,0 +1,81 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+
+/*
+    异步的分级日志
+    每个线程第一次写日志时领到一个自己的环形缓冲区，写日志只在本线程里格式化消息、拷进环中，
+    不加锁也不做系统调用；后台线程定期把所有环中的日志取出来，加上时间、级别和线程号后批量写到标准输出。
+    环满时丢弃新的日志并计数，不会阻塞写日志的线程。
+    编译时定义LOG_MIN_LEVEL可以去掉低于它的级别，默认去掉DEBUG，-DLOG_MIN_LEVEL=0打开：
+    被去掉的日志语句条件在编译期为假，整条语句连同参数的计算都不会生成代码。
+    start之前和stop之后写日志直接同步写出。
+*/
+enum LOG_LEVEL { LOG_LEVEL_DEBUG = 0, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR };
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, ...) \
+    do { if((level) >= LOG_MIN_LEVEL) logger::write((level), __VA_ARGS__); } while(0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+class logger {
+public:
+    static const int MAX_LINE = 1024;        // 一条日志消息最长的字节数，超出的部分截断
+    static const int RING_SIZE = 64 * 1024;  // 每个线程的环形缓冲区大小，必须是2的幂
+    static const int FLUSH_INTERVAL_MS = 10; // 没有日志时后台线程检查的间隔
+
+    // 启动后台线程，日志写到fd
+    static bool start(int fd);
+    // 写出所有剩余的日志，等待后台线程退出
+    static void stop();
+    // 格式化一条日志，由LOG_*宏调用
+    static void write(LOG_LEVEL level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    // 环满丢弃的日志条数
+    static long long dropped();
+
+private:
+    /*
+        单生产者单消费者的环：所属线程只推进tail，后台线程只推进head，位置一直增长，取模得到下标。
+        线程退出时把环标记为无主，仍然留在链表中，下一个新线程直接接手，后台线程照常取出其中剩下的日志
+    */
+    struct ring {
+        std::atomic<uint64_t> head;
+        char pad0[56];
+        std::atomic<uint64_t> tail;
+        std::atomic<long long> dropped;
+        std::atomic<bool> owned;
+        int tid;
+        ring *next;
+        char data[RING_SIZE];
+    };
+    // 环中每条日志的头部，后面紧跟len字节的消息
+    struct record {
+        uint64_t time_ns;   // CLOCK_REALTIME
+        uint16_t len;
+        uint8_t level;
+        uint8_t pad[5];
+    };
+    struct ring_owner;
+
+    static ring *attach();
+    static void *worker(void *arg);
+    static bool drain(char *out, int &out_len);
+    static void flush(const char *out, int len);
+    static int format_prefix(char *out, const record &rec, int tid);
+
+    static std::atomic<ring *> m_rings; // 所有线程的环，只在头部插入，从不删除
+    static std::atomic<bool> m_running;
+    static thread_local ring_owner t_owner; // 本线程的环
+    static int m_fd;
+    static pthread_t m_thread;
+};
+
+#endif
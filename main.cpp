@@ -1,21 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <sys/epoll.h>
 #include <signal.h>
+#include <libgen.h>
+#include <sys/resource.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "reactor.h"
+#include "affinity.h"
+#include "fs_watcher.h"
+#include "log.h"
+#include "access_log.h"
+#include "metrics.h"
 
-#define MAX_FD 65535 // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // 监听的最大事件的个数
+#define MAX_FD 1048576 // 连接表最多的槽数，实际取它和文件描述符上限中较小的一个
+#define MAX_REACTOR 256 // 最多的反应堆个数
+#define MAX_META_ENTRY 8192 // 元数据缓存最多缓存的文件个数，每个占用一个文件描述符
+#define ACCESS_LOG_RECORDS (1 << 21) // 访问日志文件中的记录条数，写满后覆盖最旧的，每条32字节
 // 添加信号捕捉
 void addsig(int sig, void(handler)(int)){
     struct sigaction sa;
@@ -25,142 +30,293 @@ void addsig(int sig, void(handler)(int)){
     sigaction(sig, &sa, NULL);
 }
 
-// 添加文件描述符到epoll中
-extern void addfd(int epollfd, int fd, bool one_shot);
-// 从epoll中删除文件描述符
-extern void delfd(int epollfd, int fd);
-// 在epoll中修改文件描述符
-extern void modfd(int epollfd, int fd, int ev);
-// 从epoll中删除文件描述符
-extern void removefd(int epollfd, int fd);
+// 把文件描述符的软限制提高到硬限制，返回连接表需要的槽数
+// 连接表只保留虚拟地址，槽数多不占内存，C100K时需要超过65535个文件描述符
+int raise_fd_limit(){
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) != 0){
+        return MAX_FD;
+    }
+    if(rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) != 0){
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAX_FD){
+        return MAX_FD;
+    }
+    return rl.rlim_cur;
+}
 
 int main(int argc, char* argv[]){
 
-    if(argc <= 1) {
-        printf("按照如下格式运行：./%s port_number\n", basename(argv[0]));
+    // 反应堆的个数，默认为1，即单反应堆模式
+    int reactor_number = 1;
+    listen_config config;
+    // 请求头、发送停滞和长连接的超时
+    timeout_config timeouts;
+    // 线程池的调度模式
+    SCHED_MODE sched_mode = SHARED_QUEUE;
+    // 线程池的最少、最多线程数和目标排队等待时间
+    int thread_number = 8;
+    int max_thread_number = 0;
+    int target_wait_us = 1000;
+    // 反应堆和工作线程绑定的CPU列表，为空表示不绑定
+    int reactor_cpus[MAX_CPU_LIST];
+    int reactor_cpu_number = 0;
+    int worker_cpus[MAX_CPU_LIST];
+    int worker_cpu_number = 0;
+    // 是否按收到连接的CPU把新连接分给反应堆
+    bool cpu_steering = false;
+    // 静态文件缓存的大小（MB），0表示不缓存
+    int cache_mb = 64;
+    // 事件后端，io_uring不可用时反应堆自动退回epoll
+    IO_BACKEND backend = EPOLL_BACKEND;
+    // 二进制访问日志的路径，NULL表示不记录
+    const char *access_log_path = NULL;
+    // 是否响应/__stats
+    bool stats_endpoint = false;
+    // 任务排队时间持续超过它（微秒）时线程池直接回应503，0表示不丢弃
+    int shed_target_us = 5000;
+    int opt;
+    while((opt = getopt(argc, argv, "r:b:D:F:st:T:L:C:W:Bc:d:H:I:K:UA:SO:")) != -1){
+        switch(opt){
+            case 'r':
+                reactor_number = atoi(optarg);
+                break;
+            case 'b':
+                config.backlog = atoi(optarg);
+                break;
+            case 'D':
+                config.defer_accept = atoi(optarg);
+                break;
+            case 'F':
+                config.fastopen = atoi(optarg);
+                break;
+            case 's':
+                sched_mode = WORK_STEALING;
+                break;
+            case 't':
+                thread_number = atoi(optarg);
+                break;
+            case 'T':
+                max_thread_number = atoi(optarg);
+                break;
+            case 'L':
+                target_wait_us = atoi(optarg);
+                break;
+            case 'C':
+                reactor_cpu_number = parse_cpu_list(optarg, reactor_cpus, MAX_CPU_LIST);
+                break;
+            case 'W':
+                worker_cpu_number = parse_cpu_list(optarg, worker_cpus, MAX_CPU_LIST);
+                break;
+            case 'B':
+                cpu_steering = true;
+                break;
+            case 'c':
+                cache_mb = atoi(optarg);
+                break;
+            case 'H':
+                timeouts.header = atoi(optarg) * 1000;
+                break;
+            case 'I':
+                timeouts.idle = atoi(optarg) * 1000;
+                break;
+            case 'K':
+                timeouts.keepalive = atoi(optarg) * 1000;
+                break;
+            case 'd':
+                doc_root = optarg;
+                break;
+            case 'U':
+                backend = URING_BACKEND;
+                break;
+            case 'A':
+                access_log_path = optarg;
+                break;
+            case 'S':
+                stats_endpoint = true;
+                break;
+            case 'O':
+                shed_target_us = atoi(optarg);
+                break;
+            default:
+                break;
+        }
+    }
+
+    if(optind >= argc || reactor_number <= 0 || reactor_number > MAX_REACTOR || thread_number <= 0
+        || reactor_cpu_number < 0 || worker_cpu_number < 0 || cache_mb < 0 || shed_target_us < 0) {
+        printf("按照如下格式运行：./%s [-r reactor_number] [-b backlog] [-D defer_accept_seconds] [-F fastopen_queue] [-s]"
+               " [-t min_threads] [-T max_threads] [-L target_wait_us] [-C reactor_cpus] [-W worker_cpus] [-B] [-c cache_mb] [-d doc_root]"
+               " [-H header_timeout_seconds] [-I idle_timeout_seconds] [-K keepalive_timeout_seconds] [-U] [-A access_log] [-S] [-O shed_target_us]"
+               " port_number\n", basename(argv[0]));
         exit(0);
     }
 
     // 获取端口号
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
+
+    // 日志由后台线程写到标准输出，之后创建的线程都只写自己的缓冲区
+    logger::start(STDOUT_FILENO);
+    // 运行指标导出到共享内存，用tools/stats.cpp读取
+    metrics::init(port);
+    http_conn::m_stats_enabled = stats_endpoint;
+    access_log *accesses = NULL;
+    if(access_log_path){
+        try{
+            accesses = new access_log(access_log_path, ACCESS_LOG_RECORDS);
+            http_conn::m_access_log = accesses;
+        }
+        catch(...){
+            LOG_ERROR("无法创建访问日志%s", access_log_path);
+            logger::stop();
+            exit(-1);
+        }
+    }
 
     // 对SIGPIE信号进行处理
     addsig(SIGPIPE, SIG_IGN);
 
+    // 屏蔽退出信号，之后创建的线程都继承这个屏蔽字，只由主线程用sigwait同步地处理
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    // 创建所有连接共享的静态文件缓存和路径元数据缓存，由inotify监视线程保持和文件系统一致
+    file_cache *files = cache_mb > 0 ? new file_cache((size_t)cache_mb << 20) : NULL;
+    stat_cache *metas = new stat_cache(MAX_META_ENTRY);
+    fs_watcher *watcher = NULL;
+    path_filter *filter = NULL;
+    gzip_compressor *compressor = NULL;
+    try{
+        watcher = new fs_watcher(doc_root, metas, files);
+        // 监视建立之后再遍历根目录建立过滤器，期间新建的文件由监视线程补上
+        filter = new path_filter(doc_root);
+        watcher->set_filter(filter);
+        watcher->start();
+        http_conn::m_file_cache = files;
+        http_conn::m_stat_cache = metas;
+        http_conn::m_path_filter = filter;
+        // 压缩好的版本放在文件缓存中，没有文件缓存时只使用.gz文件
+        if(files){
+            compressor = new gzip_compressor(files);
+            compressor->start();
+            http_conn::m_compressor = compressor;
+        }
+        LOG_INFO("监视%s下的%d个目录", doc_root, watcher->watch_count());
+        LOG_INFO("路径过滤器：%lld个路径，占用%zu字节，假阳性率约%.4f%%",
+            filter->paths(), filter->memory(), filter->false_positive_rate() * 100);
+    }
+    catch(...){
+        // 没有inotify时无法知道文件何时变化，不使用缓存
+        LOG_INFO("无法监视%s，不使用文件缓存", doc_root);
+        delete watcher;
+        watcher = NULL;
+        delete filter;
+        filter = NULL;
+    }
+
     // 创建线程池，初始化线程池
     threadpool<http_conn> *pool = NULL;
     try{
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(thread_number, 10000, sched_mode, max_thread_number, target_wait_us);
     }
     catch(...){
         exit(-1);
     }
+    pool->set_affinity(worker_cpus, worker_cpu_number);
+    if(shed_target_us > 0){
+        pool->set_shedding(shed_target_us, [](http_conn *conn){ conn->shed(); });
+    }
 
-    // 创建一个数组用于保存所有客户端信息
-    http_conn *users = new http_conn[MAX_FD];
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    if(listenfd == -1){
-        perror("listenfd");
+    // 创建反应堆，多于一个时每个反应堆使用SO_REUSEPORT绑定同一个端口
+    // 第i个反应堆绑定到CPU列表中的第i个CPU，客户端信息表从该CPU所在的NUMA节点分配
+    reactor *reactors[MAX_REACTOR];
+    int max_fd = raise_fd_limit();
+    LOG_INFO("最多%d个连接，每个连接常驻%zu字节，处理请求时另借%d字节的读缓冲区和工作区",
+        max_fd, sizeof(http_conn), 2 * buffer_pool::SLAB_SIZE);
+    try{
+        for(int i = 0; i < reactor_number; ++i){
+            int cpu = reactor_cpu_number > 0 ? reactor_cpus[i % reactor_cpu_number] : -1;
+            reactors[i] = new reactor(i, port, reactor_number > 1, config, timeouts, max_fd, pool, backend, cpu);
+        }
+    }
+    catch(...){
         exit(-1);
     }
 
-
-    // 设置端口复用
-    int reuse = 1;
-    int ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    if(ret == -1){
-        perror("setsocketopt");
-        exit(-1);
+    // 所有监听socket都加入SO_REUSEPORT组之后才能挂载分发程序
+    if(cpu_steering && reactor_number > 1){
+        reactors[0]->attach_cpu_steering(reactor_number);
     }
 
-    // 绑定
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    ret = bind(listenfd, (struct sockaddr*)&address, sizeof(address));
-    if(ret == -1){
-        perror("bind");
+    try{
+        for(int i = 0; i < reactor_number; ++i){
+            LOG_INFO("create the %dth reactor (%s)", i, reactors[i]->backend() == URING_BACKEND ? "io_uring" : "epoll");
+            reactors[i]->start();
+        }
+    }
+    catch(...){
         exit(-1);
     }
 
-    // 监听
-    ret = listen(listenfd, 5);
-    if(ret == -1){
-        perror("listen");
-        exit(-1);
+    // 等待退出信号
+    int sig = 0;
+    sigwait(&stop_signals, &sig);
+    LOG_INFO("收到信号%d，服务器退出...", sig);
+
+    // 先停止反应堆，不再产生新的任务，再等待工作线程处理完手上的任务，最后释放连接
+    for(int i = 0; i < reactor_number; ++i){
+        reactors[i]->stop();
     }
-    
-    // 创建epoll对象，事件数组，添加
-    epoll_event events[MAX_EVENT_NUMBER+1];
-    int epollfd = epoll_create(5);
-    if(epollfd == -1){
-        perror("epollfd");
-        exit(-1);
+    for(int i = 0; i < reactor_number; ++i){
+        reactors[i]->join();
     }
-    
-    // 将监听的文件描述符添加到epoll对象中
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
-    
-    // 检测时间发生
-    while(1){
-        
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        puts("epoll");
-        if((num < 0) && (errno != EINTR)){
-            printf("epoll failure\n");
-            break;
-        }
-        
-        // 循环遍历数组
-        for(int i = 0;i < num;++i){
-            int sockfd = events[i].data.fd;
-            if(sockfd == listenfd){ // 有客户端连接进入
-                struct sockaddr_in client_address;
-                socklen_t sock_len = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr*)&client_address, &sock_len);
-
-                if(http_conn::m_user_count >= MAX_FD){
-                    // 目前的连接数满了
-                    printf("超负荷，服务器正忙...\n");
-                    close(connfd);
-                    continue;
-                }
-
-                // 将新客户的数据初始化，放到数组中
-                users[connfd].init(connfd, client_address);
-            } else if(events[i].events & (EPOLLRDHUP | EPOLLHUP |EPOLLERR)) {
-                // 对方异常
-                users[sockfd].close_conn();
-
-            }
-            else if(events[i].events & EPOLLIN) { // 有读事件发生
-                if(users[sockfd].read()){
-                    // 一次性把所有数据都读完
-                    // 将任务追加到线程池中
-                    pool->append(users + sockfd);
-                }
-                else { 
-                    // 读失败
-                    users[sockfd].close_conn();
-                }
-            }
-            else if(events[i].events & EPOLLOUT) { // 写事件发生
-                if(users[sockfd].write()){
-                    // 一次性把所有数据都写完
-                    pool->append(users + sockfd);
-                }
-                else { 
-                    // 读失败
-                    users[sockfd].close_conn();
-                }
-            }
-        }
+    pool->stop();
+    for(int i = 0; i < reactor_number; ++i){
+        delete reactors[i];
     }
-    close(listenfd);
-    close(epollfd);
-    delete []users;
     delete pool;
+    if(watcher){
+        watcher->stop();
+        watcher->join();
+        delete watcher;
+    }
+    if(compressor){
+        compressor->stop();
+        compressor->join();
+        compressor_stats stats;
+        compressor->stats(stats);
+        LOG_INFO("后台压缩：压缩%lld个文件，%lld字节压缩为%lld字节，放弃%lld个，丢弃%lld个任务",
+            stats.compressed, stats.bytes_in, stats.bytes_out, stats.skipped, stats.dropped);
+        delete compressor;
+    }
+    if(http_conn::m_stat_cache){
+        stat_cache_stats stats;
+        http_conn::m_stat_cache->stats(stats);
+        LOG_INFO("元数据缓存：命中%lld次，未命中%lld次，失效%lld次，当前%lld个文件",
+            stats.hits, stats.misses, stats.invalidations, stats.entries);
+    }
+    if(http_conn::m_file_cache){
+        file_cache_stats stats;
+        http_conn::m_file_cache->stats(stats);
+        LOG_INFO("文件缓存：命中%lld次，未命中%lld次，读入%lld个，淘汰%lld个，拒绝%lld次，当前%lld个文件共%lld字节",
+            stats.hits, stats.misses, stats.inserts, stats.evictions, stats.rejects, stats.entries, stats.bytes);
+    }
+    if(filter){
+        LOG_INFO("路径过滤器：拒绝%lld个不存在的路径，当前%lld个路径，假阳性率约%.4f%%",
+            filter->rejects(), filter->paths(), filter->false_positive_rate() * 100);
+    }
+    delete filter;
+    delete files;
+    delete metas;
+    delete accesses;
+    metrics::destroy();
+    logger::stop();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "metrics.h"
+#include "log.h"
+
+const int metrics::status_codes[metrics::STATUS_NUMBER - 1] = { 200, 206, 304, 400, 403, 404, 416, 500, 503 };
+
+metrics::header *metrics::m_header = NULL;
+metrics::thread_block *metrics::m_blocks = NULL;
+size_t metrics::m_size = 0;
+bool metrics::m_shared = false;
+char metrics::m_name[64];
+thread_local metrics::thread_block *metrics::t_owner_block = NULL;
+
+// 线程退出时交出自己的块
+struct metrics::block_owner {
+    thread_block *owned;
+    block_owner() : owned(NULL) {}
+    ~block_owner() {
+        if(owned) {
+            t_owner_block = NULL;
+            owned->owned.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local metrics::block_owner metrics::t_owner;
+
+void metrics::shm_name(int port, char *name, size_t size) {
+    snprintf(name, size, "/tiny_webserver.%d", port);
+}
+
+void metrics::init(int port) {
+    static_assert(sizeof(header) == 64, "metrics header must be 64 bytes");
+    m_size = sizeof(header) + (size_t)MAX_THREADS * sizeof(thread_block);
+    shm_name(port, m_name, sizeof(m_name));
+    void *addr = MAP_FAILED;
+    // 上一次运行留下的同名内存直接截断重建
+    int fd = shm_open(m_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd != -1) {
+        if(ftruncate(fd, m_size) == 0) {
+            addr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if(addr == MAP_FAILED) {
+            shm_unlink(m_name);
+        }
+    }
+    m_shared = addr != MAP_FAILED;
+    if(!m_shared) {
+        LOG_WARN("shm_open: %s", strerror(errno));
+        addr = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(addr == MAP_FAILED) {
+            return;
+        }
+    }
+    m_blocks = (thread_block *)((char *)addr + sizeof(header));
+    header *h = (header *)addr;
+    h->block_size = sizeof(thread_block);
+    h->max_threads = MAX_THREADS;
+    h->used.store(0, std::memory_order_relaxed);
+    h->pid = getpid();
+    h->start_time = time(NULL);
+    // magic最后写，命令行工具看到它时其余字段都已经填好
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(h->magic, "TWSMETR1", 8);
+    m_header = h;
+}
+
+void metrics::destroy() {
+    if(!m_header) {
+        return;
+    }
+    if(m_shared) {
+        shm_unlink(m_name);
+    }
+    // 其他线程都已经退出，这里只解除映射
+    munmap(m_header, m_size);
+    m_header = NULL;
+    m_blocks = NULL;
+}
+
+// 接手一个无主的块，没有时用一个新块，都用完了就不记录
+metrics::thread_block *metrics::attach() {
+    if(!m_header) {
+        return NULL;
+    }
+    thread_block *b = NULL;
+    uint32_t used = m_header->used.load(std::memory_order_acquire);
+    for(uint32_t i = 0; i < used; ++i) {
+        bool expected = false;
+        if(!m_blocks[i].owned.load(std::memory_order_relaxed)
+            && m_blocks[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            b = m_blocks + i;
+            break;
+        }
+    }
+    while(!b && used < MAX_THREADS) {
+        if(m_header->used.compare_exchange_weak(used, used + 1, std::memory_order_acq_rel)) {
+            b = m_blocks + used;
+            b->owned.store(true, std::memory_order_relaxed);
+        }
+    }
+    if(!b) {
+        return NULL;
+    }
+    b->tid = (int)syscall(SYS_gettid);
+    t_owner.owned = b;
+    t_owner_block = b;
+    return b;
+}
+
+int metrics::bucket_of(uint64_t value) {
+    if(value < (1u << SUB_BITS)) {
+        return value;
+    }
+    int e = 63 - __builtin_clzll(value);
+    if(e >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    int sub = (value >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+    return ((e - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+uint64_t metrics::bucket_upper(int bucket) {
+    if(bucket < (1 << SUB_BITS)) {
+        return bucket;
+    }
+    int e = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << SUB_BITS) - 1);
+    uint64_t width = 1ULL << (e - SUB_BITS);
+    return (((1ULL << SUB_BITS) + sub) << (e - SUB_BITS)) + width - 1;
+}
+
+void metrics::record(METRIC_HISTOGRAM h, long long ns) {
+    thread_block *b = block();
+    if(!b) {
+        return;
+    }
+    uint64_t value = ns > 0 ? ns : 0;
+    histogram &hist = b->histograms[h];
+    bump(hist.buckets[bucket_of(value)], 1);
+    bump(hist.count, 1);
+    bump(hist.sum, value);
+}
+
+void metrics::response(int status, uint64_t bytes) {
+    thread_block *b = block();
+    if(!b) {
+        return;
+    }
+    int i = 0;
+    while(i < STATUS_NUMBER - 1 && status_codes[i] != status) {
+        ++i;
+    }
+    bump(b->requests[i], 1);
+    bump(b->counters[M_BYTES_SENT], bytes);
+}
+
+void metrics::collect(const header *h, snapshot &snap) {
+    memset(&snap, 0, sizeof(snap));
+    if(!h) {
+        return;
+    }
+    const thread_block *blocks = (const thread_block *)((const char *)h + sizeof(header));
+    uint32_t used = h->used.load(std::memory_order_acquire);
+    if(used > h->max_threads) {
+        used = h->max_threads;
+    }
+    for(uint32_t i = 0; i < used; ++i) {
+        const thread_block &b = blocks[i];
+        snap.threads += b.owned.load(std::memory_order_relaxed) ? 1 : 0;
+        for(int c = 0; c < M_COUNTER_NUMBER; ++c) {
+            snap.counters[c] += b.counters[c].load(std::memory_order_relaxed);
+        }
+        for(int s = 0; s < STATUS_NUMBER; ++s) {
+            snap.requests[s] += b.requests[s].load(std::memory_order_relaxed);
+        }
+        for(int k = 0; k < M_HISTOGRAM_NUMBER; ++k) {
+            const histogram &hist = b.histograms[k];
+            snap.count[k] += hist.count.load(std::memory_order_relaxed);
+            snap.sum[k] += hist.sum.load(std::memory_order_relaxed);
+            for(int j = 0; j < BUCKETS; ++j) {
+                snap.buckets[k][j] += hist.buckets[j].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+uint64_t metrics::percentile(const snapshot &snap, METRIC_HISTOGRAM h, double q) {
+    uint64_t total = 0;
+    for(int j = 0; j < BUCKETS; ++j) {
+        total += snap.buckets[h][j];
+    }
+    if(total == 0) {
+        return 0;
+    }
+    // 第rank个值所在的桶
+    uint64_t rank = (uint64_t)(q * total);
+    if(rank >= total) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for(int j = 0; j < BUCKETS; ++j) {
+        seen += snap.buckets[h][j];
+        if(seen > rank) {
+            return bucket_upper(j);
+        }
+    }
+    return bucket_upper(BUCKETS - 1);
+}
+
+// 两个累计值之差，读取时两者不是同一时刻的，差可能短暂为负
+static long long gauge(uint64_t up, uint64_t down) {
+    return up > down ? (long long)(up - down) : 0;
+}
+
+int metrics::format_prometheus(const snapshot &snap, char *out, int size) {
+    int len = 0;
+#define APPEND(...) \
+    do { if(len < size) { int n = snprintf(out + len, size - len, __VA_ARGS__); len += n > 0 ? n : 0; } } while(0)
+
+    APPEND("# HELP tws_requests_total Responses sent, by status code.\n# TYPE tws_requests_total counter\n");
+    for(int s = 0; s < STATUS_NUMBER - 1; ++s) {
+        APPEND("tws_requests_total{code=\"%d\"} %llu\n", status_codes[s], (unsigned long long)snap.requests[s]);
+    }
+    APPEND("tws_requests_total{code=\"other\"} %llu\n", (unsigned long long)snap.requests[STATUS_NUMBER - 1]);
+
+    static const char *const counter_names[M_COUNTER_NUMBER] = {
+        "tws_connections_accepted_total", "tws_connections_rejected_total", "tws_connections_closed_total",
+        "tws_tasks_enqueued_total", "tws_tasks_dequeued_total", "tws_response_bytes_total", "tws_requests_shed_total" };
+    for(int c = 0; c < M_COUNTER_NUMBER; ++c) {
+        APPEND("# TYPE %s counter\n%s %llu\n", counter_names[c], counter_names[c], (unsigned long long)snap.counters[c]);
+    }
+    APPEND("# TYPE tws_connections_active gauge\ntws_connections_active %lld\n",
+        gauge(snap.counters[M_ACCEPTED], snap.counters[M_CLOSED]));
+    APPEND("# TYPE tws_queue_depth gauge\ntws_queue_depth %lld\n",
+        gauge(snap.counters[M_ENQUEUED], snap.counters[M_DEQUEUED]));
+
+    // 固定的上界，每个取不超过它的桶，桶边界和它不对齐时有至多12.5%的误差
+    static const char *const histogram_names[M_HISTOGRAM_NUMBER] = {
+        "tws_queue_wait_seconds", "tws_parse_seconds", "tws_write_seconds" };
+    static const double bounds[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10 };
+    for(int k = 0; k < M_HISTOGRAM_NUMBER; ++k) {
+        const char *name = histogram_names[k];
+        APPEND("# TYPE %s histogram\n", name);
+        uint64_t cumulative = 0;
+        int j = 0;
+        for(size_t b = 0; b < sizeof(bounds) / sizeof(bounds[0]); ++b) {
+            uint64_t limit = (uint64_t)(bounds[b] * 1e9);
+            for(; j < BUCKETS && bucket_upper(j) <= limit; ++j) {
+                cumulative += snap.buckets[k][j];
+            }
+            APPEND("%s_bucket{le=\"%g\"} %llu\n", name, bounds[b], (unsigned long long)cumulative);
+        }
+        APPEND("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name, (unsigned long long)snap.count[k],
+            name, snap.sum[k] / 1e9, name, (unsigned long long)snap.count[k]);
+    }
+#undef APPEND
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,139 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+
+/*
+    运行指标
+    每个线程有一块自己的、按缓存行对齐的计数器和延迟直方图，只有这个线程写，
+    更新就是一次普通的加法，不需要原子读改写，也不会和其他线程争抢缓存行。
+    所有线程的块都放在一段共享内存（/dev/shm/tiny_webserver.端口）中：
+    自带的命令行工具直接映射这段内存汇总，服务器读取时不做任何事情；开启/__stats时工作线程按同样的方式汇总，
+    输出Prometheus文本格式。
+    计数器都是累计值，活跃连接数和队列长度由两个累计值相减得到，线程退出后它的块留给下一个新线程继续累加。
+    直方图是HDR风格的对数线性分桶：每个2的幂区间分成8个桶，相对误差不超过12.5%，覆盖1ns到约18分钟。
+*/
+
+// 计数器
+enum METRIC_COUNTER {
+    M_ACCEPTED = 0,  // 接受的连接
+    M_REJECTED,      // 连接数满了或者线程池队列满了，回应503后直接关闭的连接
+    M_CLOSED,        // 关闭的连接
+    M_ENQUEUED,      // 交给线程池的任务
+    M_DEQUEUED,      // 工作线程开始执行的任务
+    M_BYTES_SENT,    // 发送完的应答字节数，包括响应头
+    M_SHED,          // 在线程池队列中等得太久、没有处理就回应503的请求
+    M_COUNTER_NUMBER
+};
+
+// 延迟直方图，单位都是纳秒
+enum METRIC_HISTOGRAM {
+    H_QUEUE_WAIT = 0, // 任务在线程池队列中等待的时间
+    H_PARSE,          // 解析一个完整的请求并找到目标文件的时间
+    H_WRITE,          // 一批应答从生成完到全部发送完的时间
+    M_HISTOGRAM_NUMBER
+};
+
+class metrics {
+public:
+    static const int MAX_THREADS = 512;  // 共享内存中线程块的个数，超出的线程不记录
+    static const int SUB_BITS = 3;       // 每个2的幂区间分成2^SUB_BITS个桶
+    static const int MAX_BITS = 40;      // 不小于2^MAX_BITS的值都记在最后一个桶里
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+    // 单独计数的状态码，其余的记在最后一项
+    static const int STATUS_NUMBER = 10;
+    static const int status_codes[STATUS_NUMBER - 1];
+
+    struct histogram {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> buckets[BUCKETS];
+    };
+
+    struct alignas(64) thread_block {
+        std::atomic<bool> owned;
+        int tid;
+        std::atomic<uint64_t> counters[M_COUNTER_NUMBER];
+        std::atomic<uint64_t> requests[STATUS_NUMBER];
+        histogram histograms[M_HISTOGRAM_NUMBER];
+    };
+
+    // 共享内存开头的64字节
+    struct header {
+        char magic[8];           // "TWSMETR1"
+        uint32_t block_size;     // sizeof(thread_block)
+        uint32_t max_threads;
+        std::atomic<uint32_t> used; // 用过的线程块个数，只增不减
+        int32_t pid;
+        uint64_t start_time;     // 服务器启动的时间，CLOCK_REALTIME，秒
+        char pad[32];
+    };
+
+    // 所有线程块汇总后的结果
+    struct snapshot {
+        uint64_t counters[M_COUNTER_NUMBER];
+        uint64_t requests[STATUS_NUMBER];
+        uint64_t count[M_HISTOGRAM_NUMBER];
+        uint64_t sum[M_HISTOGRAM_NUMBER];
+        uint64_t buckets[M_HISTOGRAM_NUMBER][BUCKETS];
+        int threads;
+    };
+
+    // 创建端口对应的共享内存，失败时改用进程私有的内存，指标照常记录，只是外部无法读取
+    static void init(int port);
+    // 删除共享内存
+    static void destroy();
+    // 共享内存的名字，命令行工具用同样的规则找到它
+    static void shm_name(int port, char *name, size_t size);
+
+    static void add(METRIC_COUNTER counter, uint64_t n = 1) {
+        thread_block *b = block();
+        if(b) {
+            bump(b->counters[counter], n);
+        }
+    }
+    static void record(METRIC_HISTOGRAM h, long long ns);
+    static void response(int status, uint64_t bytes);
+
+    static long long now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    // 以下在读取方使用，既可以读本进程的指标，也可以读命令行工具映射的共享内存
+    static const header *shared() { return m_header; }
+    static void collect(const header *h, snapshot &snap);
+    // 直方图中第q（0到1）分位的值，取所在桶的上界
+    static uint64_t percentile(const snapshot &snap, METRIC_HISTOGRAM h, double q);
+    // 以Prometheus文本格式输出，返回长度，out不够时截断
+    static int format_prometheus(const snapshot &snap, char *out, int size);
+
+    static int bucket_of(uint64_t value);
+    static uint64_t bucket_upper(int bucket);
+
+private:
+    struct block_owner;
+
+    // 只有所属线程写，读取方可能同时读，用不带原子读改写的加法
+    static void bump(std::atomic<uint64_t> &c, uint64_t n) {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static thread_block *block() {
+        thread_block *b = t_owner_block;
+        return b ? b : attach();
+    }
+    static thread_block *attach();
+
+    static header *m_header;
+    static thread_block *m_blocks;
+    static size_t m_size;
+    static bool m_shared;
+    static char m_name[64];
+    static thread_local thread_block *t_owner_block; // 本线程的块，只是个指针，访问时不需要线程局部变量的初始化检查
+    static thread_local block_owner t_owner;         // 线程退出时交出块
+};
+
+#endif
@@ -0,0 +1,139 @@
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "path_filter.h"
+
+path_filter::path_filter(const char *root) : m_blocks_array(NULL), m_blocks(MIN_BLOCKS), m_root_len(strlen(root)),
+    m_paths(0), m_rejects(0) {
+    // 先数出路径个数再决定位数组的大小
+    std::string dir(root);
+    long long count = walk(dir, 0, false) + 1;
+    size_t bits = (size_t)count * BITS_PER_PATH * GROWTH_FACTOR;
+    while(m_blocks * 512 < bits) {
+        m_blocks <<= 1;
+    }
+    m_blocks_array = new block[m_blocks];
+    for(size_t i = 0; i < m_blocks; ++i) {
+        for(int j = 0; j < 8; ++j) {
+            m_blocks_array[i].words[j].store(0, std::memory_order_relaxed);
+        }
+    }
+    add(root);
+    walk(dir, 0, true);
+}
+
+path_filter::~path_filter() {
+    delete[] m_blocks_array;
+}
+
+// 64位FNV-1a，再用MurmurHash3的fmix64打散
+uint64_t path_filter::hash_path(const char *path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for(const unsigned char *p = (const unsigned char *)path; p < (const unsigned char *)path + len; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void path_filter::set(uint64_t h) {
+    block &b = m_blocks_array[h & (m_blocks - 1)];
+    // 高32位用双重哈希生成块内的K个位置
+    uint32_t h1 = h >> 32;
+    uint32_t h2 = (uint32_t)(h >> 16) | 1;
+    for(int i = 0; i < K; ++i) {
+        uint32_t bit = (h1 + i * h2) & 511;
+        b.words[bit >> 6].fetch_or(1ULL << (bit & 63), std::memory_order_relaxed);
+    }
+    m_paths.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool path_filter::test(uint64_t h) {
+    block &b = m_blocks_array[h & (m_blocks - 1)];
+    uint32_t h1 = h >> 32;
+    uint32_t h2 = (uint32_t)(h >> 16) | 1;
+    for(int i = 0; i < K; ++i) {
+        uint32_t bit = (h1 + i * h2) & 511;
+        if(!(b.words[bit >> 6].load(std::memory_order_relaxed) & (1ULL << (bit & 63)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void path_filter::add(const char *path) {
+    set(hash_path(path, strlen(path)));
+}
+
+void path_filter::add_link(const char *path) {
+    set(hash_path(path, strlen(path)) ^ LINK_SALT);
+}
+
+bool path_filter::may_contain(const char *path) {
+    size_t len = strlen(path);
+    if(test(hash_path(path, len))) {
+        return true;
+    }
+    // 不在过滤器中的路径，只有经过符号链接时才可能存在，只在拒绝之前多查几个块
+    const char *start = len > m_root_len ? path + m_root_len : path;
+    for(const char *p = strchr(start + 1, '/'); p; p = strchr(p + 1, '/')) {
+        if(test(hash_path(path, p - path) ^ LINK_SALT)) {
+            return true;
+        }
+    }
+    m_rejects.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void path_filter::add_tree(const std::string &dir) {
+    walk(dir, 0, true);
+}
+
+// 遍历dir下的所有路径，insert为true时加入过滤器，返回路径个数
+long long path_filter::walk(const std::string &dir, int depth, bool insert) {
+    if(depth >= MAX_DEPTH) {
+        return 0;
+    }
+    DIR *d = opendir(dir.c_str());
+    if(!d) {
+        return 0;
+    }
+    long long count = 0;
+    struct dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        std::string path = dir + "/" + entry->d_name;
+        // 不跟随符号链接，和fs_watcher一致，链接本身另外标记
+        unsigned char type = entry->d_type;
+        if(type == DT_UNKNOWN) {
+            struct stat st;
+            type = lstat(path.c_str(), &st) != 0 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+        }
+        if(insert) {
+            add(path.c_str());
+            if(type == DT_LNK) {
+                add_link(path.c_str());
+            }
+        }
+        count += type == DT_LNK ? 2 : 1;
+        if(type == DT_DIR) {
+            count += walk(path, depth + 1, insert);
+        }
+    }
+    closedir(d);
+    return count;
+}
+
+double path_filter::false_positive_rate() {
+    double bits = m_blocks * 512.0;
+    return pow(1.0 - exp(-K * (double)paths() / bits), K);
+}
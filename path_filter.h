@@ -0,0 +1,66 @@
+#ifndef PATH_FILTER_H
+#define PATH_FILTER_H
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+/*
+    存在路径的布隆过滤器，用来快速拒绝一定不存在的路径
+    启动时遍历网站根目录，把所有文件和目录的完整路径加入过滤器，之后由fs_watcher在新建、改名时加入新路径。
+    fs_watcher不跟随符号链接，链接指向的目录下新建的文件不会以链接路径加入，所以遍历时也不跟随，
+    只把符号链接本身另外标记一次；查询的路径不在过滤器中时，如果它的某个上级目录是符号链接，仍然算可能存在。
+    过滤器说不存在的路径一定不存在，不需要stat就可以直接返回404；说可能存在的路径再走正常流程。
+    布隆过滤器不能删除，被删除的路径只会变成假阳性，不影响正确性。
+    使用分块布隆过滤器：一个路径的K个位都落在同一个64字节的块里，查询只访问一个缓存行。
+    位数组在构造时按照当时的路径个数留出GROWTH_FACTOR倍的余量，之后不再扩容，路径过多时只是假阳性率升高。
+*/
+class path_filter {
+public:
+    // 遍历root建立过滤器
+    explicit path_filter(const char *root);
+    ~path_filter();
+
+    // 加入一个路径，可以和查询并发执行
+    void add(const char *path);
+    // 标记path是符号链接，经过它的路径都交给正常流程
+    void add_link(const char *path);
+    // 加入dir下面的所有路径（不包括dir本身）
+    void add_tree(const std::string &dir);
+
+    // 路径可能存在时返回true
+    bool may_contain(const char *path);
+
+    // 统计信息
+    size_t memory() { return m_blocks * sizeof(block); }
+    long long paths() { return m_paths.load(std::memory_order_relaxed); }
+    long long rejects() { return m_rejects.load(std::memory_order_relaxed); }
+    // 按当前路径个数估计的假阳性率
+    double false_positive_rate();
+
+private:
+    static const int K = 8;                 // 每个路径置位的个数
+    static const int BITS_PER_PATH = 12;
+    static const int GROWTH_FACTOR = 4;
+    static const int MIN_BLOCKS = 1024;
+    static const int MAX_DEPTH = 32;        // 最多遍历的目录层数
+    static const uint64_t LINK_SALT = 0x9e3779b97f4a7c15ULL; // 符号链接的标记和路径本身用不同的哈希值
+
+    // 一个缓存行大小的块，512位
+    struct alignas(64) block {
+        std::atomic<uint64_t> words[8];
+    };
+
+    static uint64_t hash_path(const char *path, size_t len);
+    void set(uint64_t h);
+    bool test(uint64_t h);
+    long long walk(const std::string &dir, int depth, bool insert);
+
+    block *m_blocks_array;
+    size_t m_blocks; // 块的个数，2的幂
+    size_t m_root_len; // 根目录路径的长度，只检查根目录之下的上级目录是不是符号链接
+    std::atomic<long long> m_paths;
+    std::atomic<long long> m_rejects;
+};
+
+#endif
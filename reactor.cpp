@@ -0,0 +1,1031 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <new>
+
+#include "reactor.h"
+#include "affinity.h"
+#include "io_ring.h"
+
+thread_local reactor *reactor::t_current = NULL;
+
+// 添加文件描述符到epoll中，fd需要已经是非阻塞的（accept4时指定SOCK_NONBLOCK）
+static void addfd(int epollfd, int fd, bool one_shot){
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLRDHUP;
+
+    // 避免一个socket事件被多次触发
+    if(one_shot){
+        event.events |= EPOLLONESHOT;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// 修改文件描述符，重置socket上的EPOLLONSHOT事件
+// 确保下一次可读时，EPOLLIN可以再次被触发
+static void modfd(int epollfd, int fd, int ev){
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = ev | EPOLLONESHOT | EPOLLRDBAND;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+}
+
+// 从epoll中删除文件描述符
+static void removefd(int epollfd, int fd){
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
+    close(fd);
+}
+
+static inline uint64_t encode(int op, int fd, uint16_t gen) {
+    return (uint64_t)op << 56 | (uint64_t)gen << 32 | (uint32_t)fd;
+}
+
+reactor::reactor(int id, int port, bool reuse_port, const listen_config &config, const timeout_config &timeouts,
+                 int max_fd, threadpool<http_conn> *pool, IO_BACKEND backend, int cpu) :
+    m_id(id), m_cpu(cpu), m_listenfd(-1), m_epollfd(-1), m_stopfd(-1), m_timerfd(-1), m_timer_running(false),
+    m_timeouts(timeouts), m_timers(current_tick()), m_users(NULL),
+    m_max_fd(max_fd), m_accept_high(max_fd * ACCEPT_PAUSE_RATIO), m_accept_low(max_fd * ACCEPT_RESUME_RATIO),
+    m_accept_paused(false), m_pool(pool), m_thread(0), m_ring(NULL), m_slots(NULL), m_buf_next(NULL), m_buf_len(NULL),
+    m_recycled(false), m_handoffs(NULL), m_notified(false), m_notifyfd(-1) {
+
+    // 监听socket设置为非阻塞，配合边沿触发循环accept
+    m_listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(m_listenfd == -1){
+        perror("listenfd");
+        throw std::exception();
+    }
+
+    // 设置端口复用
+    int reuse = 1;
+    int ret = setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(ret == -1){
+        perror("setsocketopt");
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    // 多反应堆模式下每个反应堆绑定同一个端口，由内核做负载均衡
+    if(reuse_port){
+        ret = setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+        if(ret == -1){
+            perror("setsocketopt");
+            close(m_listenfd);
+            throw std::exception();
+        }
+    }
+
+    // 让内核优先把在本CPU上收到的连接交给这个监听socket
+    if(m_cpu >= 0){
+        ret = setsockopt(m_listenfd, SOL_SOCKET, SO_INCOMING_CPU, &m_cpu, sizeof(m_cpu));
+        if(ret == -1){
+            perror("setsocketopt");
+        }
+    }
+
+    // 客户端发来数据后才唤醒accept，省去一次只有握手的唤醒
+    if(config.defer_accept > 0){
+        ret = setsockopt(m_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.defer_accept, sizeof(config.defer_accept));
+        if(ret == -1){
+            perror("setsocketopt");
+        }
+    }
+
+    // 允许客户端在SYN中携带请求数据
+    if(config.fastopen > 0){
+        ret = setsockopt(m_listenfd, IPPROTO_TCP, TCP_FASTOPEN, &config.fastopen, sizeof(config.fastopen));
+        if(ret == -1){
+            perror("setsocketopt");
+        }
+    }
+
+    // 绑定
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    ret = bind(m_listenfd, (struct sockaddr*)&address, sizeof(address));
+    if(ret == -1){
+        perror("bind");
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    // 监听
+    ret = listen(m_listenfd, config.backlog);
+    if(ret == -1){
+        perror("listen");
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    // 退出通知
+    m_stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_stopfd == -1){
+        perror("eventfd");
+        close(m_listenfd);
+        throw std::exception();
+    }
+
+    // 驱动时间轮的定时器
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(m_timerfd == -1){
+        perror("timerfd");
+        close(m_listenfd);
+        close(m_stopfd);
+        throw std::exception();
+    }
+
+    // 创建本反应堆的客户端信息表，绑核时从该CPU所在的NUMA节点分配
+    m_users = (http_conn *)alloc_on_node(sizeof(http_conn) * m_max_fd, m_cpu >= 0 ? cpu_to_node(m_cpu) : -1);
+    if(!m_users){
+        perror("mmap");
+        close(m_listenfd);
+        close(m_stopfd);
+        close(m_timerfd);
+        throw std::exception();
+    }
+    // http_conn的构造函数不写任何成员，这里不会触碰物理页
+    // 表来自匿名映射，全部为0，其中的定时器节点都处于未挂入时间轮的状态
+    for(int i = 0; i < m_max_fd; ++i){
+        new (m_users + i) http_conn();
+    }
+
+    if(backend == URING_BACKEND){
+        try{
+            init_uring();
+            return;
+        }
+        catch(...){
+            LOG_WARN("反应堆%d无法使用io_uring，改用epoll", m_id);
+        }
+    }
+
+    // 创建epoll对象
+    m_epollfd = epoll_create(5);
+    if(m_epollfd == -1){
+        perror("epollfd");
+        close(m_listenfd);
+        close(m_stopfd);
+        close(m_timerfd);
+        free_on_node(m_users, sizeof(http_conn) * m_max_fd);
+        throw std::exception();
+    }
+
+    // 将监听的文件描述符以边沿触发添加到epoll对象中
+    epoll_event event;
+    event.data.fd = m_listenfd;
+    event.events = EPOLLIN | EPOLLET;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_listenfd, &event);
+    event.data.fd = m_stopfd;
+    event.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_stopfd, &event);
+    event.data.fd = m_timerfd;
+    event.events = EPOLLIN;
+    epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_timerfd, &event);
+}
+
+reactor::~reactor() {
+    release_uring();
+    close(m_listenfd);
+    close(m_stopfd);
+    close(m_timerfd);
+    if(m_epollfd != -1){
+        close(m_epollfd);
+    }
+    for(int i = 0; i < m_max_fd; ++i){
+        m_users[i].~http_conn();
+    }
+    free_on_node(m_users, sizeof(http_conn) * m_max_fd);
+}
+
+bool reactor::attach_cpu_steering(int group_size) {
+    // A = 当前CPU编号; A = A % group_size; 返回A作为组内socket的下标
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)group_size },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if(setsockopt(m_listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1){
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
+
+void reactor::start() {
+    if(pthread_create(&m_thread, NULL, worker, this) != 0){
+        throw std::exception();
+    }
+}
+
+void reactor::stop() {
+    uint64_t one = 1;
+    ::write(m_stopfd, &one, sizeof(one));
+}
+
+void reactor::join() {
+    if(m_thread){
+        pthread_join(m_thread, NULL);
+        m_thread = 0;
+    }
+}
+
+void* reactor::worker(void *arg) {
+    reactor *r = (reactor *) arg;
+    // 先绑核再进入事件循环，之后本线程访问的内存都在本地节点上
+    if(r->m_cpu >= 0){
+        pin_thread(pthread_self(), r->m_cpu);
+    }
+    r->loop();
+    return r;
+}
+
+void reactor::handle_accept() {
+    // 暂停期间到达的连接留在队列中，恢复时再一起取
+    if(m_accept_paused){
+        return;
+    }
+    // 边沿触发只通知一次，必须把全连接队列中的连接全部取完
+    while(true){
+        if(http_conn::m_user_count >= m_accept_high){
+            pause_accept();
+            break;
+        }
+        struct sockaddr_in client_address;
+        socklen_t sock_len = sizeof(client_address);
+        // 新连接直接设置为非阻塞，不需要再调用fcntl
+        int connfd = accept4(m_listenfd, (struct sockaddr*)&client_address, &sock_len,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                // 队列已经取完
+                break;
+            }
+            if(errno == EINTR || errno == ECONNABORTED){
+                // 客户端在accept之前就断开了，继续取下一个
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE){
+                // 文件描述符用完了，连接还在队列中，边沿触发不会再通知，等滴答时重试
+                LOG_WARN("accept: %m");
+                pause_accept();
+                break;
+            }
+            LOG_ERROR("accept: %m");
+            break;
+        }
+
+        if(http_conn::m_user_count >= m_max_fd || connfd >= m_max_fd){
+            // 目前的连接数满了
+            LOG_WARN("超负荷，服务器正忙...");
+            metrics::add(M_REJECTED);
+            http_conn::send_unavailable(connfd);
+            close(connfd);
+            continue;
+        }
+
+        // 将新客户的数据初始化，放到数组中，连接上的事件都注册到本反应堆的epoll上
+        m_users[connfd].init(connfd, client_address, this);
+        addfd(m_epollfd, connfd, true);
+        // 第一个请求的请求头也要在限定时间内收完
+        arm(m_users[connfd], m_timeouts.header);
+    }
+}
+
+void reactor::pause_accept() {
+    if(m_accept_paused){
+        return;
+    }
+    m_accept_paused = true;
+    LOG_WARN("反应堆%d的连接数%d接近上限%d，暂停接受新连接", m_id, http_conn::m_user_count.load(), m_max_fd);
+    if(m_ring){
+        // 取消多次accept，取消完成时不再重新提交
+        io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, OP_CANCEL, -1);
+        if(sqe){
+            sqe->addr = encode(OP_ACCEPT, -1, 0);
+        }
+    }
+    // 时间轮可能是空的，保证有滴答来检查是否恢复
+    start_ticking();
+}
+
+void reactor::resume_accept() {
+    if(!m_accept_paused || http_conn::m_user_count >= m_accept_low){
+        return;
+    }
+    m_accept_paused = false;
+    LOG_INFO("反应堆%d恢复接受新连接", m_id);
+    if(m_ring){
+        arm_accept();
+    } else {
+        handle_accept();
+    }
+}
+
+uint64_t reactor::current_tick() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TICK_MS;
+}
+
+void reactor::close_conn(http_conn &conn) {
+    m_timers.cancel(&conn.timer());
+    if(m_ring){
+        int fd = fd_of(conn);
+        if(m_slots[fd].flags & SLOT_SENDING){
+            // 发送请求还在读连接的段和中转块，shutdown让它尽快失败，完成之后再关闭
+            shutdown(fd, SHUT_RDWR);
+            m_slots[fd].flags |= SLOT_CLOSING;
+            return;
+        }
+    }
+    conn.close_conn();
+}
+
+void reactor::dispatch(http_conn &conn, int &ready) {
+    conn.begin_task();
+    if(m_ring){
+        m_slots[fd_of(conn)].flags |= SLOT_WORKING;
+    }
+    m_ready[ready++] = &conn;
+    if(ready == MAX_EVENT_NUMBER){
+        flush_ready(ready);
+    }
+}
+
+void reactor::flush_ready(int &ready) {
+    // 工作窃取模式下优先交给与本反应堆同编号的工作线程
+    int appended = m_pool->append_batch(m_ready, ready, m_id);
+    // 队列满了放不进去的连接不会再有事件，回应503后关闭
+    for(int i = appended; i < ready; ++i){
+        metrics::add(M_REJECTED);
+        http_conn::send_unavailable(fd_of(*m_ready[i]));
+        m_ready[i]->end_task(m_ready[i]->task_generation());
+        close_conn(*m_ready[i]);
+    }
+    ready = 0;
+}
+
+void reactor::resume(int sockfd, bool want_write) {
+    if(!m_ring){
+        modfd(m_epollfd, sockfd, want_write ? EPOLLOUT : EPOLLIN);
+        return;
+    }
+    post(sockfd, want_write ? WAIT_WRITE : WAIT_READ);
+}
+
+void reactor::detach(int sockfd) {
+    if(!m_ring){
+        removefd(m_epollfd, sockfd);
+        return;
+    }
+    // 多次接收的recv还持有socket，先shutdown让它结束，否则关闭文件描述符之后对方也收不到FIN
+    shutdown(sockfd, SHUT_RDWR);
+    if(t_current == this){
+        finish_close(sockfd);
+    } else {
+        post(sockfd, CLOSE);
+    }
+}
+
+void reactor::arm(http_conn &conn, int timeout_ms) {
+    if(timeout_ms <= 0){
+        m_timers.cancel(&conn.timer());
+        return;
+    }
+    // 向上取整，至少一个完整的滴答
+    m_timers.schedule(&conn.timer(), current_tick() + (timeout_ms + TICK_MS - 1) / TICK_MS + 1);
+    start_ticking();
+}
+
+void reactor::start_ticking() {
+    if(!m_timer_running){
+        struct itimerspec its;
+        its.it_value.tv_sec = its.it_interval.tv_sec = TICK_MS / 1000;
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = (TICK_MS % 1000) * 1000000;
+        timerfd_settime(m_timerfd, 0, &its, NULL);
+        m_timer_running = true;
+    }
+}
+
+void reactor::expire_timers() {
+    // io_uring后端的timerfd是阻塞的，到期次数已经由异步读取走了
+    uint64_t expirations;
+    while(!m_ring && ::read(m_timerfd, &expirations, sizeof(expirations)) > 0){
+    }
+    m_timers.advance(current_tick() + 1, [this](timer_node *node){
+        http_conn &conn = *(http_conn *)node->data;
+        if(conn.busy()){
+            // 请求还在工作线程手中，等它处理完再说
+            arm(conn, m_timeouts.header > 0 ? m_timeouts.header : TICK_MS);
+        } else if(!conn.closed()){
+            close_conn(conn);
+        }
+        // 已经被工作线程关闭的连接直接丢弃定时器
+    });
+    resume_accept();
+    // 没有定时器、也不需要检查是否恢复accept时停止计时，空闲的反应堆不会被周期性地唤醒
+    if(m_timers.size() == 0 && !m_accept_paused){
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(m_timerfd, 0, &its, NULL);
+        m_timer_running = false;
+    }
+}
+
+void reactor::loop() {
+    if(m_ring){
+        uring_loop();
+        return;
+    }
+    // 检测时间发生
+    bool stop_server = false;
+    while(!stop_server){
+
+        int num = epoll_wait(m_epollfd, m_events, MAX_EVENT_NUMBER, -1);
+        if((num < 0) && (errno != EINTR)){
+            LOG_ERROR("epoll failure: %m");
+            break;
+        }
+
+        // 循环遍历数组
+        int ready = 0;
+        bool expire_timers = false;
+        for(int i = 0;i < num;++i){
+            int sockfd = m_events[i].data.fd;
+            if(sockfd == m_listenfd){ // 有客户端连接进入
+                handle_accept();
+            } else if(sockfd == m_stopfd){ // 需要退出事件循环
+                stop_server = true;
+            } else if(sockfd == m_timerfd){ // 时间轮滴答
+                expire_timers = true;
+            } else if(m_events[i].events & (EPOLLRDHUP | EPOLLHUP |EPOLLERR)) {
+                // 对方异常
+                close_conn(m_users[sockfd]);
+
+            }
+            else if(m_events[i].events & EPOLLIN) { // 有读事件发生
+                http_conn &conn = m_users[sockfd];
+                // 新请求的第一批数据开始计算请求头超时，同一个请求之后的读不延长期限，
+                // 慢慢发送请求头的客户端不能一直占着连接
+                bool new_request = conn.waiting_request();
+                if(conn.read()){
+                    if(new_request){
+                        arm(conn, m_timeouts.header);
+                    }
+                    // 一次性把所有数据都读完
+                    // 先收集起来，本轮结束后一起交给线程池
+                    dispatch(conn, ready);
+                }
+                else {
+                    // 读失败
+                    close_conn(conn);
+                }
+            }
+            else if(m_events[i].events & EPOLLOUT) { // 写事件发生
+                // 写操作在反应堆线程中完成，write()已经按进度重新注册了EPOLLIN或EPOLLOUT，
+                // 不再交给线程池，否则工作线程会把未写完连接的EPOLLOUT改回EPOLLIN
+                http_conn &conn = m_users[sockfd];
+                if(!conn.write()){
+                    // 写失败或者短连接已经发送完毕
+                    close_conn(conn);
+                } else if(conn.sending()){
+                    // 发送缓冲区满了，每次有进展都重新计时
+                    arm(conn, m_timeouts.idle);
+                } else if(!conn.waiting_request()){
+                    // 读缓冲区中还有流水线上的请求，不会再有EPOLLIN通知，直接交给线程池
+                    arm(conn, m_timeouts.header);
+                    dispatch(conn, ready);
+                } else {
+                    // 长连接发送完毕，等待下一个请求
+                    arm(conn, m_timeouts.keepalive);
+                }
+            }
+        }
+
+        // 将本轮所有就绪的连接一次追加到线程池中
+        flush_ready(ready);
+
+        // 本轮有事件的连接已经重新计时或者交给了线程池，再处理超时
+        if(expire_timers){
+            this->expire_timers();
+        }
+    }
+}
+
+/*
+    io_uring后端
+    监听socket上挂一个多次accept，新连接放进与文件描述符同号的固定文件槽位，再挂一个多次recv，
+    数据到达时内核从接收缓冲区环中挑一个缓冲区。数据先停放在缓冲区里，连接空闲时拷贝到它的读缓冲区，
+    交给线程池；连接在工作线程手中或者正在发送时继续停放。
+    工作线程处理完后通过交还队列把连接还给反应堆，由反应堆提交发送：连续的内存段是一个sendmsg，
+    文件区间是读到中转块的read和链接在它后面的send。所有请求在下一次io_uring_enter时一起提交。
+    发送还没有完成时不能释放连接的段和中转块，所以要关闭正在发送的连接时只shutdown，等发送完成再关闭。
+    文件描述符关闭之后可能被新连接复用，每个槽位带一个代数，迟到的完成事件和交还消息按代数丢弃。
+*/
+void reactor::init_uring() {
+    try{
+        m_ring = new io_ring(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+    }
+    catch(...){
+        m_ring = NULL;
+        throw;
+    }
+    m_slots = (uring_slot *)alloc_on_node(sizeof(uring_slot) * m_max_fd, m_cpu >= 0 ? cpu_to_node(m_cpu) : -1);
+    m_notifyfd = eventfd(0, EFD_CLOEXEC);
+    if(!m_slots || m_notifyfd == -1 || !m_ring->register_files(m_max_fd)){
+        release_uring();
+        throw std::exception();
+    }
+    m_handoffs = new ring_queue<handoff>(HANDOFF_CAPACITY);
+    m_buf_next = new uint16_t[URING_BUFFERS];
+    m_buf_len = new uint16_t[URING_BUFFERS];
+    // eventfd和timerfd由io_uring异步地读，改成阻塞的，读请求会一直等到有数据
+    fcntl(m_stopfd, F_SETFL, fcntl(m_stopfd, F_GETFL) & ~O_NONBLOCK);
+    fcntl(m_timerfd, F_SETFL, fcntl(m_timerfd, F_GETFL) & ~O_NONBLOCK);
+}
+
+void reactor::release_uring() {
+    // 先关闭io_uring，内核取消所有请求之后才能释放它们用到的内存
+    delete m_ring;
+    m_ring = NULL;
+    if(m_slots){
+        free_on_node(m_slots, sizeof(uring_slot) * m_max_fd);
+        m_slots = NULL;
+    }
+    if(m_notifyfd != -1){
+        close(m_notifyfd);
+        m_notifyfd = -1;
+    }
+    delete m_handoffs;
+    m_handoffs = NULL;
+    delete[] m_buf_next;
+    m_buf_next = NULL;
+    delete[] m_buf_len;
+    m_buf_len = NULL;
+}
+
+io_uring_sqe *reactor::prepare(int opcode, int fd, URING_OP op, int conn_fd) {
+    io_uring_sqe *sqe = m_ring->get_sqe();
+    if(sqe){
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = encode(op, conn_fd, conn_fd >= 0 ? m_slots[conn_fd].gen : 0);
+    }
+    // 提交失败时放弃这个请求，连接最终会因为超时被关闭
+    return sqe;
+}
+
+void reactor::arm_read(int fd, uint64_t *buf, URING_OP op) {
+    io_uring_sqe *sqe = prepare(IORING_OP_READ, fd, op, -1);
+    if(sqe){
+        sqe->addr = (uint64_t)buf;
+        sqe->len = sizeof(*buf);
+    }
+}
+
+void reactor::arm_accept() {
+    io_uring_sqe *sqe = prepare(IORING_OP_ACCEPT, m_listenfd, OP_ACCEPT, -1);
+    if(sqe){
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+}
+
+void reactor::arm_recv(int fd) {
+    io_uring_sqe *sqe = prepare(IORING_OP_RECV, fd, OP_RECV, fd);
+    if(sqe){
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->buf_group = io_ring::BUFFER_GROUP;
+        m_slots[fd].flags |= SLOT_RECV;
+    }
+}
+
+void reactor::resume_recv(int fd, uring_slot &slot) {
+    if(!(slot.flags & (SLOT_RECV | SLOT_STARVED | SLOT_CLOSING)) && slot.parked < PARK_LIMIT){
+        arm_recv(fd);
+    }
+}
+
+void reactor::uring_accept(int connfd) {
+    if(http_conn::m_user_count >= m_max_fd || connfd >= m_max_fd){
+        // 目前的连接数满了
+        LOG_WARN("超负荷，服务器正忙...");
+        metrics::add(M_REJECTED);
+        http_conn::send_unavailable(connfd);
+        close(connfd);
+        return;
+    }
+    if(http_conn::m_user_count + 1 >= m_accept_high){
+        // 这个连接照常处理，之后暂停
+        pause_accept();
+    }
+    // 多次accept不带回对端地址，连接也不使用它
+    struct sockaddr_in client_address;
+    memset(&client_address, 0, sizeof(client_address));
+    http_conn &conn = m_users[connfd];
+    conn.init(connfd, client_address, this);
+    uring_slot &slot = m_slots[connfd];
+    slot.flags = 0;
+    slot.parked = 0;
+    slot.parked_offset = 0;
+    slot.fd = connfd;
+    // 先把socket放进同号的固定文件槽位，链接在后面的recv和之后的send都使用固定文件，不再查文件描述符表
+    io_uring_sqe *sqe = prepare(IORING_OP_FILES_UPDATE, -1, OP_UPDATE, connfd);
+    if(sqe){
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = (uint64_t)&slot.fd;
+        sqe->len = 1;
+        sqe->off = connfd;
+        arm_recv(connfd);
+    }
+    // 第一个请求的请求头也要在限定时间内收完
+    arm(conn, m_timeouts.header);
+}
+
+void reactor::park(int fd, uring_slot &slot, unsigned bid, int len) {
+    m_buf_len[bid] = len;
+    if(slot.parked == 0){
+        slot.parked_head = bid;
+    } else {
+        m_buf_next[slot.parked_tail] = bid;
+    }
+    slot.parked_tail = bid;
+    ++slot.parked;
+    if(slot.parked >= PARK_LIMIT && (slot.flags & SLOT_RECV) && !(slot.flags & SLOT_CANCELING)){
+        // 连接迟迟不取走数据（比如请求体在工作线程中慢慢处理），暂停接收，让TCP窗口限制对方，
+        // 不让一个连接占满接收缓冲区
+        io_uring_sqe *sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, OP_CANCEL, fd);
+        if(sqe){
+            sqe->addr = encode(OP_RECV, fd, slot.gen);
+            slot.flags |= SLOT_CANCELING;
+        }
+    }
+}
+
+bool reactor::feed_parked(http_conn &conn, uring_slot &slot) {
+    bool fed = false;
+    while(slot.parked > 0){
+        unsigned bid = slot.parked_head;
+        int len = m_buf_len[bid] - slot.parked_offset;
+        int n = conn.feed(m_ring->buffer(bid) + slot.parked_offset, len);
+        if(n > 0){
+            fed = true;
+        }
+        if(n < len){
+            // 读缓冲区满了，剩下的等连接处理完再交
+            slot.parked_offset += n;
+            break;
+        }
+        slot.parked_offset = 0;
+        slot.parked_head = m_buf_next[bid];
+        --slot.parked;
+        m_ring->recycle(bid);
+        m_recycled = true;
+    }
+    return fed;
+}
+
+void reactor::deliver(http_conn &conn, int &ready) {
+    int fd = fd_of(conn);
+    uring_slot &slot = m_slots[fd];
+    // 和epoll后端一样，新请求的第一批数据开始计算请求头超时
+    bool new_request = conn.waiting_request();
+    bool fed = feed_parked(conn, slot);
+    resume_recv(fd, slot);
+    if(fed){
+        if(new_request){
+            arm(conn, m_timeouts.header);
+        }
+        dispatch(conn, ready);
+    }
+}
+
+void reactor::on_recv(int fd, uint16_t gen, io_uring_cqe *cqe, int &ready) {
+    uring_slot &slot = m_slots[fd];
+    http_conn &conn = m_users[fd];
+    int res = cqe->res;
+    bool current = gen == slot.gen && !conn.closed();
+    if(cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(current && res > 0){
+            park(fd, slot, bid, res);
+        } else {
+            m_ring->recycle(bid);
+            m_recycled = true;
+        }
+    }
+    if(!current){
+        // 已经关闭的连接迟到的事件
+        return;
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)){
+        slot.flags &= ~(SLOT_RECV | SLOT_CANCELING);
+    }
+    if(res == -ENOBUFS){
+        // 接收缓冲区用完了，内核结束了这个recv，有缓冲区还回来之后再重新接收
+        if(!(slot.flags & SLOT_STARVED)){
+            slot.flags |= SLOT_STARVED;
+            m_starved.push_back(fd);
+        }
+    } else if(res == 0 || (res < 0 && res != -ECANCELED)){
+        // 对方关闭连接或者出错，在工作线程手中的连接等它交还时再关闭
+        if(slot.flags & SLOT_WORKING){
+            slot.flags |= SLOT_PEER_CLOSED;
+        } else {
+            close_conn(conn);
+        }
+        return;
+    } else {
+        resume_recv(fd, slot);
+    }
+    if(slot.parked > 0 && !(slot.flags & (SLOT_WORKING | SLOT_SENDING | SLOT_CLOSING))){
+        deliver(conn, ready);
+    }
+}
+
+void reactor::start_send(http_conn &conn, int &ready) {
+    int fd = fd_of(conn);
+    uring_slot &slot = m_slots[fd];
+    static_assert(sizeof(struct msghdr) + http_conn::MAX_IOV * sizeof(struct iovec) <= buffer_pool::SLAB_SIZE,
+                  "msghdr and iovecs must fit in a slab");
+    if(!slot.send_buf){
+        slot.send_buf = buffer_pool::get_slab();
+    }
+    struct msghdr *msg = (struct msghdr *)slot.send_buf;
+    struct iovec *iov = (struct iovec *)(slot.send_buf + sizeof(struct msghdr));
+    int file_fd;
+    off_t offset;
+    size_t length;
+    bool more;
+    int count = conn.next_send(iov, http_conn::MAX_IOV, buffer_pool::BLOCK_SIZE, file_fd, offset, length, more);
+    if(count < 0){
+        send_done(conn, ready);
+        return;
+    }
+    // MSG_WAITALL让内核在发送缓冲区满时自己等待，直到全部发出才完成
+    int flags = MSG_WAITALL | MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    io_uring_sqe *sqe;
+    if(count > 0){
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_iov = iov;
+        msg->msg_iovlen = count;
+        sqe = prepare(IORING_OP_SENDMSG, fd, OP_SEND, fd);
+        if(!sqe){
+            return;
+        }
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+    } else {
+        // io_uring没有sendfile，文件区间先读到中转块，读满之后链接的send才会执行，
+        // 读不满（文件被截断）时send被取消，连接随之关闭
+        if(!slot.file_buf){
+            slot.file_buf = buffer_pool::get();
+        }
+        sqe = prepare(IORING_OP_READ, file_fd, OP_READ, fd);
+        if(!sqe){
+            return;
+        }
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = (uint64_t)slot.file_buf;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe = prepare(IORING_OP_SEND, fd, OP_SEND, fd);
+        if(!sqe){
+            return;
+        }
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)slot.file_buf;
+        sqe->len = length;
+        sqe->msg_flags = flags;
+    }
+    slot.flags |= SLOT_SENDING;
+    arm(conn, m_timeouts.idle);
+}
+
+void reactor::on_send(int fd, uint16_t gen, int res, int &ready) {
+    uring_slot &slot = m_slots[fd];
+    http_conn &conn = m_users[fd];
+    if(gen != slot.gen){
+        return;
+    }
+    slot.flags &= ~SLOT_SENDING;
+    if((slot.flags & SLOT_CLOSING) || res <= 0){
+        close_conn(conn);
+        return;
+    }
+    conn.sent(res);
+    if(conn.sending()){
+        start_send(conn, ready);
+    } else {
+        send_done(conn, ready);
+    }
+}
+
+void reactor::send_done(http_conn &conn, int &ready) {
+    int fd = fd_of(conn);
+    uring_slot &slot = m_slots[fd];
+    release_staging(slot);
+    if(!conn.finish_send()){
+        // 短连接已经发送完毕
+        close_conn(conn);
+        return;
+    }
+    // 读缓冲区中还有流水线上的请求时直接交给线程池，停放的数据也一起交给它
+    bool pipelined = !conn.waiting_request();
+    bool fed = feed_parked(conn, slot);
+    resume_recv(fd, slot);
+    if(pipelined || fed){
+        arm(conn, m_timeouts.header);
+        dispatch(conn, ready);
+    } else {
+        // 长连接发送完毕，等待下一个请求
+        arm(conn, m_timeouts.keepalive);
+    }
+}
+
+void reactor::release_staging(uring_slot &slot) {
+    if(slot.send_buf){
+        buffer_pool::put_slab(slot.send_buf);
+        slot.send_buf = NULL;
+    }
+    if(slot.file_buf){
+        buffer_pool::put(slot.file_buf);
+        slot.file_buf = NULL;
+    }
+}
+
+void reactor::post(int sockfd, int step) {
+    // 连接还在本线程手中，反应堆不会修改它的代数
+    handoff h = { sockfd, step, m_slots[sockfd].gen };
+    while(!m_handoffs->push(h)){
+        // 队列满了，等反应堆取走一些
+        sched_yield();
+    }
+    // 反应堆取队列之前会清掉标志，标志已经被别的线程设置时不必再唤醒
+    if(!m_notified.exchange(true)){
+        uint64_t one = 1;
+        ::write(m_notifyfd, &one, sizeof(one));
+    }
+}
+
+void reactor::drain_handoffs(int &ready) {
+    // 先清标志再取，之后交还的连接一定会再次唤醒反应堆
+    m_notified.store(false);
+    handoff h;
+    while(m_handoffs->pop(h)){
+        uring_slot &slot = m_slots[h.sockfd];
+        if(h.gen != slot.gen){
+            // 交还之前连接已经被超时关闭
+            continue;
+        }
+        if(h.step == CLOSE){
+            finish_close(h.sockfd);
+            continue;
+        }
+        http_conn &conn = m_users[h.sockfd];
+        slot.flags &= ~SLOT_WORKING;
+        if(conn.closed()){
+            continue;
+        }
+        if(slot.flags & SLOT_PEER_CLOSED){
+            close_conn(conn);
+        } else if(h.step == WAIT_WRITE){
+            start_send(conn, ready);
+        } else {
+            deliver(conn, ready);
+        }
+    }
+}
+
+void reactor::finish_close(int fd) {
+    uring_slot &slot = m_slots[fd];
+    // 停放的数据已经没用了，缓冲区还给内核
+    while(slot.parked > 0){
+        unsigned bid = slot.parked_head;
+        slot.parked_head = m_buf_next[bid];
+        --slot.parked;
+        m_ring->recycle(bid);
+        m_recycled = true;
+    }
+    release_staging(slot);
+    slot.flags = 0;
+    slot.parked_offset = 0;
+    ++slot.gen;
+    // 清空固定文件槽位，socket的最后一个引用随之释放
+    static const int no_file = -1;
+    io_uring_sqe *sqe = prepare(IORING_OP_FILES_UPDATE, -1, OP_UPDATE, -1);
+    if(sqe){
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->addr = (uint64_t)&no_file;
+        sqe->len = 1;
+        sqe->off = fd;
+    }
+    close(fd);
+}
+
+void reactor::uring_loop() {
+    if(!m_ring->enable()){
+        return;
+    }
+    t_current = this;
+    arm_accept();
+    arm_read(m_stopfd, &m_stop_buf, OP_STOP);
+    arm_read(m_timerfd, &m_timer_buf, OP_TIMER);
+    arm_read(m_notifyfd, &m_notify_buf, OP_NOTIFY);
+    bool stop_server = false;
+    while(!stop_server){
+        // 提交上一轮产生的所有请求，等待至少一个完成
+        int ret = m_ring->submit_and_wait(1);
+        if(ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY){
+            LOG_ERROR("io_uring failure: %s", strerror(-ret));
+            break;
+        }
+
+        int ready = 0;
+        bool expire_timers = false;
+        m_ring->for_each_cqe([&](io_uring_cqe *cqe){
+            int op = cqe->user_data >> 56;
+            uint16_t gen = cqe->user_data >> 32;
+            int fd = (int)(uint32_t)cqe->user_data;
+            switch(op){
+                case OP_ACCEPT:
+                    if(cqe->res >= 0){
+                        uring_accept(cqe->res);
+                    } else if(cqe->res == -EMFILE || cqe->res == -ENFILE){
+                        // 立即重新提交只会马上再失败，暂停到滴答时再试
+                        LOG_WARN("accept: %s", strerror(-cqe->res));
+                        pause_accept();
+                    }
+                    // 多次accept出错或者完成队列溢出时会结束，没有暂停就重新提交，被取消的不再提交
+                    if(!(cqe->flags & IORING_CQE_F_MORE) && !m_accept_paused && cqe->res != -ECANCELED){
+                        arm_accept();
+                    }
+                    break;
+                case OP_RECV:
+                    on_recv(fd, gen, cqe, ready);
+                    break;
+                case OP_SEND:
+                    on_send(fd, gen, cqe->res, ready);
+                    break;
+                case OP_STOP:
+                    stop_server = true;
+                    break;
+                case OP_TIMER:
+                    expire_timers = true;
+                    arm_read(m_timerfd, &m_timer_buf, OP_TIMER);
+                    break;
+                case OP_NOTIFY:
+                    arm_read(m_notifyfd, &m_notify_buf, OP_NOTIFY);
+                    break;
+                default:
+                    // 读文件、更新固定文件和取消请求只有失败时才有完成事件，失败由链接在后面的请求处理
+                    break;
+            }
+        });
+
+        // 不管有没有被唤醒都取一次交还队列，交还的连接在这一轮就能提交发送
+        drain_handoffs(ready);
+
+        // 有接收缓冲区还回来了，让因为缓冲区用完而停止接收的连接重新接收
+        if(m_recycled && !m_starved.empty()){
+            std::vector<int> starved;
+            starved.swap(m_starved);
+            for(size_t i = 0; i < starved.size(); ++i){
+                uring_slot &slot = m_slots[starved[i]];
+                if(slot.flags & SLOT_STARVED){
+                    slot.flags &= ~SLOT_STARVED;
+                    resume_recv(starved[i], slot);
+                }
+            }
+        }
+        m_recycled = false;
+
+        flush_ready(ready);
+
+        if(expire_timers){
+            this->expire_timers();
+        }
+    }
+    t_current = NULL;
+}
@@ -0,0 +1,195 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <exception>
+#include <atomic>
+#include <vector>
+
+#include "threadpool.h"
+#include "http_conn.h"
+#include "timer_wheel.h"
+
+class io_ring;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// 监听socket的参数
+struct listen_config {
+    int backlog;        // listen的全连接队列长度
+    int defer_accept;   // TCP_DEFER_ACCEPT的秒数，0表示不开启，开启后收到数据才唤醒accept
+    int fastopen;       // TCP_FASTOPEN的队列长度，0表示不开启
+
+    listen_config() : backlog(SOMAXCONN), defer_accept(0), fastopen(0) {}
+};
+
+// 连接的超时时间（毫秒），0表示不限制
+struct timeout_config {
+    int header;     // 从连接建立或者收到请求的第一个字节起，必须在这段时间内收到完整的请求头，之后的读不会延长它
+    int idle;       // 发送应答时连续这么久没有任何进展就关闭连接
+    int keepalive;  // 应答发送完之后等待下一个请求的时间
+
+    timeout_config() : header(10000), idle(60000), keepalive(15000) {}
+};
+
+/*
+    事件后端
+    EPOLL_BACKEND: epoll + EPOLLONESHOT，连接自己用readv读、sendmsg/sendfile写
+    URING_BACKEND: io_uring，多次接收的accept和recv、内核挑选的接收缓冲区、固定文件，
+                   发送也作为异步请求提交，反应堆一次io_uring_enter提交所有请求并等待完成
+*/
+enum IO_BACKEND { EPOLL_BACKEND = 0, URING_BACKEND };
+
+/*
+    反应堆，负责一个事件循环
+    多反应堆模式下每个反应堆在自己的线程中运行，拥有独立的epoll实例和
+    独立的SO_REUSEPORT监听socket，由内核在各个监听socket之间分发新连接。
+    每个反应堆有自己的http_conn表，按文件描述符索引，只保留虚拟地址、按需分页，
+    文件描述符在进程内唯一，因此各个表实际用到的槽位互不重叠。
+    反应堆绑定到某个CPU时，表的物理页优先从该CPU所在的NUMA节点分配。
+    事件后端在创建时选择，io_uring不可用时退回epoll。
+*/
+class reactor {
+public:
+    static const int MAX_EVENT_NUMBER = 10000; // 监听的最大事件的个数
+
+    // id为反应堆编号，cpu不小于0时事件循环线程绑定到该CPU上
+    reactor(int id, int port, bool reuse_port, const listen_config &config, const timeout_config &timeouts,
+            int max_fd, threadpool<http_conn> *pool, IO_BACKEND backend = EPOLL_BACKEND, int cpu = -1);
+    ~reactor();
+
+    IO_BACKEND backend() { return m_ring ? URING_BACKEND : EPOLL_BACKEND; }
+
+    // 连接处理完之后交还给反应堆：want_write为true时发送已经生成的应答，否则等待请求的数据。
+    // 可以在任意线程调用
+    void resume(int sockfd, bool want_write);
+    // 关闭连接的socket，可以在任意线程调用
+    void detach(int sockfd);
+
+    // 在SO_REUSEPORT组上挂载CBPF程序，把CPU c上收到的新连接交给第 c % group_size 个反应堆，
+    // 配合绑核，连接由收到它的数据包的CPU处理
+    bool attach_cpu_steering(int group_size);
+
+    void loop();    // 在当前线程中运行事件循环
+    void start();   // 创建新线程运行事件循环
+    void stop();    // 通知事件循环退出，可以在任意线程调用
+    void join();    // 等待事件循环线程退出
+
+private:
+    // 必须设置静态成员函数，避免普通成员函数导致多传入一个参数this
+    static void* worker(void *arg);
+
+    static const int TICK_MS = 100; // 时间轮一个滴答的毫秒数
+    // 连接数达到上限的ACCEPT_PAUSE_RATIO时暂停accept，降到ACCEPT_RESUME_RATIO以下时恢复，
+    // 其余的文件描述符留给文件、元数据缓存和内部使用
+    static constexpr double ACCEPT_PAUSE_RATIO = 0.875;
+    static constexpr double ACCEPT_RESUME_RATIO = 0.75;
+    static const int URING_ENTRIES = 4096;     // io_uring提交队列的大小
+    static const int URING_BUFFERS = 4096;     // 每个反应堆的接收缓冲区个数
+    static const int URING_BUFFER_SIZE = 4096; // 接收缓冲区的大小
+
+    // io_uring后端中工作线程交还连接的消息
+    enum HANDOFF_STEP { WAIT_READ = 0, WAIT_WRITE, CLOSE };
+    static const int HANDOFF_CAPACITY = 16384; // 交还队列的容量
+    static const int PARK_LIMIT = 16; // 一个连接最多停放的接收缓冲区个数，超过时暂停接收
+    struct handoff {
+        int sockfd;
+        int step;
+        uint16_t gen; // 连接交给工作线程时的代数
+    };
+    // io_uring请求的种类，和文件描述符、代数一起编码在user_data中
+    enum URING_OP { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_READ, OP_UPDATE, OP_CANCEL, OP_STOP, OP_TIMER, OP_NOTIFY };
+    /*
+        连接在io_uring后端中的状态，按文件描述符索引
+        SLOT_RECV: 多次接收的recv还在内核中        SLOT_SENDING: 有发送请求还没有完成
+        SLOT_CLOSING: 发送完成后关闭               SLOT_PEER_CLOSED: 工作线程交还后关闭
+        SLOT_STARVED: 接收缓冲区用完，等待重新接收   SLOT_WORKING: 已经交给线程池，还没有交还
+        SLOT_CANCELING: 停放的缓冲区太多，正在取消recv
+    */
+    enum SLOT_FLAG { SLOT_RECV = 1, SLOT_SENDING = 2, SLOT_CLOSING = 4, SLOT_PEER_CLOSED = 8, SLOT_STARVED = 16,
+                     SLOT_WORKING = 32, SLOT_CANCELING = 64 };
+    struct uring_slot {
+        uint16_t gen;          // 文件描述符每次关闭时加一，上一个连接迟到的完成事件据此丢弃
+        uint16_t flags;
+        uint16_t parked;       // 停放在这里、还没有交给连接的接收缓冲区个数
+        uint16_t parked_head;  // 停放的缓冲区按到达顺序排成链表
+        uint16_t parked_tail;
+        uint16_t parked_offset; // 第一个停放的缓冲区已经交给连接的字节数
+        int fd;                // 更新固定文件槽位时内核从这里读取文件描述符
+        char *send_buf;        // 正在发送时借来的小块，存放msghdr和iovec
+        char *file_buf;        // 发送文件区间时的中转块
+    };
+
+    void handle_accept(); // 处理新连接，一次取完全连接队列中的所有连接
+    // 连接数接近文件描述符上限或者accept返回EMFILE时暂停接受新连接，新连接留在内核的全连接队列中，
+    // 时间轮每个滴答检查一次，连接数降下来后恢复
+    void pause_accept();
+    void resume_accept();
+    void start_ticking(); // 启动timerfd，每个滴答推进一次时间轮
+    void close_conn(http_conn &conn); // 反应堆线程中关闭连接，同时取消它的定时器
+    void arm(http_conn &conn, int timeout_ms); // 重新设置连接的超时，0表示取消
+    void expire_timers(); // timerfd到期时推进时间轮，关闭超时的连接
+    static uint64_t current_tick();
+    void dispatch(http_conn &conn, int &ready); // 收集要交给线程池的连接，攒满一批时先交出去
+    void flush_ready(int &ready); // 把收集的连接一次追加到线程池中
+
+    // io_uring后端
+    void uring_loop();
+    void init_uring(); // 创建io_uring、固定文件表和交还队列，失败时抛出异常
+    void release_uring();
+    // 取一个提交队列项，user_data编码请求种类、连接的文件描述符和代数
+    io_uring_sqe *prepare(int opcode, int fd, URING_OP op, int conn_fd);
+    void arm_read(int fd, uint64_t *buf, URING_OP op); // 异步读eventfd或者timerfd
+    void arm_accept();
+    void arm_recv(int fd);
+    void resume_recv(int fd, uring_slot &slot); // 没有在接收、停放的缓冲区也不多时重新开始接收
+    void uring_accept(int connfd);
+    void on_recv(int fd, uint16_t gen, io_uring_cqe *cqe, int &ready);
+    void on_send(int fd, uint16_t gen, int res, int &ready);
+    void park(int fd, uring_slot &slot, unsigned bid, int len);
+    bool feed_parked(http_conn &conn, uring_slot &slot); // 停放的数据交给连接，返回是否交出了数据
+    void deliver(http_conn &conn, int &ready); // 连接空闲时把停放的数据交给它，有数据就交给线程池
+    void start_send(http_conn &conn, int &ready);
+    void send_done(http_conn &conn, int &ready);
+    void drain_handoffs(int &ready);
+    void post(int sockfd, int step);
+    void finish_close(int fd); // 连接关闭之后回收它在io_uring后端中的资源，关闭文件描述符
+    void release_staging(uring_slot &slot);
+    int fd_of(http_conn &conn) { return &conn - m_users; }
+
+    int m_id;        // 反应堆编号，也是向线程池派发任务时优先选择的工作线程
+    int m_cpu;       // 绑定的CPU，-1表示不绑定
+    int m_listenfd;  // 监听的文件描述符
+    int m_epollfd;   // 该反应堆的epoll对象
+    int m_stopfd;    // 用于通知事件循环退出的eventfd
+    int m_timerfd;   // 周期性地驱动时间轮，时间轮为空时停止
+    bool m_timer_running; // m_timerfd是否在计时
+    timeout_config m_timeouts;
+    timer_wheel m_timers; // 本反应堆所有连接的超时定时器
+    http_conn *m_users; // 本反应堆的客户端信息，按文件描述符索引
+    int m_max_fd;    // 最大的文件描述符个数
+    int m_accept_high; // 连接数达到它时暂停accept
+    int m_accept_low;  // 暂停之后连接数降到它以下才恢复
+    bool m_accept_paused;
+    threadpool<http_conn> *m_pool; // 工作线程池，所有反应堆共享
+    pthread_t m_thread; // 事件循环线程
+    epoll_event m_events[MAX_EVENT_NUMBER + 1]; // 事件数组
+    http_conn *m_ready[MAX_EVENT_NUMBER]; // 一轮事件中需要交给线程池的连接
+
+    io_ring *m_ring;      // io_uring后端的环，为NULL时使用epoll
+    uring_slot *m_slots;  // 按文件描述符索引，和m_users一样只保留虚拟地址
+    uint16_t *m_buf_next; // 停放的接收缓冲区链表
+    uint16_t *m_buf_len;  // 停放的接收缓冲区中数据的长度
+    std::vector<int> m_starved; // 接收缓冲区用完而停止接收的连接，有缓冲区还回来后重新开始接收
+    bool m_recycled;      // 这一轮是否有接收缓冲区还给了内核
+    ring_queue<handoff> *m_handoffs; // 工作线程交还的连接
+    std::atomic<bool> m_notified; // 已经写过m_notifyfd、反应堆还没有取走交还队列
+    int m_notifyfd;       // 交还队列非空时唤醒反应堆的eventfd
+    uint64_t m_stop_buf;  // 异步读eventfd和timerfd的缓冲区
+    uint64_t m_timer_buf;
+    uint64_t m_notify_buf;
+    static thread_local reactor *t_current; // 当前线程运行的反应堆
+};
+
+#endif
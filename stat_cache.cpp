@@ -0,0 +1,180 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "stat_cache.h"
+#include "file_cache.h"
+
+stat_cache::stat_cache(int max_entries) : m_shards(NULL), m_shard_entries(max_entries / SHARD_NUMBER), m_epoch(0) {
+    m_shards = new shard[SHARD_NUMBER];
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        memset(s.buckets, 0, sizeof(s.buckets));
+        s.head = s.tail = NULL;
+        s.entries = 0;
+        s.hits = s.misses = s.invalidations = 0;
+    }
+}
+
+stat_cache::~stat_cache() {
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        while(s.head) {
+            unlink(s, s.head);
+        }
+    }
+    delete[] m_shards;
+}
+
+file_meta *stat_cache::find(shard &s, uint32_t hash, const char *path) {
+    file_meta *meta = s.buckets[(hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    while(meta) {
+        if(meta->hash == hash && meta->path == path) {
+            return meta;
+        }
+        meta = meta->hnext;
+    }
+    return NULL;
+}
+
+// 从哈希表和LRU链表中摘除，并释放缓存本身持有的引用
+void stat_cache::unlink(shard &s, file_meta *meta) {
+    file_meta **p = &s.buckets[(meta->hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    while(*p != meta) {
+        p = &(*p)->hnext;
+    }
+    *p = meta->hnext;
+
+    if(meta->prev) {
+        meta->prev->next = meta->next;
+    } else {
+        s.head = meta->next;
+    }
+    if(meta->next) {
+        meta->next->prev = meta->prev;
+    } else {
+        s.tail = meta->prev;
+    }
+    --s.entries;
+    release(meta);
+}
+
+file_meta *stat_cache::get(const char *path) {
+    uint32_t hash = file_cache::hash_path(path);
+    shard &s = shard_of(hash);
+    s.lock.lock();
+    file_meta *meta = find(s, hash, path);
+    if(!meta) {
+        ++s.misses;
+        s.lock.unlock();
+        return NULL;
+    }
+    // 移到LRU链表头部
+    if(s.head != meta) {
+        meta->prev->next = meta->next;
+        if(meta->next) {
+            meta->next->prev = meta->prev;
+        } else {
+            s.tail = meta->prev;
+        }
+        meta->prev = NULL;
+        meta->next = s.head;
+        s.head->prev = meta;
+        s.head = meta;
+    }
+    meta->refs.fetch_add(1, std::memory_order_relaxed);
+    ++s.hits;
+    s.lock.unlock();
+    return meta;
+}
+
+file_meta *stat_cache::insert(const char *path, int fd, const struct stat &st, unsigned long epoch) {
+    uint32_t hash = file_cache::hash_path(path);
+    shard &s = shard_of(hash);
+
+    file_meta *meta = new file_meta;
+    meta->st = st;
+    make_validators(st, meta->validators);
+    meta->fd = fd;
+    meta->refs.store(1, std::memory_order_relaxed);
+    meta->hash = hash;
+    meta->path = path;
+    meta->prev = NULL;
+
+    s.lock.lock();
+    if(m_shard_entries <= 0 || m_epoch.load(std::memory_order_acquire) != epoch) {
+        // 不缓存，或者stat之后有文件被修改，元数据可能已经过时，只给这一次请求使用
+        s.lock.unlock();
+        return meta;
+    }
+    file_meta *existing = find(s, hash, path);
+    if(existing) {
+        // 其他线程已经先插入了同一个路径
+        existing->refs.fetch_add(1, std::memory_order_relaxed);
+        s.lock.unlock();
+        release(meta);
+        return existing;
+    }
+    while(s.tail && s.entries >= m_shard_entries) {
+        unlink(s, s.tail);
+    }
+    file_meta **bucket = &s.buckets[(hash / SHARD_NUMBER) % BUCKET_NUMBER];
+    meta->hnext = *bucket;
+    *bucket = meta;
+    meta->next = s.head;
+    if(s.head) {
+        s.head->prev = meta;
+    } else {
+        s.tail = meta;
+    }
+    s.head = meta;
+    ++s.entries;
+    meta->refs.fetch_add(1, std::memory_order_relaxed); // 缓存和调用者各一个
+    s.lock.unlock();
+    return meta;
+}
+
+void stat_cache::release(file_meta *meta) {
+    if(meta->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        close(meta->fd);
+        delete meta;
+    }
+}
+
+void stat_cache::invalidate(const char *path) {
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    uint32_t hash = file_cache::hash_path(path);
+    shard &s = shard_of(hash);
+    s.lock.lock();
+    file_meta *meta = find(s, hash, path);
+    if(meta) {
+        unlink(s, meta);
+        ++s.invalidations;
+    }
+    s.lock.unlock();
+}
+
+void stat_cache::clear() {
+    m_epoch.fetch_add(1, std::memory_order_acq_rel);
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        while(s.head) {
+            unlink(s, s.head);
+            ++s.invalidations;
+        }
+        s.lock.unlock();
+    }
+}
+
+void stat_cache::stats(stat_cache_stats &out) {
+    memset(&out, 0, sizeof(out));
+    for(int i = 0; i < SHARD_NUMBER; ++i) {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        out.hits += s.hits;
+        out.misses += s.misses;
+        out.invalidations += s.invalidations;
+        out.entries += s.entries;
+        s.lock.unlock();
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef STAT_CACHE_H
+#define STAT_CACHE_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include "locker.h"
+#include "validators.h"
+
+// 一个存在且允许访问的普通文件的元数据和打开的文件描述符
+// 文件描述符被所有连接共享，sendfile时使用各自的偏移，不会互相影响
+struct file_meta {
+    struct stat st;        // 文件状态，包括类型、权限、大小、修改时间
+    file_validators validators; // 由st生成的ETag和Last-Modified
+    int fd;                // 以只读方式打开的文件描述符，最后一个引用释放时关闭
+    std::atomic<int> refs; // 引用计数，缓存本身持有一个，每个正在使用它的连接持有一个
+
+    uint32_t hash;
+    std::string path;
+    file_meta *hnext;      // 哈希桶中的下一个
+    file_meta *prev;       // LRU链表，靠近头部的是最近访问的
+    file_meta *next;
+};
+
+// 元数据缓存的统计信息
+struct stat_cache_stats {
+    long long hits;
+    long long misses;
+    long long invalidations;
+    long long entries;
+};
+
+/*
+    路径元数据缓存，请求路径命中时不需要stat和open
+    和file_cache一样按路径哈希分片，每个分片最多缓存max_entries / SHARD_NUMBER个文件，超出时按LRU淘汰，
+    每个缓存的文件占用一个文件描述符。只缓存存在的文件，不存在的路径交给上层处理。
+    不设过期时间，文件被修改、删除或者改名后由fs_watcher根据inotify事件调用invalidate。
+*/
+class stat_cache {
+public:
+    explicit stat_cache(int max_entries);
+    ~stat_cache();
+
+    // 查找路径，命中时返回的元数据已经增加了引用计数，用完后调用release
+    file_meta *get(const char *path);
+
+    // 未命中时由调用者stat并打开文件、检查过权限后调用，fd的所有权交给返回的元数据。
+    // epoch为查找之前读取的epoch()，期间有文件被修改时不放入缓存，只返回这一次使用的元数据
+    file_meta *insert(const char *path, int fd, const struct stat &st, unsigned long epoch);
+
+    // 释放get或insert返回的元数据
+    static void release(file_meta *meta);
+
+    // 删除某个路径的缓存
+    void invalidate(const char *path);
+    // 删除所有缓存，目录被删除、改名或者inotify事件队列溢出时使用
+    void clear();
+    unsigned long epoch() { return m_epoch.load(std::memory_order_acquire); }
+
+    void stats(stat_cache_stats &out);
+
+private:
+    static const int SHARD_NUMBER = 16;
+    static const int BUCKET_NUMBER = 1024; // 每个分片的哈希桶个数
+
+    struct shard {
+        locker lock;
+        file_meta *buckets[BUCKET_NUMBER];
+        file_meta *head;
+        file_meta *tail;
+        int entries;
+        long long hits, misses, invalidations;
+    };
+
+    shard &shard_of(uint32_t hash) { return m_shards[hash % SHARD_NUMBER]; }
+
+    // 以下函数都需要持有分片的锁
+    file_meta *find(shard &s, uint32_t hash, const char *path);
+    void unlink(shard &s, file_meta *meta);
+
+    shard *m_shards;
+    int m_shard_entries;
+    std::atomic<unsigned long> m_epoch;
+};
+
+#endif
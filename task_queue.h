@@ -0,0 +1,178 @@
+#ifndef TASK_QUEUE_H
+#define TASK_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <atomic>
+#include <exception>
+#include "locker.h"
+
+/*
+    线程池的请求队列策略
+    每个队列策略都需要提供以下接口：
+        explicit Queue(int capacity)          构造容量至少为capacity的队列
+        bool push(const E &item)              入队，队列满时返回false
+        int  push_batch(const E *items, int n) 批量入队，返回实际入队的个数
+        bool pop(E &item)                     出队，队列空时返回false
+        bool empty()                          队列是否为空（并发下只是近似值）
+*/
+
+// 有界无锁多生产者多消费者环形队列（Dmitry Vyukov的算法）
+// 每个槽位带一个序号，生产者和消费者只通过CAS抢占位置，不需要加锁，也不需要为每个任务分配内存
+template<typename E>
+class ring_queue {
+public:
+    explicit ring_queue(int capacity) : m_buffer(NULL), m_mask(0), m_enqueue_pos(0), m_dequeue_pos(0) {
+        if(capacity <= 0) {
+            throw std::exception();
+        }
+        // 容量向上取整为2的幂，用位与代替取模
+        size_t size = 2;
+        while(size < (size_t)capacity) {
+            size <<= 1;
+        }
+        m_buffer = new cell[size];
+        m_mask = size - 1;
+        for(size_t i = 0; i < size; ++i) {
+            m_buffer[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~ring_queue() {
+        delete[] m_buffer;
+    }
+
+    bool push(const E &item) {
+        return push_batch(&item, 1) == 1;
+    }
+
+    // 一次CAS预留连续的多个槽位
+    int push_batch(const E *items, int n) {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        int count;
+        while(true) {
+            // 统计从pos开始连续空闲的槽位数
+            count = 0;
+            while(count < n) {
+                cell *c = &m_buffer[(pos + count) & m_mask];
+                size_t seq = c->seq.load(std::memory_order_acquire);
+                if(seq != pos + count) {
+                    break;
+                }
+                ++count;
+            }
+            if(count == 0) {
+                size_t seq = m_buffer[pos & m_mask].seq.load(std::memory_order_acquire);
+                if((intptr_t)seq - (intptr_t)pos < 0) {
+                    // 队列已满
+                    return 0;
+                }
+                // 被其他生产者抢先，重新读取位置
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+                continue;
+            }
+            if(m_enqueue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        // 已经独占[pos, pos + count)，写入数据后发布序号
+        for(int i = 0; i < count; ++i) {
+            cell *c = &m_buffer[(pos + i) & m_mask];
+            c->data = items[i];
+            c->seq.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+    }
+
+    bool pop(E &item) {
+        cell *c;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        while(true) {
+            c = &m_buffer[pos & m_mask];
+            size_t seq = c->seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(dif == 0) {
+                if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if(dif < 0) {
+                // 队列为空
+                return false;
+            } else {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        item = c->data;
+        // 槽位留给下一圈的生产者
+        c->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() {
+        return m_dequeue_pos.load(std::memory_order_acquire) >= m_enqueue_pos.load(std::memory_order_acquire);
+    }
+
+private:
+    struct cell {
+        std::atomic<size_t> seq;
+        E data;
+    };
+
+    cell *m_buffer;
+    size_t m_mask;
+    // 生产者和消费者的位置放在不同的缓存行，避免伪共享
+    alignas(64) std::atomic<size_t> m_enqueue_pos;
+    alignas(64) std::atomic<size_t> m_dequeue_pos;
+};
+
+// 互斥锁保护的链表队列，即最初的实现，每个任务一次内存分配和一次加锁
+template<typename E>
+class list_queue {
+public:
+    explicit list_queue(int capacity) : m_capacity(capacity) {
+        if(capacity <= 0) {
+            throw std::exception();
+        }
+    }
+
+    bool push(const E &item) {
+        return push_batch(&item, 1) == 1;
+    }
+
+    int push_batch(const E *items, int n) {
+        m_locker.lock();
+        int count = 0;
+        while(count < n && (int)m_list.size() < m_capacity) {
+            m_list.push_back(items[count++]);
+        }
+        m_locker.unlock();
+        return count;
+    }
+
+    bool pop(E &item) {
+        m_locker.lock();
+        if(m_list.empty()) {
+            m_locker.unlock();
+            return false;
+        }
+        item = m_list.front();
+        m_list.pop_front();
+        m_locker.unlock();
+        return true;
+    }
+
+    bool empty() {
+        m_locker.lock();
+        bool ret = m_list.empty();
+        m_locker.unlock();
+        return ret;
+    }
+
+private:
+    int m_capacity;
+    std::list<E> m_list;
+    locker m_locker;
+};
+
+#endif
@@ -2,127 +2,595 @@
 #define THREADPOOL_H
 
 #include <pthread.h>
-#include <list>
+#include <stdio.h>
+#include <time.h>
+#include <limits.h>
 #include <exception>
+#include <atomic>
 #include "locker.h"
-// 线程池类，定义为模板类为了代码复用，T为任务类
+#include "task_queue.h"
+#include "work_stealing.h"
+#include "affinity.h"
+#include "log.h"
+#include "metrics.h"
+
+// 线程池的调度模式
+// SHARED_QUEUE  : 所有工作线程共用一个请求队列
+// WORK_STEALING : 每个工作线程有自己的收件队列和Chase-Lev双端队列，
+//                 反应堆把任务交给选中的工作线程，空闲的工作线程随机挑选其他线程窃取任务
+enum SCHED_MODE { SHARED_QUEUE = 0, WORK_STEALING };
+
+// 队列中的任务，记录入队时间用于统计排队等待的时间
 template<typename T>
+struct pool_task {
+    T* request;
+    long long enqueue_ns;
+};
+
+// 线程池类，定义为模板类为了代码复用，T为任务类
+// Queue为请求队列策略，默认是有界无锁环形队列，list_queue为最初的链表加互斥锁实现
+// Waiter为等待策略，默认先自旋再睡眠在futex上，sem_waiter为最初的信号量实现
+// 线程数在[thread_number, max_thread_number]之间根据排队等待时间和线程利用率动态调整，
+// max_thread_number不大于thread_number时线程数固定
+template<typename T, template<typename> class Queue = ring_queue, typename Waiter = spin_futex_waiter>
 class threadpool{
 public:
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    threadpool(int thread_number = 8, int max_requests = 10000, SCHED_MODE mode = SHARED_QUEUE,
+               int max_thread_number = 0, int target_wait_us = 1000);
     ~threadpool();
 
     // 添加任务
     bool append(T* request);
+
+    // 批量添加任务，一次epoll_wait得到的所有就绪连接一次交给线程池，返回实际添加的个数
+    // 工作窃取模式下hint不小于0时优先交给第 hint % 线程数 个工作线程，否则轮询
+    int append_batch(T** requests, int n, int hint = -1);
+
+    // 把第i个工作线程绑定到 cpus[i % n] 上，之后新创建的工作线程也会绑定
+    void set_affinity(const int *cpus, int n);
+
+    // 停止所有线程并等待它们退出，正在执行的任务会执行完，可以重复调用
+    void stop();
+
+    // 当前的目标工作线程数
+    int thread_count() const { return m_target_threads.load(); }
+
+    /*
+        过载控制，按排队时间（而不是队列长度）决定是否处理任务，CoDel的思路：
+        每CODEL_INTERVAL_MS看一次这段时间内出队任务的最小排队时间，超过target_us说明队列一直没有清空过，
+        是积压而不是突发，下一个周期进入过载状态；过载时排队超过2 * target_us的任务不再执行，
+        交给shed快速拒绝，队列很快缩短，被接受的任务的延迟保持在目标附近。
+        target_us为0时关闭，这也是默认值
+    */
+    void set_shedding(int target_us, void (*shed)(T *request));
+    bool overloaded() const { return m_overloaded.load(std::memory_order_relaxed); }
+
 private:
+    typedef pool_task<T> task;
+
+    // 工作线程的参数
+    struct worker_arg {
+        threadpool *pool;
+        int id;
+    };
+
+    // 工作线程槽位的状态
+    enum SLOT_STATE { SLOT_FREE = 0, SLOT_RUNNING, SLOT_EXITED };
+
+    // 单个线程最多一次从收件队列搬到本地双端队列的任务数，也是批量入队时的分段大小
+    static const int DRAIN_BATCH = 32;
+
+    // 管理线程调整线程数的周期
+    static const int ADJUST_INTERVAL_MS = 100;
+
+    // 过载控制观察最小排队时间的周期
+    static const int CODEL_INTERVAL_MS = 100;
+
+    // 连续多少个周期负载都很低才减少一个线程
+    static const int SHRINK_ROUNDS = 10;
+
     // 必须设置静态成员函数，避免普通成员函数导致多传入一个参数this
     static void* worker(void *);
+    static void* manager(void *);
+
+    static long long now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
 
     // 线程创建后就执行run
-    void run();
+    void run(int id);
+
+    // 执行任务并记录排队时间和执行时间
+    void execute(const task &t);
+
+    // 根据出队任务的排队时间更新过载状态，返回是否拒绝这个任务
+    bool should_shed(long long now, long long wait);
+
+    // 工作窃取模式下为工作线程id寻找一个任务：本地双端队列、本地收件队列、随机窃取其他线程
+    bool find_task(int id, unsigned int &seed, task &t);
+
+    // 是否有等待处理的任务
+    bool has_work();
+
+    // 在槽位id上创建工作线程
+    bool spawn(int id);
+
+    // 管理线程的循环
+    void manage();
 
-    // 线程数量
-    int m_thread_number;
-    
-    // 线程池数组 
+    // 根据上一个周期的统计调整线程数
+    void adjust();
+
+    // 回收已退出的线程，并为目标线程数以内的空槽位创建线程
+    void reconcile();
+
+    // 最少和最多的线程数量
+    int m_min_threads;
+    int m_max_threads;
+
+    // 当前目标线程数，编号不小于它的工作线程空闲时自行退出
+    std::atomic<int> m_target_threads;
+
+    // 线程池数组，按最多线程数分配
     pthread_t * m_threads;
+    worker_arg * m_args;
+    std::atomic<int> * m_slot_state;
 
     // 请求队列中最多允许的，等待处理的请求数量
     int m_max_requests;
 
     // 请求队列
-    std::list<T*> m_workqueue;
+    Queue<task> m_workqueue;
 
-    // 互斥锁
-    locker m_queuelocker;
-
-    // 信号量来判断是否有任务需要处理
-    sem m_queuestat;
+    // 等待策略，判断是否有任务需要处理
+    Waiter m_queuestat;
 
     // 是否结束线程
-    bool m_stop;
+    std::atomic<bool> m_stop;
+
+    // stop是否已经执行过
+    std::atomic<bool> m_stopped;
+
+    // 调度模式
+    SCHED_MODE m_mode;
+
+    // 工作窃取模式下每个工作线程的收件队列，反应堆只往这里放任务
+    Queue<task> **m_inboxes;
 
+    // 工作窃取模式下每个工作线程的本地双端队列
+    ws_deque<task> **m_deques;
+
+    // 工作窃取模式下所有队列中尚未被取走的任务数，用于判断是否需要睡眠
+    std::atomic<int> m_pending;
+
+    // 下一个接收任务的工作线程
+    std::atomic<unsigned int> m_next_worker;
+
+    // 工作线程绑定的CPU列表
+    int m_cpus[MAX_CPU_LIST];
+    int m_cpu_number;
+
+    // 管理线程，只有线程数可以调整时才创建
+    pthread_t m_manager;
+    bool m_has_manager;
+    locker m_manager_locker;
+    cond m_manager_cond;
+
+    // 目标排队等待时间
+    long long m_target_wait_ns;
+
+    // 当前周期内的统计：排队时间总和、出队任务数、工作线程忙碌时间总和
+    std::atomic<long long> m_wait_ns_sum;
+    std::atomic<long long> m_wait_count;
+    std::atomic<long long> m_busy_ns;
+    long long m_last_adjust_ns;
+    int m_idle_rounds;
+
+    // 过载控制：拒绝任务的函数（NULL表示不拒绝）、目标排队时间、当前周期的结束时间和最小排队时间
+    void (*m_shed)(T *request);
+    long long m_shed_target_ns;
+    std::atomic<long long> m_codel_interval_end;
+    std::atomic<long long> m_codel_min_wait;
+    std::atomic<bool> m_overloaded;
 };
 
-template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) :
-    m_thread_number(thread_number), m_max_requests(max_requests),
-    m_stop(false), m_threads(NULL){
-    
-    if((m_thread_number <= 0) || (max_requests) <= 0){
+template<typename T, template<typename> class Queue, typename Waiter>
+threadpool<T, Queue, Waiter>::threadpool(int thread_number, int max_requests, SCHED_MODE mode,
+                                         int max_thread_number, int target_wait_us) :
+    m_min_threads(thread_number),
+    m_max_threads(max_thread_number > thread_number ? max_thread_number : thread_number),
+    m_target_threads(thread_number), m_threads(NULL), m_args(NULL), m_slot_state(NULL),
+    m_max_requests(max_requests), m_workqueue(max_requests), m_stop(false), m_stopped(false),
+    m_mode(mode), m_inboxes(NULL), m_deques(NULL), m_pending(0), m_next_worker(0),
+    m_cpu_number(0), m_manager(0), m_has_manager(false), m_target_wait_ns(target_wait_us * 1000LL),
+    m_wait_ns_sum(0), m_wait_count(0), m_busy_ns(0), m_last_adjust_ns(now_ns()), m_idle_rounds(0),
+    m_shed(NULL), m_shed_target_ns(0), m_codel_interval_end(0), m_codel_min_wait(LLONG_MAX), m_overloaded(false){
+
+    if((thread_number <= 0) || (max_requests) <= 0){
         throw std::exception();
     }
 
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads){
-        throw std::exception();
+    if(m_mode == WORK_STEALING) {
+        // 请求总数的上限平均分给每个工作线程
+        int per_worker = (max_requests + thread_number - 1) / thread_number;
+        m_inboxes = new Queue<task>*[m_max_threads];
+        m_deques = new ws_deque<task>*[m_max_threads];
+        for(int i = 0; i < m_max_threads; ++i) {
+            m_inboxes[i] = new Queue<task>(per_worker);
+            // 本地队列至少能容纳一次搬运的任务
+            m_deques[i] = new ws_deque<task>(per_worker > DRAIN_BATCH ? per_worker : DRAIN_BATCH);
+        }
+    }
+
+    m_threads = new pthread_t[m_max_threads];
+    m_args = new worker_arg[m_max_threads];
+    m_slot_state = new std::atomic<int>[m_max_threads];
+    for(int i = 0; i < m_max_threads; ++i) {
+        m_slot_state[i] = SLOT_FREE;
     }
 
-    // 创建thread_number个线程，并将它们设置为线程脱离
+    // 创建thread_number个线程，线程不再脱离，stop时等待它们退出
     for(int i = 0;i < thread_number; ++i){
-        printf("create the %dth thread\n", i);
-        // this 指针将类实例传递进worker
-        if(pthread_create(m_threads + i, NULL, worker, this) != 0){
-            delete [] m_threads;
+        LOG_INFO("create the %dth thread", i);
+        if(!spawn(i)){
+            stop();
             throw std::exception();
         }
-        if(pthread_detach(m_threads[i])) {
-            delete[] m_threads;
+    }
+
+    // 线程数可以调整时创建管理线程
+    if(m_max_threads > m_min_threads) {
+        if(pthread_create(&m_manager, NULL, manager, this) != 0){
+            stop();
             throw std::exception();
         }
+        m_has_manager = true;
     }
 }
 
-template<typename T>
-threadpool<T>::~threadpool() {
+template<typename T, template<typename> class Queue, typename Waiter>
+threadpool<T, Queue, Waiter>::~threadpool() {
+    stop();
+    if(m_mode == WORK_STEALING) {
+        for(int i = 0; i < m_max_threads; ++i) {
+            delete m_inboxes[i];
+            delete m_deques[i];
+        }
+        delete[] m_inboxes;
+        delete[] m_deques;
+    }
     delete[] m_threads;
+    delete[] m_args;
+    delete[] m_slot_state;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::stop() {
+    if(m_stopped.exchange(true)) {
+        return;
+    }
     m_stop = true;
+
+    // 先停止管理线程，之后不会再有新的工作线程被创建
+    if(m_has_manager) {
+        m_manager_locker.lock();
+        m_manager_cond.signal();
+        m_manager_locker.unlock();
+        pthread_join(m_manager, NULL);
+        m_has_manager = false;
+    }
+
+    m_queuestat.notify_all();
+    for(int i = 0; i < m_max_threads; ++i) {
+        if(m_slot_state[i] != SLOT_FREE) {
+            pthread_join(m_threads[i], NULL);
+            m_slot_state[i] = SLOT_FREE;
+        }
+    }
 }
 
-template<typename T>
-bool threadpool<T>::append(T *request){
-    // 上锁
-    m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_requests) {
-        m_queuelocker.unlock();
+template<typename T, template<typename> class Queue, typename Waiter>
+bool threadpool<T, Queue, Waiter>::spawn(int id) {
+    m_args[id].pool = this;
+    m_args[id].id = id;
+    m_slot_state[id] = SLOT_RUNNING;
+    // args 将类实例和线程编号传递进worker
+    if(pthread_create(m_threads + id, NULL, worker, m_args + id) != 0){
+        m_slot_state[id] = SLOT_FREE;
         return false;
     }
-
-    m_workqueue.push_back(request);
-    m_queuelocker.unlock();
-    m_queuestat.post();
+    if(m_cpu_number > 0) {
+        pin_thread(m_threads[id], m_cpus[id % m_cpu_number]);
+    }
     return true;
 }
 
-template<typename T>
-void* threadpool<T>::worker(void *arg){
-    threadpool *pool = (threadpool *) arg;
-    pool->run();
-    return pool;
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::set_affinity(const int *cpus, int n) {
+    if(n <= 0) {
+        return;
+    }
+    m_cpu_number = n < MAX_CPU_LIST ? n : MAX_CPU_LIST;
+    for(int i = 0; i < m_cpu_number; ++i) {
+        m_cpus[i] = cpus[i];
+    }
+    // 已经在运行的工作线程
+    for(int i = 0; i < m_max_threads; ++i) {
+        if(m_slot_state[i] == SLOT_RUNNING) {
+            pin_thread(m_threads[i], m_cpus[i % m_cpu_number]);
+        }
+    }
 }
 
-template<typename T>
-void threadpool<T>::run() {
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::set_shedding(int target_us, void (*shed)(T *request)) {
+    m_shed_target_ns = target_us * 1000LL;
+    m_shed = target_us > 0 ? shed : NULL;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+bool threadpool<T, Queue, Waiter>::append(T *request){
+    return append_batch(&request, 1) == 1;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+int threadpool<T, Queue, Waiter>::append_batch(T **requests, int n, int hint){
+    if(n <= 0) {
+        return 0;
+    }
+
+    // 整批任务使用同一个入队时间
+    long long now = now_ns();
+    task tasks[DRAIN_BATCH];
+    int count = 0;
+    unsigned int start = 0;
+    int threads = m_target_threads.load();
+    if(m_mode == WORK_STEALING) {
+        // 整批交给指定的或者轮询选中的工作线程
+        m_pending.fetch_add(n);
+        start = hint >= 0 ? (unsigned int)hint : m_next_worker.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    while(count < n) {
+        int len = n - count < DRAIN_BATCH ? n - count : DRAIN_BATCH;
+        for(int i = 0; i < len; ++i) {
+            tasks[i].request = requests[count + i];
+            tasks[i].enqueue_ns = now;
+        }
+        int pushed = 0;
+        if(m_mode == WORK_STEALING) {
+            // 选中的工作线程的收件队列满了就依次尝试下一个
+            for(int i = 0; i < threads && pushed < len; ++i) {
+                pushed += m_inboxes[(start + i) % threads]->push_batch(tasks + pushed, len - pushed);
+            }
+        } else {
+            // 队列满时多余的任务不入队
+            pushed = m_workqueue.push_batch(tasks, len);
+        }
+        count += pushed;
+        if(pushed < len) {
+            break;
+        }
+    }
+
+    if(m_mode == WORK_STEALING && count < n) {
+        m_pending.fetch_sub(n - count);
+    }
+    if(count > 0) {
+        metrics::add(M_ENQUEUED, count);
+        m_queuestat.notify(count);
+    }
+    return count;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void* threadpool<T, Queue, Waiter>::worker(void *arg){
+    worker_arg *warg = (worker_arg *) arg;
+    warg->pool->run(warg->id);
+    return warg->pool;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+bool threadpool<T, Queue, Waiter>::has_work() {
+    if(m_mode == WORK_STEALING) {
+        return m_pending.load() > 0;
+    }
+    return !m_workqueue.empty();
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::run(int id) {
+    // 每个工作线程自己的随机数种子，用于挑选窃取对象
+    unsigned int seed = id * 2654435761u + 1;
     while(!m_stop) {
-        // 阻塞，直到信号量被释放，可以开始工作
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty()){ // 判断当前是否有任务
-            // 无任务
-            m_queuelocker.unlock();
-            continue;
+        // 线程数被调小，编号超出范围的线程在自己的队列清空后退出
+        if(id >= m_target_threads.load()) {
+            if(m_mode != WORK_STEALING || (m_deques[id]->empty() && m_inboxes[id]->empty())) {
+                // 退出前转交可能被本线程消耗掉的唤醒
+                m_queuestat.notify(1);
+                break;
+            }
         }
-        // 有任务，拿走任务列表头
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
 
-        if(!request) { // 是否获取到任务
+        task t;
+        if(m_mode == WORK_STEALING) {
+            if(!find_task(id, seed, t)) {
+                // 所有队列都没有任务，睡眠等待
+                m_queuestat.wait([this, id] { return m_stop || has_work() || id >= m_target_threads.load(); });
+                continue;
+            }
+            m_pending.fetch_sub(1);
+        } else {
+            // 阻塞，直到有任务需要处理
+            m_queuestat.wait([this, id] { return m_stop || has_work() || id >= m_target_threads.load(); });
+
+            // 有任务，拿走队列头
+            if(!m_workqueue.pop(t)) { // 判断当前是否有任务
+                // 无任务
+                continue;
+            }
+        }
+
+        if(!t.request) { // 是否获取到任务
             continue;
         }
 
         // 任务运行
-        request->process();
+        execute(t);
+    }
+    m_slot_state[id] = SLOT_EXITED;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::execute(const task &t) {
+    long long begin = now_ns();
+    metrics::add(M_DEQUEUED);
+    metrics::record(H_QUEUE_WAIT, begin - t.enqueue_ns);
+    if(m_shed && should_shed(begin, begin - t.enqueue_ns)) {
+        metrics::add(M_SHED);
+        m_shed(t.request);
+    } else {
+        t.request->process();
+    }
+    long long end = now_ns();
+    m_wait_ns_sum.fetch_add(begin - t.enqueue_ns, std::memory_order_relaxed);
+    m_wait_count.fetch_add(1, std::memory_order_relaxed);
+    m_busy_ns.fetch_add(end - begin, std::memory_order_relaxed);
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+bool threadpool<T, Queue, Waiter>::should_shed(long long now, long long wait) {
+    // 周期结束时由一个线程结算：这个周期内有任务出队并且最小排队时间超过目标才算过载
+    long long end = m_codel_interval_end.load(std::memory_order_relaxed);
+    if(now >= end && m_codel_interval_end.compare_exchange_strong(end, now + CODEL_INTERVAL_MS * 1000000LL,
+                                                                 std::memory_order_relaxed)) {
+        long long min_wait = m_codel_min_wait.exchange(LLONG_MAX, std::memory_order_relaxed);
+        bool overloaded = min_wait != LLONG_MAX && min_wait > m_shed_target_ns;
+        if(overloaded != m_overloaded.load(std::memory_order_relaxed)) {
+            m_overloaded.store(overloaded, std::memory_order_relaxed);
+            if(overloaded) {
+                LOG_WARN("排队时间持续超过%lldus，开始拒绝排队过久的请求", m_shed_target_ns / 1000);
+            } else {
+                LOG_INFO("排队时间恢复正常，停止拒绝请求");
+            }
+        }
+    }
+    // 只在变小时写，大多数任务只读一次这个缓存行
+    long long min_wait = m_codel_min_wait.load(std::memory_order_relaxed);
+    while(wait < min_wait && !m_codel_min_wait.compare_exchange_weak(min_wait, wait, std::memory_order_relaxed)) {
+    }
+    return m_overloaded.load(std::memory_order_relaxed) && wait > 2 * m_shed_target_ns;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+bool threadpool<T, Queue, Waiter>::find_task(int id, unsigned int &seed, task &t) {
+    // 优先处理本地双端队列
+    if(m_deques[id]->pop(t)) {
+        return true;
+    }
+
+    // 把收件队列中的任务搬到本地双端队列，第一个直接处理，其余的可以被其他线程窃取
+    // 走到这里时本地队列是空的，容量不小于DRAIN_BATCH，因此push不会失败
+    if(m_inboxes[id]->pop(t)) {
+        task next;
+        for(int i = 1; i < DRAIN_BATCH && m_inboxes[id]->pop(next); ++i) {
+            m_deques[id]->push(next);
+        }
+        return true;
+    }
+
+    // 从随机的一个线程开始依次尝试窃取，已退出线程的队列中残留的任务也在这里被取走
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    int start = seed % m_max_threads;
+    for(int i = 0; i < m_max_threads; ++i) {
+        int victim = (start + i) % m_max_threads;
+        if(victim == id) {
+            continue;
+        }
+        if(m_deques[victim]->steal(t) || m_inboxes[victim]->pop(t)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void* threadpool<T, Queue, Waiter>::manager(void *arg){
+    threadpool *pool = (threadpool *) arg;
+    pool->manage();
+    return pool;
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::manage() {
+    m_manager_locker.lock();
+    while(!m_stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ADJUST_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        m_manager_cond.timedwait(m_manager_locker.get(), deadline);
+        if(m_stop) {
+            break;
+        }
+        adjust();
+    }
+    m_manager_locker.unlock();
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::adjust() {
+    long long now = now_ns();
+    long long interval = now - m_last_adjust_ns;
+    m_last_adjust_ns = now;
+    long long waits = m_wait_ns_sum.exchange(0);
+    long long count = m_wait_count.exchange(0);
+    long long busy = m_busy_ns.exchange(0);
+    int threads = m_target_threads.load();
+    if(interval <= 0) {
+        return;
+    }
+
+    // 平均排队时间和线程利用率
+    long long avg_wait = count > 0 ? waits / count : 0;
+    double utilization = (double)busy / ((double)interval * threads);
+
+    if(avg_wait > m_target_wait_ns && utilization > 0.5 && threads < m_max_threads) {
+        // 任务排队太久且线程都在忙，按当前线程数的四分之一扩容
+        int grow = threads / 4 > 0 ? threads / 4 : 1;
+        threads = threads + grow < m_max_threads ? threads + grow : m_max_threads;
+        m_target_threads = threads;
+        m_idle_rounds = 0;
+    } else if(avg_wait < m_target_wait_ns / 2 && utilization < 0.5 && threads > m_min_threads) {
+        // 持续空闲才缩容，每次减少一个线程，避免抖动
+        if(++m_idle_rounds >= SHRINK_ROUNDS) {
+            m_target_threads = threads - 1;
+            m_idle_rounds = 0;
+            // 唤醒睡眠的线程，编号超出范围的线程会自行退出
+            m_queuestat.notify_all();
+        }
+    } else {
+        m_idle_rounds = 0;
+    }
+    reconcile();
+}
+
+template<typename T, template<typename> class Queue, typename Waiter>
+void threadpool<T, Queue, Waiter>::reconcile() {
+    int threads = m_target_threads.load();
+    for(int i = 0; i < m_max_threads; ++i) {
+        if(m_slot_state[i] == SLOT_EXITED) {
+            pthread_join(m_threads[i], NULL);
+            m_slot_state[i] = SLOT_FREE;
+        }
+        if(i < threads && m_slot_state[i] == SLOT_FREE) {
+            spawn(i);
+        }
     }
 }
-#endif
\ No newline at end of file
+#endif
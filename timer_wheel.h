@@ -0,0 +1,114 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 侵入式定时器节点，嵌在被定时的对象里，不需要为每个定时器分配内存
+// next为NULL表示不在时间轮中。节点所在的内存全部清零时就是未挂入的状态
+struct timer_node {
+    timer_node *prev;
+    timer_node *next;
+    uint64_t expire;   // 到期的滴答数
+    void *data;        // 所属的对象
+};
+
+/*
+    分层时间轮
+    共LEVEL_NUMBER层，每层SLOT_NUMBER个槽，第i层的一个槽代表 SLOT_NUMBER^i 个滴答。
+    添加、重新设置和取消都只是在双向链表中摘除或插入一个节点，是O(1)的，和定时器个数无关。
+    每走过SLOT_NUMBER个滴答，把上一层对应槽中的定时器按剩余时间重新分配到下层（级联），
+    每个定时器最多被级联LEVEL_NUMBER - 1次。
+    不是线程安全的，只能在拥有它的反应堆线程中使用。
+*/
+class timer_wheel {
+public:
+    static const int SLOT_BITS = 6;
+    static const int SLOT_NUMBER = 1 << SLOT_BITS;
+    static const int LEVEL_NUMBER = 4; // 最多 2^24 个滴答，100毫秒一个滴答时约19天
+
+    explicit timer_wheel(uint64_t now = 0) : m_now(now), m_count(0) {
+        for(int i = 0; i < LEVEL_NUMBER; ++i) {
+            for(int j = 0; j < SLOT_NUMBER; ++j) {
+                m_slots[i][j].prev = m_slots[i][j].next = &m_slots[i][j];
+            }
+        }
+    }
+
+    uint64_t now() const { return m_now; }
+    int size() const { return m_count; }
+
+    // 在第expire个滴答到期，已经在时间轮中的节点先摘除，再按新的时间插入
+    void schedule(timer_node *node, uint64_t expire) {
+        cancel(node);
+        node->expire = expire;
+        link(node);
+        ++m_count;
+    }
+
+    void cancel(timer_node *node) {
+        if(node->next) {
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+            node->prev = node->next = NULL;
+            --m_count;
+        }
+    }
+
+    // 把时间推进到第now个滴答，对每个到期的节点调用on_expire(node)
+    // 回调之前节点已经摘除，回调中可以重新schedule
+    template<typename F>
+    void advance(uint64_t now, F on_expire) {
+        while(m_now < now) {
+            int index = m_now & (SLOT_NUMBER - 1);
+            // 第0层转完一圈时，从上层取出下一段时间的定时器重新分配
+            for(int level = 1; level < LEVEL_NUMBER && index == 0; ++level) {
+                index = (m_now >> (level * SLOT_BITS)) & (SLOT_NUMBER - 1);
+                cascade(level, index);
+            }
+            timer_node *slot = &m_slots[0][m_now & (SLOT_NUMBER - 1)];
+            ++m_now;
+            while(slot->next != slot) {
+                timer_node *node = slot->next;
+                cancel(node);
+                on_expire(node);
+            }
+        }
+    }
+
+private:
+    void link(timer_node *node) {
+        uint64_t expire = node->expire < m_now ? m_now : node->expire;
+        uint64_t delta = expire - m_now;
+        int level = 0;
+        while(level < LEVEL_NUMBER - 1 && delta >= ((uint64_t)1 << ((level + 1) * SLOT_BITS))) {
+            ++level;
+        }
+        if(level == LEVEL_NUMBER - 1 && delta >= ((uint64_t)1 << (LEVEL_NUMBER * SLOT_BITS))) {
+            // 超出时间轮的范围，放在最远的槽里，级联时再重新计算
+            expire = m_now + ((uint64_t)1 << (LEVEL_NUMBER * SLOT_BITS)) - 1;
+        }
+        timer_node *slot = &m_slots[level][(expire >> (level * SLOT_BITS)) & (SLOT_NUMBER - 1)];
+        node->next = slot;
+        node->prev = slot->prev;
+        slot->prev->next = node;
+        slot->prev = node;
+    }
+
+    void cascade(int level, int index) {
+        timer_node *slot = &m_slots[level][index];
+        timer_node *node = slot->next;
+        slot->prev = slot->next = slot;
+        while(node != slot) {
+            timer_node *next = node->next;
+            link(node);
+            node = next;
+        }
+    }
+
+    timer_node m_slots[LEVEL_NUMBER][SLOT_NUMBER]; // 每个槽是带哨兵的循环双向链表
+    uint64_t m_now;   // 下一个要处理的滴答
+    int m_count;      // 时间轮中的定时器个数
+};
+
+#endif
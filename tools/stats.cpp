@@ -0,0 +1,169 @@
+/*
+    运行指标的命令行工具
+    只读地映射服务器导出的共享内存（/dev/shm/tiny_webserver.端口），汇总所有线程的计数器和直方图后输出，
+    服务器不参与读取，读多频繁都不影响它。
+    不带-i时输出从启动到现在的累计值；-i 秒数 每隔这么久输出一次这段时间内的速率和延迟分位数。
+    编译：g++ -O2 -I. tools/stats.cpp metrics.cpp log.cpp -pthread -o stats.out
+    运行：./stats.out [-i 秒数] port
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metrics.h"
+
+static const char *const histogram_names[M_HISTOGRAM_NUMBER] = { "queue wait", "parse", "write" };
+
+// 纳秒转成便于阅读的单位
+static const char *format_ns(double ns, char *buf, size_t size) {
+    if(ns < 1e3) {
+        snprintf(buf, size, "%.0fns", ns);
+    } else if(ns < 1e6) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if(ns < 1e9) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+// after - before，before为NULL时就是after本身
+static void diff(const metrics::snapshot &after, const metrics::snapshot *before, metrics::snapshot &out) {
+    out = after;
+    if(!before) {
+        return;
+    }
+    for(int c = 0; c < M_COUNTER_NUMBER; ++c) {
+        out.counters[c] -= before->counters[c];
+    }
+    for(int s = 0; s < metrics::STATUS_NUMBER; ++s) {
+        out.requests[s] -= before->requests[s];
+    }
+    for(int k = 0; k < M_HISTOGRAM_NUMBER; ++k) {
+        out.count[k] -= before->count[k];
+        out.sum[k] -= before->sum[k];
+        for(int j = 0; j < metrics::BUCKETS; ++j) {
+            out.buckets[k][j] -= before->buckets[k][j];
+        }
+    }
+}
+
+static long long gauge(uint64_t up, uint64_t down) {
+    return up > down ? (long long)(up - down) : 0;
+}
+
+// 输出一段时间内的指标，seconds为这段时间的长度
+static void print(const metrics::snapshot &total, const metrics::snapshot &delta, double seconds) {
+    unsigned long long requests = 0;
+    for(int s = 0; s < metrics::STATUS_NUMBER; ++s) {
+        requests += delta.requests[s];
+    }
+    printf("threads %d, connections active %lld, queue depth %lld\n", total.threads,
+        gauge(total.counters[M_ACCEPTED], total.counters[M_CLOSED]),
+        gauge(total.counters[M_ENQUEUED], total.counters[M_DEQUEUED]));
+    printf("requests %llu (%.0f/s), bytes %llu (%.1f MB/s), accepted %llu (%.0f/s), rejected %llu, closed %llu, shed %llu\n",
+        requests, requests / seconds,
+        (unsigned long long)delta.counters[M_BYTES_SENT], delta.counters[M_BYTES_SENT] / seconds / 1e6,
+        (unsigned long long)delta.counters[M_ACCEPTED], delta.counters[M_ACCEPTED] / seconds,
+        (unsigned long long)delta.counters[M_REJECTED], (unsigned long long)delta.counters[M_CLOSED],
+        (unsigned long long)delta.counters[M_SHED]);
+    printf("status");
+    for(int s = 0; s < metrics::STATUS_NUMBER; ++s) {
+        if(delta.requests[s] == 0) {
+            continue;
+        }
+        if(s < metrics::STATUS_NUMBER - 1) {
+            printf(" %d:%llu", metrics::status_codes[s], (unsigned long long)delta.requests[s]);
+        } else {
+            printf(" other:%llu", (unsigned long long)delta.requests[s]);
+        }
+    }
+    printf("\n");
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+    printf("%-12s %10s %9s %9s %9s %9s %9s %9s\n", "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for(int k = 0; k < M_HISTOGRAM_NUMBER; ++k) {
+        char buf[32];
+        printf("%-12s %10llu %9s", histogram_names[k], (unsigned long long)delta.count[k],
+            format_ns(delta.count[k] ? (double)delta.sum[k] / delta.count[k] : 0, buf, sizeof(buf)));
+        for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+            printf(" %9s", format_ns(metrics::percentile(delta, (METRIC_HISTOGRAM)k, quantiles[q]), buf, sizeof(buf)));
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int interval = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "i:")) != -1) {
+        switch(opt) {
+            case 'i': interval = atoi(optarg); break;
+            default:
+                printf("usage: %s [-i seconds] port\n", basename(argv[0]));
+                return 1;
+        }
+    }
+    if(optind >= argc || interval < 0) {
+        printf("usage: %s [-i seconds] port\n", basename(argv[0]));
+        return 1;
+    }
+
+    char name[64];
+    metrics::shm_name(atoi(argv[optind]), name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd == -1) {
+        printf("找不到%s，服务器没有运行或者无法创建共享内存\n", name);
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(metrics::header)) {
+        printf("%s的大小不对\n", name);
+        return 1;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const metrics::header *h = (const metrics::header *)addr;
+    if(memcmp(h->magic, "TWSMETR1", 8) != 0 || h->block_size != sizeof(metrics::thread_block)
+        || st.st_size < (off_t)(sizeof(metrics::header) + (size_t)h->max_threads * h->block_size)) {
+        printf("%s不是这个版本的服务器导出的指标\n", name);
+        return 1;
+    }
+
+    metrics::snapshot *now = new metrics::snapshot;
+    metrics::snapshot *last = new metrics::snapshot;
+    metrics::snapshot *delta = new metrics::snapshot;
+    metrics::collect(h, *now);
+    if(interval == 0) {
+        long long up = (long long)time(NULL) - (long long)h->start_time;
+        printf("pid %d, up %llds\n", h->pid, up);
+        print(*now, *now, up > 0 ? up : 1);
+    } else {
+        while(true) {
+            metrics::snapshot *t = last;
+            last = now;
+            now = t;
+            sleep(interval);
+            metrics::collect(h, *now);
+            diff(*now, last, *delta);
+            print(*now, *delta, interval);
+            printf("\n");
+            fflush(stdout);
+        }
+    }
+    munmap(addr, st.st_size);
+    delete now;
+    delete last;
+    delete delta;
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef VALIDATORS_H
+#define VALIDATORS_H
+#include <stdio.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// 一个文件版本的缓存验证器，在文件放入缓存时生成一次，之后的应答直接复制
+struct file_validators {
+    char etag[64];          // 强ETag，带引号，由inode、大小和纳秒精度的修改时间组成
+    char last_modified[32]; // HTTP日期格式的修改时间
+    char headers[128];      // "ETag: ...\r\nLast-Modified: ...\r\n"，200和304应答都会带上
+    int headers_len;
+};
+
+inline void make_validators(const struct stat &st, file_validators &v) {
+    unsigned long long mtime = (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    snprintf(v.etag, sizeof(v.etag), "\"%lx-%llx-%llx\"",
+        (unsigned long)st.st_ino, (unsigned long long)st.st_size, mtime);
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(v.last_modified, sizeof(v.last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    v.headers_len = snprintf(v.headers, sizeof(v.headers), "ETag: %s\r\nLast-Modified: %s\r\n",
+        v.etag, v.last_modified);
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <stdint.h>
+#include <atomic>
+#include <exception>
+
+/*
+    Chase-Lev工作窃取双端队列（固定容量版本）
+    只有所属的工作线程可以调用push和pop，在底部操作，不需要原子的读改写；
+    其他空闲的工作线程调用steal从顶部窃取任务，只在争抢最后一个任务时才需要CAS。
+    内存序参考 Lê 等人的 "Correct and Efficient Work-Stealing for Weak Memory Models"。
+    槽位本身不是原子的：窃取者读到的槽位如果同时被所属线程覆盖，说明top已经前进，
+    窃取者随后的CAS一定失败，读到的值会被丢弃，因此任务可以是任意可复制的结构体。
+*/
+template<typename E>
+class ws_deque {
+public:
+    explicit ws_deque(int capacity) : m_buffer(NULL), m_mask(0), m_top(0), m_bottom(0) {
+        if(capacity <= 0) {
+            throw std::exception();
+        }
+        // 容量向上取整为2的幂
+        int64_t size = 2;
+        while(size < capacity) {
+            size <<= 1;
+        }
+        m_buffer = new E[size];
+        m_mask = size - 1;
+    }
+
+    ~ws_deque() {
+        delete[] m_buffer;
+    }
+
+    // 所属线程在底部压入任务，队列满时返回false
+    bool push(E item) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if(b - t > m_mask) {
+            return false;
+        }
+        m_buffer[b & m_mask] = item;
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // 所属线程从底部弹出任务，后进先出，缓存更热
+    bool pop(E &item) {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if(t > b) {
+            // 队列为空
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        item = m_buffer[b & m_mask];
+        if(t == b) {
+            // 只剩最后一个任务，和窃取者竞争
+            bool won = m_top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // 其他线程从顶部窃取任务，失败（队列为空或竞争失败）返回false
+    bool steal(E &item) {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b) {
+            return false;
+        }
+        item = m_buffer[t & m_mask];
+        return m_top.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // 队列是否为空（并发下只是近似值）
+    bool empty() {
+        return m_top.load(std::memory_order_acquire) >= m_bottom.load(std::memory_order_acquire);
+    }
+
+private:
+    E *m_buffer;
+    int64_t m_mask;
+    // 窃取者只修改top，所属线程只修改bottom，放在不同的缓存行
+    alignas(64) std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+};
+
+#endif